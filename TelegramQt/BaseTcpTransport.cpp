@@ -20,14 +20,43 @@
 #include "CompatibilityLayer.hpp"
 #include "Crypto/AesCtr.hpp"
 #include "Debug_p.hpp"
+#include "RandomGenerator.hpp"
 #include "RawStream.hpp"
 
 #include <QHostAddress>
 #include <QLoggingCategory>
+#include <QtEndian>
+
+#include <zlib.h>
 
 Q_LOGGING_CATEGORY(c_loggingTcpTransport, "telegram.transport.tcp", QtWarningMsg)
 
 static const quint32 c_defaultConnectionTimeout = 15 * 1000;
+static const quint32 c_fullFrameOverhead = 12; // length + packet number + CRC32
+// The abridged framing can not encode more than (2^24 - 1) * 4 bytes; use the same limit for all framings
+static const quint32 c_maxFrameLength = 64 * 1024 * 1024;
+
+/*
+  Returns the length of the MTProto packet in a padded intermediate frame.
+  The padding is not a part of the packet, so its length is derived from the packet header.
+*/
+static int getUnpaddedLength(const char *frame, int frameLength)
+{
+    // auth_key_id (8 bytes) + msg_key (16 bytes) + encrypted data (a multiple of 16 bytes)
+    static const int c_encryptedPrefixLength = 24;
+    // auth_key_id (8 bytes) + message_id (8 bytes) + message_data_length (4 bytes)
+    static const int c_plainPrefixLength = 20;
+    if (frameLength < c_encryptedPrefixLength) {
+        // An error code (a negative 32-bit integer)
+        return qMin(frameLength, 4);
+    }
+    const uchar *data = reinterpret_cast<const uchar*>(frame);
+    if (qFromLittleEndian<quint64>(data)) {
+        return c_encryptedPrefixLength + ((frameLength - c_encryptedPrefixLength) & ~15);
+    }
+    const quint32 messageLength = qFromLittleEndian<quint32>(data + c_plainPrefixLength - 4);
+    return static_cast<int>(qMin<quint32>(c_plainPrefixLength + messageLength, static_cast<quint32>(frameLength)));
+}
 
 namespace Telegram {
 
@@ -73,6 +102,7 @@ void BaseTcpTransport::disconnectFromHost()
     }
     m_readBuffer.clear();
     m_packetNumber = 0;
+    m_receivedPacketNumber = 0;
     m_expectedLength = 0;
     m_sessionType = Unknown;
 }
@@ -86,11 +116,12 @@ void BaseTcpTransport::sendPacketImplementation(const QByteArray &payload)
 {
     qCDebug(c_loggingTcpTransport) << CALL_INFO << payload.size();
 
+    // Full version:
     // quint32 length (included length itself + packet number
     //                 + crc32 + payload (MUST be divisible by 4)
     // quint32 packet number
-    // quint32 CRC32 (length, quint32 packet number, payload)
     // Payload
+    // quint32 CRC32 (length, quint32 packet number, payload)
 
     // Abridged version:
     // quint8: 0xef
@@ -99,33 +130,116 @@ void BaseTcpTransport::sendPacketImplementation(const QByteArray &payload)
     //      (quint8: 0x7f, quint24: Packet length / 4)
     // Payload
 
+    // Intermediate version:
+    // quint32: 0xeeeeeeee
+    // quint32: Payload length
+    // Payload
+
+    // Padded intermediate version:
+    // quint32: 0xdddddddd
+    // quint32: Payload length + padding length
+    // Payload
+    // 0-15 random padding bytes
+
     if (payload.length() % 4) {
         qCCritical(c_loggingTcpTransport) << CALL_INFO
                                           << "Invalid outgoing packet! "
                                              "The payload size is not divisible by four!";
     }
 
-    QByteArray packet;
-    packet.reserve(payload.size() + 4);
-    const quint32 length = payload.length() / 4;
-    if (length < 0x7f) {
-        packet.append(char(length));
-    } else {
-        packet.append(char(0x7f));
-        packet.append(reinterpret_cast<const char *>(&length), 3);
+    int headerSize = 4;
+    int trailerSize = 0;
+    switch (m_framing) {
+    case Framing::Abridged:
+        headerSize = (payload.length() / 4) < 0x7f ? 1 : 4;
+        break;
+    case Framing::Intermediate:
+        break;
+    case Framing::PaddedIntermediate:
+        trailerSize = RandomGenerator::instance()->generate<quint8>() & 0xf;
+        break;
+    case Framing::Full:
+        headerSize = 8;
+        trailerSize = 4;
+        break;
+    }
+    const int packetSize = headerSize + payload.size() + trailerSize;
+
+    // Reuse the write buffer memory; reserve() also prevents the buffer from shrinking
+    if (m_writeBuffer.capacity() < packetSize) {
+        m_writeBuffer.reserve(packetSize);
+    }
+    m_writeBuffer.resize(packetSize);
+    char *packet = m_writeBuffer.data();
+    uchar *header = reinterpret_cast<uchar *>(packet);
+    char *trailer = packet + headerSize + payload.size();
+    switch (m_framing) {
+    case Framing::Abridged:
+    {
+        const quint32 length = payload.length() / 4;
+        if (headerSize == 1) {
+            packet[0] = char(length);
+        } else {
+            packet[0] = char(0x7f);
+            memcpy(packet + 1, &length, 3);
+        }
+    }
+        break;
+    case Framing::Intermediate:
+    case Framing::PaddedIntermediate:
+        qToLittleEndian<quint32>(static_cast<quint32>(payload.size() + trailerSize), header);
+        break;
+    case Framing::Full:
+        qToLittleEndian<quint32>(static_cast<quint32>(packetSize), header);
+        qToLittleEndian<quint32>(m_packetNumber, header + 4);
+        ++m_packetNumber;
+        break;
+    }
+    memcpy(packet + headerSize, payload.constData(), static_cast<size_t>(payload.size()));
+
+    if (m_framing == Framing::PaddedIntermediate) {
+        RandomGenerator::instance()->generate(trailer, trailerSize);
+    } else if (m_framing == Framing::Full) {
+        const quint32 crc = static_cast<quint32>(crc32(0, reinterpret_cast<const Bytef *>(packet),
+                                                       static_cast<uInt>(packetSize - trailerSize)));
+        qToLittleEndian<quint32>(crc, reinterpret_cast<uchar *>(trailer));
     }
-    packet.append(payload);
 
     if (m_writeAesContext && m_writeAesContext->hasKey()) {
-        packet = m_writeAesContext->crypt(packet);
+        m_writeAesContext->crypt(packet, packetSize);
     }
 
-    m_socket->write(packet);
+    m_socket->write(packet, packetSize);
 }
 
 void BaseTcpTransport::setSessionType(BaseTcpTransport::SessionType sessionType)
 {
     m_sessionType = sessionType;
+    switch (sessionType) {
+    case Abridged:
+        setFraming(Framing::Abridged);
+        break;
+    case FullSize:
+        setFraming(Framing::Full);
+        break;
+    case Intermediate:
+        setFraming(Framing::Intermediate);
+        break;
+    case PaddedIntermediate:
+        setFraming(Framing::PaddedIntermediate);
+        break;
+    case Unknown:
+    case Obfuscated:
+        break;
+    }
+}
+
+void BaseTcpTransport::setFraming(Framing framing)
+{
+    m_framing = framing;
+    m_packetNumber = 0;
+    m_receivedPacketNumber = 0;
+    m_expectedLength = 0;
 }
 
 void BaseTcpTransport::resetCryptoKeys()
@@ -179,6 +293,8 @@ void BaseTcpTransport::setState(QAbstractSocket::SocketState newState)
 {
     qCDebug(c_loggingTcpTransport) << CALL_INFO << newState;
     if (newState == QAbstractSocket::ConnectedState) {
+        m_packetNumber = 0;
+        m_receivedPacketNumber = 0;
         m_expectedLength = 0;
         setSessionType(Unknown);
     }
@@ -193,27 +309,82 @@ void BaseTcpTransport::onReadyRead()
         qCCritical(c_loggingTcpTransport) << this << "Unknown session type!";
         return;
     }
-    if (m_socket->bytesAvailable() > 0) {
-        QByteArray allData = m_socket->readAll();
-        if (m_readAesContext) {
-            allData = m_readAesContext->crypt(allData);
+    const qint64 bytesAvailable = m_socket->bytesAvailable();
+    if (bytesAvailable > 0) {
+        // Read and decrypt the data right in the free tail of the read buffer
+        char *tail = m_readBuffer.reserve(static_cast<int>(bytesAvailable));
+        const qint64 bytesRead = m_socket->read(tail, bytesAvailable);
+        if (bytesRead > 0) {
+            if (m_readAesContext) {
+                m_readAesContext->crypt(tail, static_cast<int>(bytesRead));
+            }
+            m_readBuffer.commit(static_cast<int>(bytesRead));
+        }
+    }
+    processReadBuffer();
+}
+
+/*!
+  Reads the frame header and sets m_expectedLength to the number of bytes
+  to wait for (the rest of the frame).
+
+  Returns false if the header is invalid.
+*/
+bool BaseTcpTransport::readFrameLength()
+{
+    const uchar *data = reinterpret_cast<const uchar*>(m_readBuffer.data());
+    switch (m_framing) {
+    case Framing::Abridged:
+    {
+        quint8 length_t1 = data[0];
+        if (length_t1 < 0x7fu) {
+            m_expectedLength = length_t1 * 4;
+            m_readBuffer.skip(1);
+        } else if (length_t1 == 0x7fu) {
+            m_expectedLength = data[1] + data[2] * 256 + data[3] * 256 * 256;
+            m_expectedLength *= 4;
+            m_readBuffer.skip(4);
+        } else {
+            qCWarning(c_loggingTcpTransport) << CALL_INFO << "Invalid packet size byte"
+                                             << TELEGRAMQT_HEX_SHOWBASE << length_t1;
+            return false;
+        }
+    }
+        return true;
+    case Framing::Intermediate:
+    case Framing::PaddedIntermediate:
+        // The most significant bit is the "quick ack" request flag
+        m_expectedLength = qFromLittleEndian<quint32>(data) & 0x7fffffffu;
+        if ((m_expectedLength > c_maxFrameLength)
+                || ((m_framing == Framing::Intermediate) && (m_expectedLength % 4))) {
+            qCWarning(c_loggingTcpTransport) << CALL_INFO << "Invalid packet length"
+                                             << m_expectedLength;
+            m_expectedLength = 0;
+            return false;
+        }
+        m_readBuffer.skip(4);
+        return true;
+    case Framing::Full:
+        // The length includes the length itself, the packet number and the CRC
+        // Keep the length in the buffer as it is covered by the CRC
+        m_expectedLength = qFromLittleEndian<quint32>(data);
+        if ((m_expectedLength < c_fullFrameOverhead) || (m_expectedLength > c_maxFrameLength)
+                || (m_expectedLength % 4)) {
+            qCWarning(c_loggingTcpTransport) << CALL_INFO << "Invalid packet length"
+                                             << m_expectedLength;
+            m_expectedLength = 0;
+            return false;
         }
-        m_readBuffer.append(allData);
+        return true;
     }
+    return false;
+}
+
+void BaseTcpTransport::processReadBuffer()
+{
     while (m_readBuffer.size() >= 4) {
         if (m_expectedLength == 0) {
-            const quint8 *data = reinterpret_cast<const quint8*>(m_readBuffer.constData());
-            quint8 length_t1 = data[0];
-            if (length_t1 < 0x7fu) {
-                m_expectedLength = length_t1 * 4;
-                m_readBuffer = m_readBuffer.mid(1);
-            } else if (length_t1 == 0x7fu) {
-                m_expectedLength = data[1] + data[2] * 256 + data[3] * 256 * 256;
-                m_expectedLength *= 4;
-                m_readBuffer = m_readBuffer.mid(4);
-            } else {
-                qCWarning(c_loggingTcpTransport) << CALL_INFO << "Invalid packet size byte"
-                                                 << TELEGRAMQT_HEX_SHOWBASE << length_t1;
+            if (!readFrameLength()) {
                 setError(QAbstractSocket::UnknownSocketError, QLatin1String("Invalid read operation"));
                 disconnectFromHost();
                 return;
@@ -225,12 +396,50 @@ void BaseTcpTransport::onReadyRead()
                                            << m_expectedLength << "bytes expected)";
             return;
         }
-        const QByteArray payload = m_readBuffer.left(static_cast<int>(m_expectedLength));
-        m_readBuffer = m_readBuffer.mid(static_cast<int>(m_expectedLength));
+        const int frameLength = static_cast<int>(m_expectedLength);
         m_expectedLength = 0;
+        int packetLength = frameLength;
+        int trailerLength = 0;
+        switch (m_framing) {
+        case Framing::Abridged:
+        case Framing::Intermediate:
+            break;
+        case Framing::PaddedIntermediate:
+            packetLength = getUnpaddedLength(m_readBuffer.data(), frameLength);
+            trailerLength = frameLength - packetLength;
+            break;
+        case Framing::Full:
+        {
+            const uchar *frame = reinterpret_cast<const uchar*>(m_readBuffer.data());
+            const quint32 packetNumber = qFromLittleEndian<quint32>(frame + 4);
+            const quint32 expectedCrc = qFromLittleEndian<quint32>(frame + frameLength - 4);
+            const quint32 crc = static_cast<quint32>(crc32(0, frame, static_cast<uInt>(frameLength - 4)));
+            if ((crc != expectedCrc) || (packetNumber != m_receivedPacketNumber)) {
+                qCWarning(c_loggingTcpTransport) << CALL_INFO << "Invalid packet"
+                                                 << "number:" << packetNumber
+                                                 << "expected:" << m_receivedPacketNumber
+                                                 << "crc valid:" << (crc == expectedCrc);
+                setError(QAbstractSocket::UnknownSocketError, QLatin1String("Invalid read operation"));
+                disconnectFromHost();
+                return;
+            }
+            ++m_receivedPacketNumber;
+            m_readBuffer.skip(8);
+            packetLength = frameLength - static_cast<int>(c_fullFrameOverhead);
+            trailerLength = 4;
+        }
+            break;
+        }
         qCDebug(c_loggingTcpTransport) << CALL_INFO
-                                       << "Received a packet (" << payload.size() << " bytes)";
+                                       << "Received a packet (" << packetLength << " bytes)";
+        // The payload references the read buffer memory and it is valid only during the emission
+        const QByteArray payload = m_readBuffer.slice(packetLength);
         emit packetReceived(payload);
+        if (m_readBuffer.size() < packetLength + trailerLength) {
+            // The buffer is reset (e.g. on disconnect from a packetReceived() handler)
+            return;
+        }
+        m_readBuffer.skip(packetLength + trailerLength);
     }
 }
 
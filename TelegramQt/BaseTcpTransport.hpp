@@ -19,6 +19,7 @@
 #define BASE_TCP_TRANSPORT_HPP
 
 #include "BaseTransport.hpp"
+#include "ReadBuffer.hpp"
 
 namespace Telegram {
 
@@ -37,9 +38,18 @@ public:
         Abridged, // char(0xef)
         FullSize,
         Obfuscated,
+        Intermediate, // 0xeeeeeeee
+        PaddedIntermediate, // 0xdddddddd
         Default = Unknown,
     };
     Q_ENUM(SessionType)
+    enum class Framing {
+        Abridged,
+        Intermediate,
+        PaddedIntermediate,
+        Full,
+    };
+    Q_ENUM(Framing)
     enum SourceRevertion {
         DirectIsWriteReversedIsRead,
         DirectIsReadReversedIsWrite,
@@ -55,6 +65,7 @@ public:
     void disconnectFromHost() override;
 
     SessionType sessionType() const;
+    Framing framing() const { return m_framing; }
 
 TELEGRAMQT_PROTECTED_SLOTS:
     void setState(QAbstractSocket::SocketState newState) override;
@@ -66,16 +77,24 @@ protected:
     void setSocket(QAbstractSocket *socket);
     void sendPacketImplementation(const QByteArray &payload) override;
 
+    void processReadBuffer();
+
+    // Obfuscated sessions carry one of the other framings; use setFraming() to select it
     void setSessionType(SessionType sessionType);
+    void setFraming(Framing framing);
+    bool readFrameLength();
     void resetCryptoKeys();
     void setCryptoKeysSourceData(const QByteArray &source, SourceRevertion revertion);
 
     quint32 m_packetNumber = 0;
+    quint32 m_receivedPacketNumber = 0;
     quint32 m_expectedLength = 0;
     SessionType m_sessionType = Unknown;
+    Framing m_framing = Framing::Abridged;
 
     QAbstractSocket *m_socket = nullptr;
-    QByteArray m_readBuffer;
+    ReadBuffer m_readBuffer;
+    QByteArray m_writeBuffer;
     Telegram::Crypto::AesCtrContext *m_readAesContext = nullptr;
     Telegram::Crypto::AesCtrContext *m_writeAesContext = nullptr;
 
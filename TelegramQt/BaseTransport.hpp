@@ -49,6 +49,7 @@ signals:
 
     void timeout();
 
+    // The payload may reference the transport read buffer, detach it to keep the data
     void packetReceived(const QByteArray &payload);
     void packetSent(const QByteArray &payload);
 
@@ -30,6 +30,10 @@
 #include "MTProto/Stream.hpp"
 
 #include <QLoggingCategory>
+#include <QSet>
+#include <QTimer>
+
+#include <cstring>
 
 Q_LOGGING_CATEGORY(c_clientRpcLayerCategory, "telegram.client.rpclayer", QtWarningMsg)
 Q_LOGGING_CATEGORY(c_clientRpcDumpPackageCategory, "telegram.client.rpclayer.dump", QtWarningMsg)
@@ -38,9 +42,23 @@ namespace Telegram {
 
 namespace Client {
 
+// https://core.telegram.org/mtproto/service_messages#simple-container
+static constexpr int c_containerItemsLimit = 1020;
+static constexpr int c_defaultMaxContainerMessages = 64;
+static constexpr int c_defaultMaxContainerSize = 32 * 1024;
+// Well above the file transfers in flight (4 files by 4 parts of 512 KiB)
+static constexpr int c_defaultMaxResendStoreSize = 32 * 1024 * 1024;
+
 RpcLayer::RpcLayer(QObject *parent) :
-    BaseRpcLayer(parent)
+    BaseRpcLayer(parent),
+    m_flushTimer(new QTimer(this)),
+    m_maxContainerMessages(c_defaultMaxContainerMessages),
+    m_maxContainerSize(c_defaultMaxContainerSize),
+    m_maxResendStoreSize(c_defaultMaxResendStoreSize)
 {
+    m_flushTimer->setSingleShot(true);
+    m_flushTimer->setInterval(m_containerLatency);
+    connect(m_flushTimer, &QTimer::timeout, this, &RpcLayer::flushSendQueue);
 }
 
 RpcLayer::~RpcLayer()
@@ -69,6 +87,39 @@ void RpcLayer::setServerSalt(quint64 serverSalt)
     m_serverSalt = serverSalt;
 }
 
+void RpcLayer::setMaxContainerMessages(int count)
+{
+    m_maxContainerMessages = qBound(1, count, c_containerItemsLimit);
+}
+
+void RpcLayer::setMaxContainerSize(int bytes)
+{
+    m_maxContainerSize = qMax(0, bytes);
+}
+
+/*!
+  Set the time (in msecs) an outgoing message can wait for other messages
+  to be packed into the same container. The default value 0 means that only
+  messages queued within the same event loop iteration are coalesced.
+*/
+void RpcLayer::setContainerLatency(int msecs)
+{
+    m_containerLatency = qMax(0, msecs);
+    m_flushTimer->setInterval(m_containerLatency);
+}
+
+/*!
+  Set the limit of the data size of the sent messages kept for resend.
+  The messages are released once acknowledged or answered. If the limit
+  is exceeded, the oldest sent messages are dropped and the corresponding
+  requests fail if the server asks to resend them.
+*/
+void RpcLayer::setMaxResendStoreSize(int bytes)
+{
+    m_maxResendStoreSize = qMax(0, bytes);
+    trimResendStore();
+}
+
 void RpcLayer::startNewSession()
 {
     m_sessionId = RandomGenerator::instance()->generate<quint64>();
@@ -115,6 +166,7 @@ bool RpcLayer::processMTProtoMessage(const MTProto::Message &message)
         TLPong pong;
         stream >> pong;
         PendingRpcOperation *op = m_operations.take(pong.msgId);
+        releaseMessage(pong.msgId);
         if (op) {
             op->setFinishedWithReplyData(message.data);
             result = true;
@@ -142,13 +194,28 @@ bool RpcLayer::processRpcResult(const MTProto::Message &message)
     quint64 messageId = 0;
     stream >> messageId;
     PendingRpcOperation *op = m_operations.take(messageId);
+    releaseMessage(messageId);
     if (!op) {
         qCWarning(c_clientRpcLayerCategory) << "processRpcQuery():"
                                             << "Unhandled RPC result for messageId"
                                             << TELEGRAMQT_HEX_SHOWBASE << messageId;
         return false;
     }
-    op->setFinishedWithReplyData(stream.readAll());
+    QByteArray replyData = stream.readAll();
+    if (TLValue::firstFromArray(replyData) == TLValue::GzipPacked) {
+        // Inflate with the connection zlib stream right away,
+        // so the reply is not copied again on the processing
+        QByteArray unpackedData;
+        if (!unpackGZipPacked(replyData, &unpackedData)) {
+            qCWarning(c_clientRpcLayerCategory) << CALL_INFO << "Unable to unpack gzip_packed reply for messageId"
+                                                << TELEGRAMQT_HEX_SHOWBASE << messageId;
+            op->setFinishedWithError({{PendingOperation::c_text(),
+                                       QStringLiteral("Unable to unpack the reply")}});
+            return false;
+        }
+        replyData = unpackedData;
+    }
+    op->setFinishedWithReplyData(replyData);
 #define DUMP_CLIENT_RPC_PACKETS
 #ifdef DUMP_CLIENT_RPC_PACKETS
     qCDebug(c_clientRpcLayerCategory) << "Client: Answer for message"
@@ -179,6 +246,15 @@ bool RpcLayer::processMessageAck(const MTProto::Message &message)
     stream >> idsVector;
     qCDebug(c_clientRpcLayerCategory) << "processMessageAck():" << idsVector;
 
+    // The acknowledged messages are received by the server and never need to be resent
+    for (const quint64 messageId : idsVector) {
+        const QVector<quint64> innerMessageIds = m_containers.value(messageId);
+        for (const quint64 innerMessageId : innerMessageIds) {
+            releaseMessage(innerMessageId);
+        }
+        releaseMessage(messageId);
+    }
+
     return true;
 }
 
@@ -211,21 +287,43 @@ bool RpcLayer::processIgnoredMessageNotification(const MTProto::Message &message
     MTProto::IgnoredMessageNotification notification(tlNotification);
     qCDebug(c_clientRpcLayerCategory) << CALL_INFO << notification.toString();
 
+    if (m_containers.contains(notification.messageId)) {
+        return resendContainer(notification.messageId, notification.errorCode);
+    }
+
     MTProto::Message *m = m_messages.value(notification.messageId);
     if (!m) {
+        if (m_operations.contains(notification.messageId)) {
+            // The message is dropped from the resend store; fail the operation
+            return resendIgnoredMessage(notification.messageId);
+        }
         qCWarning(c_clientRpcLayerCategory) << CALL_INFO
                                             << notification.toString() << "for unknown message id"
                                             << TELEGRAMQT_HEX_SHOWBASE << notification.messageId;
         return false;
     }
 
-    switch (notification.errorCode) {
+    if (!fixupIgnoredMessage(m, notification.errorCode)) {
+        qCWarning(c_clientRpcLayerCategory) << "Unhandled error:" << notification.toString();
+        return false;
+    }
+    return resendIgnoredMessage(notification.messageId);
+}
+
+/*
+    Prepare the ignored message for resend according to the notification error code.
+    Returns false if the error can not be fixed on the client side.
+ */
+bool RpcLayer::fixupIgnoredMessage(MTProto::Message *m, int errorCode)
+{
+    switch (errorCode) {
     case MTProto::IgnoredMessageNotification::IncorrectServerSalt:
         // We sync local serverSalt value in processDecryptedMessageHeader().
         // Resend message will automatically apply the new salt
-        return resendIgnoredMessage(notification.messageId);
+        return true;
     case MTProto::IgnoredMessageNotification::MessageIdTooOld:
-        return resendIgnoredMessage(notification.messageId);
+        // The message gets a new id on resend
+        return true;
     case MTProto::IgnoredMessageNotification::SequenceNumberTooHigh:
         qCDebug(c_clientRpcLayerCategory) << "processIgnoredMessageNotification(SequenceNumberTooHigh):"
                                              " reduce seq num"
@@ -233,7 +331,7 @@ bool RpcLayer::processIgnoredMessageNotification(const MTProto::Message &message
                                           << " from" << m->sequenceNumber
                                           << " to" << (m->sequenceNumber - 2);
         m->sequenceNumber -= 2;
-        return resendIgnoredMessage(notification.messageId);
+        return true;
     case MTProto::IgnoredMessageNotification::SequenceNumberTooLow:
         qCDebug(c_clientRpcLayerCategory) << "processIgnoredMessageNotification(SequenceNumberTooLow):"
                                              " increase seq num"
@@ -247,18 +345,15 @@ bool RpcLayer::processIgnoredMessageNotification(const MTProto::Message &message
             m_contentRelatedMessages = messageContentNumber + 1;
         }
     }
-        return resendIgnoredMessage(notification.messageId);
+        return true;
     case MTProto::IgnoredMessageNotification::IncorrectTwoLowerOrderMessageIdBits:
         qCCritical(c_clientRpcLayerCategory) << "How we ever managed to mess with"
                                                 " the lower messageId bytes?!";
         // Just resend the message. We regenerate message id, so it can help.
-        return resendIgnoredMessage(notification.messageId);
+        return true;
     default:
-        break;
+        return false;
     }
-
-    qCWarning(c_clientRpcLayerCategory) << "Unhandled error:" << notification.toString();
-    return false;
 }
 
 bool RpcLayer::processMessageHeader(const MTProto::FullMessageHeader &header)
@@ -309,19 +404,19 @@ quint64 RpcLayer::sendRpc(PendingRpcOperation *operation)
     // We have to add InitConnection here because
     // sendPackage() implementation is shared with server
     if (message->sequenceNumber == 1) {
-        message->setData(getInitConnection() + operation->requestData());
+        message->setData(packGZipIfBeneficial(getInitConnection() + operation->requestData()));
     } else {
-        message->setData(operation->requestData());
+        message->setData(packGZipIfBeneficial(operation->requestData()));
     }
     m_operations.insert(message->messageId, operation);
-    m_messages.insert(message->messageId, message);
-    sendPacket(*message);
+    storeMessage(message);
+    enqueueMessage(message);
     return message->messageId;
 }
 
 bool RpcLayer::resendIgnoredMessage(quint64 messageId)
 {
-    MTProto::Message *message = m_messages.take(messageId);
+    MTProto::Message *message = takeMessage(messageId);
     PendingRpcOperation *operation = m_operations.take(messageId);
     if (!operation) {
         qCCritical(c_clientRpcLayerCategory) << CALL_INFO
@@ -330,32 +425,240 @@ bool RpcLayer::resendIgnoredMessage(quint64 messageId)
         delete message;
         return false;
     }
+    if (!message) {
+        qCWarning(c_clientRpcLayerCategory) << CALL_INFO
+                                            << "The message to resend is dropped from the resend store"
+                                            << TELEGRAMQT_HEX_SHOWBASE << messageId;
+        operation->setFinishedWithError({{PendingOperation::c_text(),
+                                          QStringLiteral("Unable to resend the message")}});
+        return false;
+    }
     qCDebug(c_clientRpcLayerCategory) << "Resend message"
                                       << TELEGRAMQT_HEX_SHOWBASE << messageId
                                       << message->firstValue();
     message->messageId = m_sendHelper->newMessageId(SendMode::Client);
     m_operations.insert(message->messageId, operation);
-    m_messages.insert(message->messageId, message);
-    sendPacket(*message);
+    storeMessage(message);
+    enqueueMessage(message);
     emit operation->resent(messageId, message->messageId);
     return message->messageId;
 }
 
-void RpcLayer::acknowledgeMessages()
+/*
+    Resend the messages of the ignored container. The inner messages get new ids
+    (and the actual salt) on resend and the sequence numbers are fixed the same way
+    as for a single message. The container itself is recreated on the next flush.
+ */
+bool RpcLayer::resendContainer(quint64 containerId, int errorCode)
+{
+    const QVector<quint64> messageIds = m_containers.value(containerId);
+    QVector<quint64> messagesToResend;
+    messagesToResend.reserve(messageIds.count());
+    for (const quint64 messageId : messageIds) {
+        if (!m_operations.contains(messageId)) {
+            // Acknowledgements and already answered messages
+            continue;
+        }
+        MTProto::Message *message = m_messages.value(messageId);
+        if (message && !fixupIgnoredMessage(message, errorCode)) {
+            qCWarning(c_clientRpcLayerCategory) << CALL_INFO << "Unhandled error" << errorCode
+                                                << "for container" << TELEGRAMQT_HEX_SHOWBASE << containerId;
+            return false;
+        }
+        messagesToResend.append(messageId);
+    }
+    m_containers.remove(containerId);
+
+    bool result = true;
+    for (const quint64 messageId : messagesToResend) {
+        result = resendIgnoredMessage(messageId) && result;
+    }
+    return result;
+}
+
+MTProto::Message RpcLayer::createAckMessage()
 {
     MTProto::Stream outputStream(MTProto::Stream::WriteOnly);
-    QVector<quint64> idsVector = m_messagesToAck;
-    m_messagesToAck.clear();
     outputStream << TLValue::MsgsAck;
-    outputStream << idsVector;
+    outputStream << m_messagesToAck;
+    m_messagesToAck.clear();
 
-    MTProto::Message *message = new MTProto::Message();
-    message->messageId = m_sendHelper->newMessageId(SendMode::Client);
-    message->sequenceNumber = m_contentRelatedMessages * 2;
-    message->setData(outputStream.getData());
+    // Acknowledgements are never resent, so the message is not stored
+    MTProto::Message message;
+    message.messageId = m_sendHelper->newMessageId(SendMode::Client);
+    message.sequenceNumber = m_contentRelatedMessages * 2;
+    message.setData(outputStream.getData());
+    return message;
+}
 
+void RpcLayer::storeMessage(MTProto::Message *message)
+{
     m_messages.insert(message->messageId, message);
-    sendPacket(*message);
+    m_resendStoreSize += message->data.size();
+}
+
+MTProto::Message *RpcLayer::takeMessage(quint64 messageId)
+{
+    MTProto::Message *message = m_messages.take(messageId);
+    if (message) {
+        m_resendStoreSize -= message->data.size();
+    }
+
+    const quint64 containerId = m_messageContainers.take(messageId);
+    if (containerId) {
+        QHash<quint64, QVector<quint64>>::iterator it = m_containers.find(containerId);
+        if (it != m_containers.end()) {
+            it->removeOne(messageId);
+            if (it->isEmpty()) {
+                m_containers.erase(it);
+            }
+        }
+    }
+    return message;
+}
+
+void RpcLayer::releaseMessage(quint64 messageId)
+{
+    delete takeMessage(messageId);
+}
+
+void RpcLayer::trimResendStore()
+{
+    if (m_resendStoreSize <= m_maxResendStoreSize) {
+        return;
+    }
+    QSet<quint64> queuedMessages;
+    queuedMessages.reserve(m_sendQueue.count());
+    for (const quint64 messageId : m_sendQueue) {
+        queuedMessages.insert(messageId);
+    }
+
+    /* Drop the messages without a pending operation first, then the oldest ones.
+     * Message ids grow with time, so the map begins with the oldest messages. */
+    for (const bool dropPending : { false, true }) {
+        QMap<quint64, MTProto::Message*>::const_iterator it = m_messages.constBegin();
+        while ((m_resendStoreSize > m_maxResendStoreSize) && (it != m_messages.constEnd())) {
+            const quint64 messageId = it.key();
+            ++it;
+            if (queuedMessages.contains(messageId)) {
+                // Not sent yet
+                continue;
+            }
+            const PendingRpcOperation *operation = m_operations.value(messageId);
+            if (!dropPending && operation && !operation->isFinished()) {
+                continue;
+            }
+            qCDebug(c_clientRpcLayerCategory) << CALL_INFO << "Drop message"
+                                              << TELEGRAMQT_HEX_SHOWBASE << messageId
+                                              << "from the resend store";
+            releaseMessage(messageId);
+        }
+    }
+}
+
+void RpcLayer::enqueueMessage(const MTProto::Message *message)
+{
+    const int messageSize = MTProto::MessageHeader::headerLength + message->data.size();
+    if (!m_sendQueue.isEmpty()
+            && ((m_sendQueue.count() + 1 > m_maxContainerMessages) || (m_sendQueueSize + messageSize > m_maxContainerSize))) {
+        // Send the queued messages first to keep the container within the limits;
+        // a message bigger than the size limit is sent alone on the flush below
+        flushSendQueue();
+    }
+    m_sendQueue.append(message->messageId);
+    m_sendQueueSize += messageSize;
+    if ((m_sendQueue.count() >= m_maxContainerMessages) || (m_sendQueueSize >= m_maxContainerSize)) {
+        flushSendQueue();
+    } else {
+        scheduleFlush();
+    }
+}
+
+void RpcLayer::scheduleFlush()
+{
+    if (!m_flushTimer->isActive()) {
+        m_flushTimer->start();
+    }
+}
+
+void RpcLayer::flushSendQueue()
+{
+    m_flushTimer->stop();
+
+    QVector<const MTProto::Message *> messages;
+    messages.reserve(m_sendQueue.count() + 1);
+    int containerSize = 0;
+    for (const quint64 messageId : m_sendQueue) {
+        // The message can be already resent with a new id
+        const MTProto::Message *message = m_messages.value(messageId);
+        if (!message) {
+            continue;
+        }
+        messages.append(message);
+        containerSize += MTProto::MessageHeader::headerLength + message->data.size();
+    }
+    m_sendQueue.clear();
+    m_sendQueueSize = 0;
+
+    MTProto::Message ackMessage;
+    if (!m_messagesToAck.isEmpty() && (containerSize >= m_maxContainerSize)) {
+        // The container is full (or a single message is too big for a container);
+        // the acknowledgements go with the next flush
+        scheduleFlush();
+    } else if (!m_messagesToAck.isEmpty()) {
+        ackMessage = createAckMessage();
+        messages.append(&ackMessage);
+        containerSize += MTProto::MessageHeader::headerLength + ackMessage.data.size();
+    }
+
+    if (messages.isEmpty()) {
+        return;
+    }
+    if (messages.count() == 1) {
+        sendPacket(*messages.constFirst());
+        trimResendStore();
+        return;
+    }
+
+    // msg_container#73f1f8dc messages:vector<%Message> = MessageContainer;
+    // The container message id must be greater than the inner messages ids.
+    QByteArray containerData(static_cast<int>(sizeof(quint32) * 2) + containerSize, Qt::Uninitialized);
+    char *data = containerData.data();
+    const quint32 containerTypeId = TLValue::MsgContainer;
+    const quint32 itemsCount = static_cast<quint32>(messages.count());
+    memcpy(data, &containerTypeId, sizeof(containerTypeId));
+    data += sizeof(containerTypeId);
+    memcpy(data, &itemsCount, sizeof(itemsCount));
+    data += sizeof(itemsCount);
+
+    QVector<quint64> messageIds;
+    messageIds.reserve(messages.count());
+    for (const MTProto::Message *message : messages) {
+        message->writeTo(data);
+        data += MTProto::MessageHeader::headerLength;
+        memcpy(data, message->data.constData(), static_cast<size_t>(message->data.size()));
+        data += message->data.size();
+        if (message != &ackMessage) {
+            messageIds.append(message->messageId);
+        }
+    }
+
+    MTProto::Message container;
+    container.messageId = m_sendHelper->newMessageId(SendMode::Client);
+    container.sequenceNumber = m_contentRelatedMessages * 2;
+    container.setData(containerData);
+    if (!messageIds.isEmpty()) {
+        m_containers.insert(container.messageId, messageIds);
+        for (const quint64 messageId : messageIds) {
+            m_messageContainers.insert(messageId, container.messageId);
+        }
+    }
+
+    qCDebug(c_clientRpcLayerCategory) << CALL_INFO << "Send container"
+                                      << TELEGRAMQT_HEX_SHOWBASE << container.messageId
+                                      << "with" << itemsCount << "messages";
+    sendPacket(container);
+    trimResendStore();
 }
 
 void RpcLayer::onConnectionLost(const QVariantHash &details)
@@ -366,8 +669,16 @@ void RpcLayer::onConnectionLost(const QVariantHash &details)
         }
     }
     m_operations.clear();
+    m_flushTimer->stop();
+    m_sendQueue.clear();
+    m_sendQueueSize = 0;
+    // The acknowledgements refer to the messages of the lost session
+    m_messagesToAck.clear();
+    m_containers.clear();
+    m_messageContainers.clear();
     qDeleteAll(m_messages);
     m_messages.clear();
+    m_resendStoreSize = 0;
 }
 
 QByteArray RpcLayer::getInitConnection() const
@@ -393,14 +704,9 @@ QByteArray RpcLayer::getInitConnection() const
 
 void RpcLayer::addMessageToAck(quint64 messageId)
 {
-    if (m_messagesToAck.isEmpty()) {
-#if QT_VERSION < QT_VERSION_CHECK(5, 10, 0)
-        QMetaObject::invokeMethod(this, "acknowledgeMessages", Qt::QueuedConnection);
-#else
-        QMetaObject::invokeMethod(this, &RpcLayer::acknowledgeMessages, Qt::QueuedConnection);
-#endif
-    }
+    // The acknowledgements go with the next outgoing container
     m_messagesToAck.append(messageId);
+    scheduleFlush();
 }
 
 } // Client namespace
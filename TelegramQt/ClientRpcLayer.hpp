@@ -21,8 +21,11 @@
 #include "RpcLayer.hpp"
 
 #include <QHash>
+#include <QMap>
 #include <QVector>
 
+QT_FORWARD_DECLARE_CLASS(QTimer)
+
 class CTelegramStream;
 
 namespace Telegram {
@@ -40,7 +43,7 @@ class AuthOperation;
 class PendingRpcOperation;
 class UpdatesInternalApi;
 
-class RpcLayer : public Telegram::BaseRpcLayer
+class TELEGRAMQT_INTERNAL_EXPORT RpcLayer : public Telegram::BaseRpcLayer
 {
     Q_OBJECT
 public:
@@ -70,10 +73,23 @@ public:
     quint64 sendRpc(PendingRpcOperation *operation);
     bool resendIgnoredMessage(quint64 messageId);
 
+    // Outgoing messages are coalesced into a msg_container
+    int maxContainerMessages() const { return m_maxContainerMessages; }
+    void setMaxContainerMessages(int count);
+    int maxContainerSize() const { return m_maxContainerSize; }
+    void setMaxContainerSize(int bytes);
+    int containerLatency() const { return m_containerLatency; }
+    void setContainerLatency(int msecs);
+
+    // Sent messages are kept for resend until acknowledged or answered
+    int maxResendStoreSize() const { return m_maxResendStoreSize; }
+    void setMaxResendStoreSize(int bytes);
+    int resendStoreSize() const { return m_resendStoreSize; }
+
     void onConnectionLost(const QVariantHash &details) override;
 
 protected Q_SLOTS:
-    void acknowledgeMessages();
+    void flushSendQueue();
 
 protected:
     bool processMessageHeader(const MTProto::FullMessageHeader &header) override;
@@ -86,15 +102,36 @@ protected:
     QByteArray getInitConnection() const;
 
     void addMessageToAck(quint64 messageId);
+    void enqueueMessage(const MTProto::Message *message);
+    void scheduleFlush();
+    MTProto::Message createAckMessage();
+    bool resendContainer(quint64 containerId, int errorCode);
+    bool fixupIgnoredMessage(MTProto::Message *m, int errorCode);
+
+    void storeMessage(MTProto::Message *message);
+    MTProto::Message *takeMessage(quint64 messageId);
+    void releaseMessage(quint64 messageId);
+    void trimResendStore();
 
     AppInformation *m_appInfo = nullptr;
     UpdatesInternalApi *m_UpdatesInternalApi = nullptr;
     AuthOperation *m_pendingAuthOperation = nullptr;
     QHash<quint64, PendingRpcOperation*> m_operations; // request message id, operation
-    QHash<quint64, MTProto::Message*> m_messages; // request message id to MTProto::Message
+    QMap<quint64, MTProto::Message*> m_messages; // request message id to MTProto::Message (the resend store)
     quint64 m_sessionId = 0;
     quint64 m_serverSalt = 0;
     QVector<quint64> m_messagesToAck;
+
+    QTimer *m_flushTimer = nullptr;
+    QVector<quint64> m_sendQueue; // ids of messages to send on the next flush
+    QHash<quint64, QVector<quint64>> m_containers; // container message id to inner message ids
+    QHash<quint64, quint64> m_messageContainers; // inner message id to container message id
+    int m_sendQueueSize = 0;
+    int m_maxContainerMessages;
+    int m_maxContainerSize;
+    int m_containerLatency = 0;
+    int m_resendStoreSize = 0; // Total size of the stored messages data
+    int m_maxResendStoreSize;
 };
 
 } // Client namespace
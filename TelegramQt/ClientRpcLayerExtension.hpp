@@ -51,9 +51,17 @@ public:
     template <typename TLType>
     bool processReply(PendingRpcOperation *operation, TLType *output);
 
+    // Same as processReply(), but the decoded bytes values refer to the operation reply data
+    // (if possible) instead of being copied. The results must not outlive the operation.
+    template <typename TLType>
+    bool processSharedReply(PendingRpcOperation *operation, TLType *output);
+
     void prepareReplyStream(MTProto::Stream *stream, PendingRpcOperation *operation);
 
 protected:
+    template <typename TLType>
+    bool readReply(MTProto::Stream *stream, TLType *output);
+
     void processRpcCall(PendingRpcOperation *operation);
     RpcProcessingMethod m_processingMethod = nullptr;
 
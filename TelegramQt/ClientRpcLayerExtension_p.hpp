@@ -22,6 +22,7 @@
 
 #include "MTProto/Stream.hpp"
 #include "PendingOperation.hpp"
+#include "PendingRpcOperation.hpp"
 
 #ifdef DEVELOPER_BUILD
 #include "MTProto/TLTypesDebug.hpp"
@@ -42,18 +43,36 @@ namespace Telegram {
 namespace Client {
 
 template <typename TLType>
-bool BaseRpcLayerExtension::processReply(PendingRpcOperation *operation, TLType *output)
+bool BaseRpcLayerExtension::readReply(MTProto::Stream *stream, TLType *output)
 {
-    MTProto::Stream stream;
-    prepareReplyStream(&stream, operation);
-
-    stream >> *output;
-    const TLValue v = TLValue::firstFromArray(stream.getData());
+    *stream >> *output;
+    const TLValue v = TLValue::firstFromArray(stream->getData());
     qCDebug(c_clientRpcDumpPackageCategory) << Q_FUNC_INFO << v;
 #ifdef DEVELOPER_BUILD
     qCDebug(c_clientRpcDumpPackageCategory) << *output;
 #endif
-    return !stream.error();
+    return !stream->error();
+}
+
+template <typename TLType>
+bool BaseRpcLayerExtension::processReply(PendingRpcOperation *operation, TLType *output)
+{
+    MTProto::Stream stream;
+    prepareReplyStream(&stream, operation);
+    return readReply(&stream, output);
+}
+
+template <typename TLType>
+bool BaseRpcLayerExtension::processSharedReply(PendingRpcOperation *operation, TLType *output)
+{
+    MTProto::Stream stream;
+    prepareReplyStream(&stream, operation);
+    // The stream data is a local copy if the reply was unpacked, so it is
+    // safe to share only the data that is owned by the operation.
+    if (stream.getData().constData() == operation->replyData().constData()) {
+        stream.setSharedBytes(true);
+    }
+    return readReply(&stream, output);
 }
 
 } // Client namespace
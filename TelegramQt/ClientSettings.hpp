@@ -21,6 +21,9 @@ public:
         None,
         Abridged,
         Obfuscated,
+        Intermediate,
+        PaddedIntermediate,
+        FullSize,
     };
     Q_ENUM(SessionType)
 
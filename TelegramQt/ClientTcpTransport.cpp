@@ -36,6 +36,7 @@ Q_LOGGING_CATEGORY(c_loggingTranport, "telegram.client.transport", QtWarningMsg)
 
 static const quint8 c_abridgedVersionByte = 0xef;
 static const quint32 c_intermediateVersionBytes = 0xeeeeeeeeu;
+static const quint32 c_paddedIntermediateVersionBytes = 0xddddddddu;
 static const quint32 c_obfucsatedProcotolIdentifier = 0xefefefefu;
 
 TcpTransport::TcpTransport(QObject *parent) :
@@ -84,6 +85,7 @@ void TcpTransport::startObfuscatedSession()
     // prepare random part
     const QVector<quint32> headerFirstWordBlackList = {
         0x44414548u, 0x54534f50u, 0x20544547u, 0x20544547u, c_intermediateVersionBytes,
+        c_paddedIntermediateVersionBytes,
     };
     const QVector<quint32> headerSecondWordBlackList = {
         0x0,
@@ -121,6 +123,7 @@ void TcpTransport::startObfuscatedSession()
     QByteArray encrypted = m_writeAesContext->crypt(raw.getData());
     m_socket->write(encrypted.mid(56, 8));
     setSessionType(Obfuscated);
+    setFraming(Framing::Abridged);
 }
 
 void TcpTransport::startAbridgedSession()
@@ -130,6 +133,23 @@ void TcpTransport::startAbridgedSession()
     setSessionType(Abridged);
 }
 
+void TcpTransport::startIntermediateSession(bool padded)
+{
+    qCDebug(c_loggingTranport) << "Start the session in Intermediate format, padded:" << padded;
+    RawStream raw(RawStream::WriteOnly);
+    raw << (padded ? c_paddedIntermediateVersionBytes : c_intermediateVersionBytes);
+    m_socket->write(raw.getData());
+    setSessionType(padded ? PaddedIntermediate : Intermediate);
+}
+
+void TcpTransport::startFullSizeSession()
+{
+    // The full format has no session header; the server recognizes it by the zero
+    // packet number in the second word of the first packet.
+    qCDebug(c_loggingTranport) << "Start the session in Full format";
+    setSessionType(FullSize);
+}
+
 bool TcpTransport::setProxy(const QNetworkProxy &proxy)
 {
     if (m_socket->isOpen()) {
@@ -180,6 +200,15 @@ void TcpTransport::writeEvent()
     case Abridged:
         startAbridgedSession();
         break;
+    case Intermediate:
+        startIntermediateSession(/* padded */ false);
+        break;
+    case PaddedIntermediate:
+        startIntermediateSession(/* padded */ true);
+        break;
+    case FullSize:
+        startFullSizeSession();
+        break;
     default:
         qCCritical(c_loggingTranport) << CALL_INFO
                                       << "The selected session type"
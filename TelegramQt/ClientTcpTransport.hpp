@@ -40,6 +40,8 @@ public:
 
     void startObfuscatedSession();
     void startAbridgedSession();
+    void startIntermediateSession(bool padded);
+    void startFullSizeSession();
     bool setProxy(const QNetworkProxy &proxy);
 
 protected:
@@ -390,13 +390,8 @@ ConnectOperation *ConnectionApiPrivate::connectToExtraDc(const ConnectionSpec &c
             conn->rpcLayer()->startNewSession();
         } else {
             if (!m_exportedAuthorizations.contains(connectionSpec.dcId)) {
-                AuthRpcLayer::PendingAuthExportedAuthorization *rpcOperation = nullptr;
-                rpcOperation = backend()->authLayer()->exportAuthorization(connectionSpec.dcId);
-                rpcOperation->setObjectName(rpcOperation->objectName()
-                                            + QStringLiteral("/dc%1").arg(connectionSpec.dcId));
-                rpcOperation->connectToFinished(this, &ConnectionApiPrivate::onRpcExportAuthorizationResult,
-                                                connectionSpec.dcId,
-                                                rpcOperation);
+                // All the extra connections to the DC wait for the same export
+                ensureDcHasAuthentication(connectionSpec.dcId);
             }
 
             // if has exported authentication
@@ -449,6 +444,15 @@ Connection *ConnectionApiPrivate::createConnection(const DcOption &dcOption)
     case Settings::SessionType::Obfuscated:
         transport->setPreferedSessionType(TcpTransport::Obfuscated);
         break;
+    case Settings::SessionType::Intermediate:
+        transport->setPreferedSessionType(TcpTransport::Intermediate);
+        break;
+    case Settings::SessionType::PaddedIntermediate:
+        transport->setPreferedSessionType(TcpTransport::PaddedIntermediate);
+        break;
+    case Settings::SessionType::FullSize:
+        transport->setPreferedSessionType(TcpTransport::FullSize);
+        break;
     }
     connection->setTransport(transport);
 
@@ -502,6 +506,10 @@ PendingOperation *ConnectionApiPrivate::getAuthentication(quint32 dcId)
 
 PendingOperation *ConnectionApiPrivate::ensureDcHasAuthentication(quint32 dcId)
 {
+    PendingOperation *pendingExport = m_pendingAuthExports.value(dcId);
+    if (pendingExport) {
+        return pendingExport;
+    }
     AuthRpcLayer::PendingAuthExportedAuthorization *rpcOperation = nullptr;
     rpcOperation = backend()->authLayer()->exportAuthorization(dcId);
     rpcOperation->setObjectName(rpcOperation->objectName()
@@ -509,6 +517,7 @@ PendingOperation *ConnectionApiPrivate::ensureDcHasAuthentication(quint32 dcId)
     rpcOperation->connectToFinished(this, &ConnectionApiPrivate::onRpcExportAuthorizationResult,
                                     dcId,
                                     rpcOperation);
+    m_pendingAuthExports.insert(dcId, rpcOperation);
     return rpcOperation;
 }
 
@@ -797,6 +806,9 @@ void ConnectionApiPrivate::onAllDcOptionsTried()
 
 void ConnectionApiPrivate::onRpcExportAuthorizationResult(quint32 dcId, BasePendingRpcResult *rpcOperation)
 {
+    if (m_pendingAuthExports.value(dcId) == rpcOperation) {
+        m_pendingAuthExports.remove(dcId);
+    }
     if (rpcOperation->isFailed()) {
         qCCritical(lcConnectionApi) << CALL_INFO
                                     << "TODO: Implement 'op failed' case" << rpcOperation->errorDetails();
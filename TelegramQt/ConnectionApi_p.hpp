@@ -118,6 +118,7 @@ protected:
     PingOperation *m_pingOperation = nullptr;
 
     QHash<quint32, QByteArray> m_exportedAuthorizations; // dc, data
+    QHash<quint32, PendingOperation *> m_pendingAuthExports; // dc, the export in progress
 
     ConnectionApi::Status m_status = ConnectionApi::StatusDisconnected;
     QVector<DcOption> m_serverConfiguration;
@@ -4,39 +4,67 @@
 
 #include <QLoggingCategory>
 
+#include <cstring>
+
 namespace Telegram {
 
 namespace Crypto {
 
 QByteArray aesDecrypt(const QByteArray &data, const AesKey &key)
 {
-    if (data.length() % AES_BLOCK_SIZE) {
-        qCritical() << __func__ << "Data is not padded (size %" << AES_BLOCK_SIZE << "!= 0)";
+    QByteArray result(data.size(), Qt::Uninitialized);
+    if (!aesDecrypt(data.constData(), result.data(), data.size(), key)) {
         return QByteArray();
     }
-    QByteArray result = data;
-    QByteArray initVector = key.iv;
-    AES_KEY dec_key;
-    AES_set_decrypt_key((const uchar *) key.key.constData(), key.key.length() * 8, &dec_key);
-    AES_ige_encrypt((const uchar *) data.constData(), (uchar *) result.data(), data.length(),
-                    &dec_key, (uchar *) initVector.data(), AES_DECRYPT);
     return result;
 }
 
 QByteArray aesEncrypt(const QByteArray &data, const AesKey &key)
 {
-    if (data.length() % AES_BLOCK_SIZE) {
+    QByteArray result(data.size(), Qt::Uninitialized);
+    if (!aesEncrypt(data.constData(), result.data(), data.size(), key)) {
+        return QByteArray();
+    }
+    return result;
+}
+
+bool aesDecrypt(const char *input, char *output, int size, const AesKey &key)
+{
+    if (size % AES_BLOCK_SIZE) {
+        qCritical() << __func__ << "Data is not padded (size %" << AES_BLOCK_SIZE << "!= 0)";
+        return false;
+    }
+    if (key.iv.size() != AES_BLOCK_SIZE * 2) {
+        qCritical() << __func__ << "Invalid IV size" << key.iv.size();
+        return false;
+    }
+    uchar initVector[AES_BLOCK_SIZE * 2];
+    std::memcpy(initVector, key.iv.constData(), sizeof(initVector));
+    AES_KEY dec_key;
+    AES_set_decrypt_key((const uchar *) key.key.constData(), key.key.length() * 8, &dec_key);
+    AES_ige_encrypt((const uchar *) input, (uchar *) output, static_cast<size_t>(size),
+                    &dec_key, initVector, AES_DECRYPT);
+    return true;
+}
+
+bool aesEncrypt(const char *input, char *output, int size, const AesKey &key)
+{
+    if (size % AES_BLOCK_SIZE) {
         qCritical() << __func__ << "Data is not padded "
                                    "(the size %" << AES_BLOCK_SIZE << " is not zero)";
-        return QByteArray();
+        return false;
     }
-    QByteArray result = data;
-    QByteArray initVector = key.iv;
+    if (key.iv.size() != AES_BLOCK_SIZE * 2) {
+        qCritical() << __func__ << "Invalid IV size" << key.iv.size();
+        return false;
+    }
+    uchar initVector[AES_BLOCK_SIZE * 2];
+    std::memcpy(initVector, key.iv.constData(), sizeof(initVector));
     AES_KEY enc_key;
     AES_set_encrypt_key((const uchar *) key.key.constData(), key.key.length() * 8, &enc_key);
-    AES_ige_encrypt((const uchar *) data.constData(), (uchar *) result.data(), data.length(),
-                    &enc_key, (uchar *) initVector.data(), AES_ENCRYPT);
-    return result;
+    AES_ige_encrypt((const uchar *) input, (uchar *) output, static_cast<size_t>(size),
+                    &enc_key, initVector, AES_ENCRYPT);
+    return true;
 }
 
 } // Crypto
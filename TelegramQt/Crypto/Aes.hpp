@@ -46,6 +46,10 @@ struct TELEGRAMQT_INTERNAL_EXPORT AesKey {
 TELEGRAMQT_INTERNAL_EXPORT QByteArray aesDecrypt(const QByteArray &data, const AesKey &key);
 TELEGRAMQT_INTERNAL_EXPORT QByteArray aesEncrypt(const QByteArray &data, const AesKey &key);
 
+// The input and output can point to the same memory to process the data in place
+TELEGRAMQT_INTERNAL_EXPORT bool aesDecrypt(const char *input, char *output, int size, const AesKey &key);
+TELEGRAMQT_INTERNAL_EXPORT bool aesEncrypt(const char *input, char *output, int size, const AesKey &key);
+
 } // Crypto namespace
 
 } // Telegram namespace
@@ -17,24 +17,73 @@
 
 #include "AesCtr.hpp"
 
-#include <openssl/aes.h>
-extern "C" {
-#include <openssl/modes.h>
-}
+#include <openssl/evp.h>
 
 #include <QLoggingCategory>
 
+#include <cstring>
+
 Q_LOGGING_CATEGORY(c_categoryCryptoAesCtr, "telegram.crypto.aes-ctr", QtWarningMsg)
 
 namespace Telegram {
 
 namespace Crypto {
 
+// The number of counter blocks encrypted at once.
+// EVP processes several independent blocks in parallel (e.g. with AES-NI).
+static constexpr int c_keystreamBlocks = 32;
+
+static void incrementCounter(uchar *counter)
+{
+    // The counter is a 128-bit big-endian number (see OpenSSL CRYPTO_ctr128_encrypt())
+    for (int i = AesCtrContext::IvecSize - 1; i >= 0; --i) {
+        if (++counter[i]) {
+            break;
+        }
+    }
+}
+
 AesCtrContext::AesCtrContext()
 {
     m_ecount = QByteArray(EcountSize, char(0));
 }
 
+AesCtrContext::AesCtrContext(const AesCtrContext &context) :
+    m_key(context.m_key),
+    m_ivec(context.m_ivec),
+    m_ecount(context.m_ecount),
+    m_num(context.m_num),
+    m_description(context.m_description)
+{
+    if (context.hasKey()) {
+        setupCipherContext();
+    }
+}
+
+AesCtrContext::~AesCtrContext()
+{
+    EVP_CIPHER_CTX_free(m_cipherContext);
+}
+
+AesCtrContext &AesCtrContext::operator=(const AesCtrContext &context)
+{
+    if (this == &context) {
+        return *this;
+    }
+    m_key = context.m_key;
+    m_ivec = context.m_ivec;
+    m_ecount = context.m_ecount;
+    m_num = context.m_num;
+    m_description = context.m_description;
+    if (context.hasKey()) {
+        setupCipherContext();
+    } else {
+        EVP_CIPHER_CTX_free(m_cipherContext);
+        m_cipherContext = nullptr;
+    }
+    return *this;
+}
+
 bool AesCtrContext::setKey(const QByteArray &key)
 {
     if (key.size() != KeySize) {
@@ -42,7 +91,7 @@ bool AesCtrContext::setKey(const QByteArray &key)
         return false;
     }
     m_key = key;
-    return true;
+    return setupCipherContext();
 }
 
 bool AesCtrContext::setIVec(const QByteArray &iv)
@@ -67,31 +116,85 @@ QByteArray AesCtrContext::crypt(const QByteArray &in)
 bool AesCtrContext::crypt(const QByteArray &in, QByteArray *out)
 {
     out->resize(in.size());
-    union {
-        char *ivecData;
-        unsigned char *ivecSsl[16];
-    };
-    ivecData = m_ivec.data();
-    union {
-        char *ecountData;
-        unsigned char *ecountSsl[16];
-    };
-    ecountData = m_ecount.data();
+    return crypt(in.constData(), out->data(), in.size());
+}
+
+bool AesCtrContext::crypt(char *data, int size)
+{
+    return crypt(data, data, size);
+}
 
+bool AesCtrContext::crypt(const char *in, char *out, int size)
+{
+    if (!m_cipherContext) {
+        qCCritical(c_categoryCryptoAesCtr) << "AesCtrContext::crypt(): The key is not set!";
+        return false;
+    }
 #ifdef TELEGRAM_DEBUG_CRYPTO
-    qCDebug(c_categoryCryptoAesCtr).noquote() << QStringLiteral("Crypt 0x%1 (%2) bytes on ").arg(in.size(), 4, 16, QLatin1Char('0')).arg(in.size()) << m_description << "context" << this;
+    qCDebug(c_categoryCryptoAesCtr).noquote() << QStringLiteral("Crypt 0x%1 (%2) bytes on ").arg(size, 4, 16, QLatin1Char('0')).arg(size) << m_description << "context" << this;
     qCDebug(c_categoryCryptoAesCtr) << "Key:" << m_key.toHex() << "Ivec:" << m_ivec.toHex() << "Ecount:" << m_ecount.toHex();
+    qCDebug(c_categoryCryptoAesCtr) << "in:" << QByteArray(in, size).toHex();
+    const char *outData = out;
+    const int outSize = size;
 #endif // TELEGRAM_DEBUG_CRYPTO
-    AES_KEY aes;
-    AES_set_encrypt_key(reinterpret_cast<const unsigned char*>(m_key.constData()), 256, &aes);
-    CRYPTO_ctr128_encrypt(reinterpret_cast<const uchar*>(in.constData()), reinterpret_cast<uchar*>(out->data()), in.size(), &aes, *ivecSsl, *ecountSsl, &m_num, (block128_f) AES_encrypt);
+    uchar *ivec = reinterpret_cast<uchar *>(m_ivec.data());
+    uchar *ecount = reinterpret_cast<uchar *>(m_ecount.data());
+
+    // Use the rest of the previously generated keystream block
+    while (m_num && size) {
+        *out++ = *in++ ^ static_cast<char>(ecount[m_num]);
+        --size;
+        m_num = (m_num + 1) % EcountSize;
+    }
+
+    uchar counters[c_keystreamBlocks * IvecSize];
+    uchar keystream[c_keystreamBlocks * IvecSize];
+    while (size > 0) {
+        const int blocks = qMin((size + IvecSize - 1) / IvecSize, c_keystreamBlocks);
+        for (int i = 0; i < blocks; ++i) {
+            std::memcpy(counters + i * IvecSize, ivec, IvecSize);
+            incrementCounter(ivec);
+        }
+        int keystreamSize = 0;
+        if (!EVP_EncryptUpdate(m_cipherContext, keystream, &keystreamSize, counters, blocks * IvecSize)) {
+            qCCritical(c_categoryCryptoAesCtr) << "AesCtrContext::crypt(): Unable to encrypt";
+            return false;
+        }
+        const int bytes = qMin(size, keystreamSize);
+        for (int i = 0; i < bytes; ++i) {
+            out[i] = in[i] ^ static_cast<char>(keystream[i]);
+        }
+        in += bytes;
+        out += bytes;
+        size -= bytes;
+        // Keep the last keystream block for the next call
+        std::memcpy(ecount, keystream + keystreamSize - EcountSize, EcountSize);
+        m_num = bytes % EcountSize;
+    }
 #ifdef TELEGRAM_DEBUG_CRYPTO
-    qCDebug(c_categoryCryptoAesCtr) << "in:" << in.toHex();
-    qCDebug(c_categoryCryptoAesCtr) << "out:" << out->toHex();
+    qCDebug(c_categoryCryptoAesCtr) << "out:" << QByteArray(outData, outSize).toHex();
 #endif
     return true;
 }
 
+bool AesCtrContext::setupCipherContext()
+{
+    if (!m_cipherContext) {
+        m_cipherContext = EVP_CIPHER_CTX_new();
+    }
+    // The counter mode is implemented on top of ECB, so the state (ivec, ecount and num)
+    // is under our control, while the key schedule is expanded only once.
+    if (!EVP_EncryptInit_ex(m_cipherContext, EVP_aes_256_ecb(), nullptr,
+                            reinterpret_cast<const uchar *>(m_key.constData()), nullptr)) {
+        qCCritical(c_categoryCryptoAesCtr) << "AesCtrContext::setKey(): Unable to init the cipher";
+        EVP_CIPHER_CTX_free(m_cipherContext);
+        m_cipherContext = nullptr;
+        return false;
+    }
+    EVP_CIPHER_CTX_set_padding(m_cipherContext, 0);
+    return true;
+}
+
 } // Crypto
 
 } // Telegram
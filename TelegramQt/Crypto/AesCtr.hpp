@@ -22,6 +22,8 @@
 
 #include <QByteArray>
 
+struct evp_cipher_ctx_st;
+
 namespace Telegram {
 
 namespace Crypto {
@@ -30,6 +32,11 @@ class TELEGRAMQT_INTERNAL_EXPORT AesCtrContext
 {
 public:
     explicit AesCtrContext();
+    AesCtrContext(const AesCtrContext &context);
+    ~AesCtrContext();
+
+    AesCtrContext &operator=(const AesCtrContext &context);
+
     static constexpr int KeySize = 32;
     static constexpr int IvecSize = 16;
     static constexpr int EcountSize = 16;
@@ -40,17 +47,23 @@ public:
     QByteArray ivec() const { return m_ivec; }
     bool setIVec(const QByteArray &iv);
 
-    bool hasKey() const { return !m_key.isEmpty(); }
+    bool hasKey() const { return m_cipherContext != nullptr; }
 
     QByteArray ecount() const { return m_ecount; }
     quint32 num() const { return m_num; }
 
     QByteArray crypt(const QByteArray &in);
     bool crypt(const QByteArray &in, QByteArray *out);
+    bool crypt(char *data, int size);
 
     // The context description is needed only for debug
     void setDescription(const QByteArray &desc) { m_description = desc; }
 protected:
+    bool crypt(const char *in, char *out, int size);
+    bool setupCipherContext();
+
+    // The expanded key schedule, prepared once on setKey()
+    evp_cipher_ctx_st *m_cipherContext = nullptr;
     QByteArray m_key;
     QByteArray m_ivec;
     QByteArray m_ecount;
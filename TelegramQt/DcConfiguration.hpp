@@ -22,18 +22,20 @@ struct ConnectionSpec
     Q_DECLARE_FLAGS(RequestFlags, RequestFlag)
 
     ConnectionSpec() = default;
-    explicit ConnectionSpec(quint32 id, RequestFlags f = RequestFlags()) :
+    explicit ConnectionSpec(quint32 id, RequestFlags f = RequestFlags(), quint32 connectionIndex = 0) :
         dcId(id),
-        flags(f)
+        flags(f),
+        index(connectionIndex)
     {
     }
     bool operator==(const ConnectionSpec &spec) const
     {
-        return spec.dcId == dcId && spec.flags == flags;
+        return spec.dcId == dcId && spec.flags == flags && spec.index == index;
     }
 
     quint32 dcId = 0;
     RequestFlags flags;
+    quint32 index = 0; // Distinguishes extra connections with the same dcId and flags
 };
 
 struct TELEGRAMQT_INTERNAL_EXPORT DcConfiguration
@@ -58,7 +60,9 @@ struct TELEGRAMQT_INTERNAL_EXPORT DcConfiguration
 
 inline uint qHash(const ConnectionSpec &key, uint seed = 0)
 {
-    return ::qHash(static_cast<uint>(key.dcId | (static_cast<quint32>(key.flags) << 20)), seed);
+    return ::qHash(static_cast<uint>(key.dcId
+                                     | (static_cast<quint32>(key.flags) << 20)
+                                     | (key.index << 26)), seed);
 }
 
 } // Telegram namespace
@@ -23,13 +23,30 @@
 #include "MTProto/TLTypesDebug.hpp"
 #endif
 
-#include <QCryptographicHash>
 #include <QLoggingCategory>
 
 namespace Telegram {
 
 namespace Client {
 
+// Double the download chunk size on faster requests and halve it on slower ones
+static constexpr qint64 c_chunkGrowthThresholdMs = 1000;
+static constexpr qint64 c_chunkShrinkThresholdMs = 4000;
+static constexpr quint32 c_unknownSizeDownloadPartSize = 128 * 1024;
+static constexpr quint32 c_largeFileDownloadPartSize = 128 * 1024;
+static constexpr quint32 c_minUploadPartSize = 128 * 1024;
+static constexpr quint32 c_maxUploadPartSize = 512 * 1024;
+static constexpr quint32 c_maxUploadParts = 4000;
+
+static quint32 floorPowerOfTwo(quint32 value)
+{
+    quint32 result = 1;
+    while (result <= value / 2) {
+        result *= 2;
+    }
+    return result;
+}
+
 FileRequestDescriptor FileRequestDescriptor::downloadRequest(quint32 dcId, const TLInputFileLocation &inputLocation, quint32 size)
 {
     FileRequestDescriptor result;
@@ -37,21 +54,19 @@ FileRequestDescriptor FileRequestDescriptor::downloadRequest(quint32 dcId, const
     result.m_dcId = dcId;
     result.m_inputLocation = inputLocation;
     result.m_size = size;
+    result.m_chunkSize = initialDownloadPartSize(size);
+    result.m_adaptiveChunkSize = true;
     return result;
 }
 
-FileRequestDescriptor FileRequestDescriptor::uploadRequest(const QByteArray &data, const QString &fileName, quint32 dcId)
+FileRequestDescriptor FileRequestDescriptor::uploadRequest(quint32 size, const QString &fileName, quint32 dcId)
 {
     FileRequestDescriptor result;
     result.m_type = Upload;
     result.m_dcId = dcId;
-    result.m_data = data;
-    result.m_size = data.size();
+    result.m_size = size;
     result.m_fileName = fileName;
-
-    if (!result.isBigFile()) {
-        result.m_hash = new QCryptographicHash(QCryptographicHash::Md5);
-    }
+    result.m_chunkSize = uploadPartSize(size);
 
     RandomGenerator::instance()->generate(&result.m_fileId);
 
@@ -81,7 +96,7 @@ TLInputFile FileRequestDescriptor::inputFile() const
         file.tlType = TLValue::InputFileBig;
     } else {
         file.tlType = TLValue::InputFile;
-//        file.md5Checksum = QString::fromLatin1(md5Sum().toHex());
+        file.md5Checksum = QString::fromLatin1(md5Sum().toHex());
     }
 
     file.id = m_fileId;
@@ -117,27 +132,12 @@ bool FileRequestDescriptor::finished() const
 
 void FileRequestDescriptor::bumpPart()
 {
-    if (m_hash) {
-        m_hash->addData(data());
-    }
-
     ++m_part;
     m_offset = m_part * chunkSize();
 
     if (m_offset > m_size) {
         m_offset = m_size;
     }
-
-    if (m_hash && finished()) {
-        m_md5Sum = m_hash->result();
-        delete m_hash;
-        m_hash = 0;
-    }
-}
-
-QByteArray FileRequestDescriptor::data() const
-{
-    return m_data.mid(m_part * chunkSize(), chunkSize());
 }
 
 quint32 FileRequestDescriptor::chunkSize() const
@@ -155,11 +155,106 @@ void FileRequestDescriptor::setChunkSize(quint32 size)
         qCritical() << "Requested chunk size is not valid";
     }
     m_chunkSize = size;
+    m_adaptiveChunkSize = false;
+}
+
+/*
+    Returns the limit for a getFile request at the given offset.
+
+    The server expects the offset and the limit to be 1024-aligned, the limit
+    to be a divisor of 1 MiB and the chunk to not cross a 1 MiB boundary.
+    Limit the power-of-two chunk size to the largest one the offset is
+    aligned to, so the offsets stay valid while the chunk size changes.
+*/
+quint32 FileRequestDescriptor::chunkSizeAt(quint32 offset) const
+{
+    quint32 result = chunkSize();
+    while ((result > minDownloadPartSize()) && (offset % result)) {
+        result /= 2;
+    }
+    return result;
+}
+
+/*
+    Adjusts the download chunk size on a getFile request finished.
+
+    The elapsed time includes both the round-trip and the transfer time,
+    so a fast request means that the latency dominates and a bigger chunk
+    saves round-trips, while a slow one means a poor throughput and a
+    smaller chunk keeps the progress (and a possible retry) granular.
+*/
+void FileRequestDescriptor::updateChunkSize(quint32 limit, quint32 receivedBytes, qint64 elapsedMs)
+{
+    if (!m_adaptiveChunkSize) {
+        return;
+    }
+    if (limit != m_chunkSize) {
+        // The request was made with an outdated or an offset-limited chunk size
+        return;
+    }
+    if (elapsedMs < c_chunkGrowthThresholdMs) {
+        if (receivedBytes < limit) {
+            // The end of the file; nothing to measure
+            return;
+        }
+        if ((m_size == 0) || (m_offset < m_size)) {
+            m_chunkSize = qMin(m_chunkSize * 2, maxDownloadPartSize());
+        }
+    } else if (elapsedMs > c_chunkShrinkThresholdMs) {
+        m_chunkSize = qMax(m_chunkSize / 2, minDownloadPartSize());
+    }
 }
 
 quint32 FileRequestDescriptor::defaultDownloadPartSize()
 {
-    return 1024 * 32; // Set chunkSize to some big number to get the whole avatar at once
+    return 1024 * 32;
+}
+
+quint32 FileRequestDescriptor::minDownloadPartSize()
+{
+    return 1024 * 4;
+}
+
+quint32 FileRequestDescriptor::maxDownloadPartSize()
+{
+    return 1024 * 512;
+}
+
+/*
+    Files up to the max part size (e.g. avatars) are requested at once;
+    larger files start with a moderate chunk to grow it on a fast link.
+*/
+quint32 FileRequestDescriptor::initialDownloadPartSize(quint32 fileSize)
+{
+    if (!fileSize) {
+        return c_unknownSizeDownloadPartSize;
+    }
+    if (fileSize > maxDownloadPartSize()) {
+        return c_largeFileDownloadPartSize;
+    }
+    if (fileSize <= minDownloadPartSize()) {
+        return minDownloadPartSize();
+    }
+    const quint32 result = floorPowerOfTwo(fileSize);
+    return result == fileSize ? result : result * 2;
+}
+
+/*
+    The part size must be a divisor of 512 KiB; use the smallest one that
+    keeps the number of parts within the server limit.
+*/
+quint32 FileRequestDescriptor::uploadPartSize(quint32 fileSize)
+{
+    quint32 result = c_minUploadPartSize;
+    while ((result < c_maxUploadPartSize) && (fileSize / result >= c_maxUploadParts)) {
+        result *= 2;
+    }
+    return result;
+}
+
+quint32 FileRequestDescriptor::maxUploadFileSize()
+{
+    return c_maxUploadParts * c_maxUploadPartSize;
 }
 
 } // Client namespace
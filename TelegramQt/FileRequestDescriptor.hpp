@@ -24,8 +24,6 @@
 #include <QByteArray>
 #include <QString>
 
-QT_FORWARD_DECLARE_CLASS(QCryptographicHash)
-
 namespace Telegram {
 
 namespace Client {
@@ -42,7 +40,7 @@ public:
     FileRequestDescriptor() = default;
 
     static FileRequestDescriptor downloadRequest(quint32 dcId, const TLInputFileLocation &inputLocation, quint32 size);
-    static FileRequestDescriptor uploadRequest(const QByteArray &data, const QString &fileName, quint32 dcId);
+    static FileRequestDescriptor uploadRequest(quint32 size, const QString &fileName, quint32 dcId);
 
     Type type() const { return m_type; }
     void setType(Type type) { m_type = type; }
@@ -67,27 +65,33 @@ public:
     quint32 part() const { return m_part; }
     quint32 parts() const;
     QByteArray md5Sum() const { return m_md5Sum; }
+    void setMd5Sum(const QByteArray &md5Sum) { m_md5Sum = md5Sum; }
     quint64 fileId() const { return m_fileId; }
 
     bool isBigFile() const;
     bool finished() const;
     void bumpPart();
 
-    QByteArray data() const;
-
     quint32 chunkSize() const;
     void setChunkSize(quint32 size);
 
+    /* Download stuff */
+    quint32 chunkSizeAt(quint32 offset) const;
+    void updateChunkSize(quint32 limit, quint32 receivedBytes, qint64 elapsedMs);
+
     QString uniqueId;
 
     static quint32 defaultDownloadPartSize();
+    static quint32 minDownloadPartSize();
+    static quint32 maxDownloadPartSize();
+    static quint32 initialDownloadPartSize(quint32 fileSize);
+    static quint32 uploadPartSize(quint32 fileSize);
+    static quint32 maxUploadFileSize();
 
 protected:
     TLInputFileLocation m_inputLocation;
-    QByteArray m_data;
     QByteArray m_md5Sum;
     QString m_fileName;
-    QCryptographicHash *m_hash = nullptr;
     quint64 m_fileId = 0;
     quint32 m_size = 0;
     quint32 m_offset = 0;
@@ -95,6 +99,7 @@ protected:
     quint32 m_chunkSize = 0;
     quint32 m_dcId = 0;
     Type m_type = Invalid;
+    bool m_adaptiveChunkSize = false;
 };
 
 } // Client namespace
@@ -11,7 +11,8 @@
 #include "Operations/FileOperation_p.hpp"
 #include "RpcLayers/ClientRpcUploadLayer.hpp"
 
-#include <QIODevice>
+#include <QBuffer>
+#include <QFile>
 #include <QLoggingCategory>
 #include <QTimer>
 
@@ -21,6 +22,10 @@ namespace Telegram {
 
 namespace Client {
 
+static constexpr int c_maxParallelFiles = 4;
+static constexpr int c_maxChunkRequestsPerFile = 4;
+static constexpr quint32 c_mediaConnectionsPerDc = 2;
+
 FilesApiPrivate::FilesApiPrivate(FilesApi *parent) :
     ClientApiPrivate(parent)
 {
@@ -82,14 +87,46 @@ FileOperation *FilesApiPrivate::downloadFile(const FileInfo *file, QIODevice *ou
 
 FileOperation *FilesApiPrivate::uploadFile(const QByteArray &fileContent, const QString &fileName)
 {
-    return PendingOperation::failOperation<FileOperation>
-            (QLatin1String("Not implemented"), this);
+    QBuffer *buffer = new QBuffer();
+    buffer->setData(fileContent);
+    buffer->open(QIODevice::ReadOnly);
+    FileOperation *operation = uploadFile(buffer, fileName);
+    buffer->setParent(operation);
+    return operation;
 }
 
+/* Upload FileOperation reads the source device part by part from its current
+ * position to the end, so the device must stay valid until the operation is finished.
+ * The uploaded file is available as the operation fileInfo().
+ */
 FileOperation *FilesApiPrivate::uploadFile(QIODevice *source, const QString &fileName)
 {
-    return PendingOperation::failOperation<FileOperation>
-            (QLatin1String("Not implemented"), this);
+    if (!source || !source->isReadable()) {
+        return PendingOperation::failOperation<FileOperation>
+                (QLatin1String("Unable to upload a file: the source device is not readable"), this);
+    }
+    if (source->isSequential()) {
+        return PendingOperation::failOperation<FileOperation>
+                (QLatin1String("Unable to upload a file: sequential devices are not supported"), this);
+    }
+    const qint64 size = source->size() - source->pos();
+    if (size <= 0) {
+        return PendingOperation::failOperation<FileOperation>
+                (QLatin1String("Unable to upload a file: the file is empty"), this);
+    }
+    if (size > FileRequestDescriptor::maxUploadFileSize()) {
+        return PendingOperation::failOperation<FileOperation>
+                (QLatin1String("Unable to upload a file: the file is too big"), this);
+    }
+    Connection *mainConnection = ConnectionApiPrivate::get(backend()->connectionApi())->mainConnection();
+    if (!mainConnection) {
+        return PendingOperation::failOperation<FileOperation>
+                (QLatin1String("Unable to upload a file: not connected"), this);
+    }
+
+    const quint32 dcId = mainConnection->dcOption().id;
+    const FileRequestDescriptor descriptor = FileRequestDescriptor::uploadRequest(static_cast<quint32>(size), fileName, dcId);
+    return addFileRequest(descriptor, source);
 }
 
 FileOperation *FilesApiPrivate::addFileRequest(const FileRequestDescriptor &descriptor, QIODevice *device)
@@ -109,25 +146,183 @@ FileOperation *FilesApiPrivate::addFileRequest(const FileRequestDescriptor &desc
     FileOperation *operation = new FileOperation(this);
     FileOperationPrivate *privOperation = FileOperationPrivate::get(operation);
     privOperation->m_descriptor = descriptor;
+    privOperation->m_transferStatus = FileOperationPrivate::TransferStatus::WaitingForItsTurn;
     privOperation->ensureDeviceIsSet(device);
-    m_fileRequests.enqueue(operation);
+    // The caller owns the operation and can delete it at any time
+    connect(operation, &QObject::destroyed, this, [this, operation]() {
+        onFileOperationDestroyed(operation);
+    });
 
-    if (!m_currentOperation) {
-        processNextRequest();
+    if (descriptor.type() == FileRequestDescriptor::Download) {
+        privOperation->m_cacheKey = MediaCache::getKey(descriptor.dcId(), descriptor.inputLocation());
+        if (readFromCache(operation) || joinPendingDownload(operation)) {
+            return operation;
+        }
     }
 
+    m_fileRequests.enqueue(operation);
+
+    processNextRequests();
+
     return operation;
 }
 
+bool FilesApiPrivate::readFromCache(FileOperation *operation)
+{
+    FileOperationPrivate *privOperation = FileOperationPrivate::get(operation);
+    QFile *file = m_mediaCache.openFile(privOperation->m_cacheKey);
+    if (!file) {
+        return false;
+    }
+    qCDebug(lcFilesApi) << __func__ << operation << privOperation->m_cacheKey;
+
+    privOperation->prepareForDownload();
+    const bool succeeded = privOperation->writeFromDevice(file);
+    delete file;
+    privOperation->m_transferStatus = FileOperationPrivate::TransferStatus::Finished;
+    if (!succeeded) {
+        m_mediaCache.remove(privOperation->m_cacheKey);
+        operation->setDelayedFinishedWithError({{ PendingOperation::c_text(), QLatin1String("Unable to read the cached file") }});
+        return true;
+    }
+    privOperation->m_descriptor.setSize(privOperation->m_totalTransferredBytes);
+    const QString mimeType = m_mediaCache.mimeType(privOperation->m_cacheKey);
+    if (!mimeType.isEmpty() && privOperation->m_fileInfo) {
+        FileInfo::Private::get(privOperation->m_fileInfo)->setMimeType(mimeType);
+    }
+    privOperation->finalizeDownload();
+    operation->finishLater();
+    return true;
+}
+
+/*
+    Concurrent requests of the same file share a single download as long as
+    no data is received yet. The first request of the file becomes the leader:
+    it transfers the data, writes the cache file and finishes the followers.
+ */
+bool FilesApiPrivate::joinPendingDownload(FileOperation *operation)
+{
+    FileOperationPrivate *privOperation = FileOperationPrivate::get(operation);
+    const QString &key = privOperation->m_cacheKey;
+    if (key.isEmpty()) {
+        return false;
+    }
+
+    FileOperation *download = m_downloadsByKey.value(key);
+    if (!download) {
+        m_downloadsByKey.insert(key, operation);
+        // Connect before the caller gets the operation to finish the followers ahead of the caller slots
+        operation->connectToFinished(this, &FilesApiPrivate::completeDownload, operation);
+        return false;
+    }
+
+    FileOperationPrivate *privDownload = FileOperationPrivate::get(download);
+    if (privDownload->m_totalTransferredBytes) {
+        // The operation downloads the file on its own (and leaves the cache to the leader)
+        return false;
+    }
+    qCDebug(lcFilesApi) << __func__ << operation << "joins" << download;
+    privOperation->prepareForDownload();
+    privDownload->m_followers.append(operation);
+
+    const QPointer<FileOperation> follower = operation;
+    connect(download, &QObject::destroyed, this, [this, follower]() {
+        if (follower) {
+            onDownloadLeaderDestroyed(follower);
+        }
+    });
+    return true;
+}
+
+/*
+    The leader download is deleted by its caller before it finished.
+    The follower takes over the download if it has not received any data yet;
+    otherwise the data written to its device can not be restarted and it fails.
+ */
+void FilesApiPrivate::onDownloadLeaderDestroyed(FileOperation *follower)
+{
+    if (follower->isFinished()) {
+        return;
+    }
+    FileOperationPrivate *privFollower = FileOperationPrivate::get(follower);
+    if (privFollower->m_totalTransferredBytes) {
+        qCDebug(lcFilesApi) << __func__ << follower << "fails";
+        privFollower->m_transferStatus = FileOperationPrivate::TransferStatus::Finished;
+        follower->setFinishedWithError({{ PendingOperation::c_text(), QLatin1String("The shared download is deleted") }});
+        return;
+    }
+
+    qCDebug(lcFilesApi) << __func__ << follower << "restarts the download";
+    privFollower->m_transferStatus = FileOperationPrivate::TransferStatus::WaitingForItsTurn;
+    if (joinPendingDownload(follower)) {
+        return;
+    }
+    m_fileRequests.enqueue(follower);
+    processNextRequests();
+}
+
+void FilesApiPrivate::onFileOperationDestroyed(FileOperation *operation)
+{
+    m_fileRequests.removeAll(operation);
+    if (m_activeOperations.removeOne(operation)) {
+        processNextRequests();
+    }
+}
+
+void FilesApiPrivate::completeDownload(FileOperation *operation)
+{
+    FileOperationPrivate *privOperation = FileOperationPrivate::get(operation);
+    const QString &key = privOperation->m_cacheKey;
+    if (m_downloadsByKey.value(key) == operation) {
+        m_downloadsByKey.remove(key);
+    }
+
+    if (privOperation->m_cacheFile) {
+        if (operation->isSucceeded()) {
+            QString mimeType;
+            if (privOperation->m_fileInfo) {
+                mimeType = FileInfo::Private::get(privOperation->m_fileInfo)->m_mimeType;
+            }
+            m_mediaCache.commitWrite(key, privOperation->m_cacheFile, mimeType);
+        } else {
+            m_mediaCache.cancelWrite(privOperation->m_cacheFile);
+        }
+        privOperation->m_cacheFile = nullptr;
+    }
+
+    const QVector<QPointer<FileOperation>> followers = privOperation->m_followers;
+    privOperation->m_followers.clear();
+    for (FileOperation *follower : followers) {
+        if (!follower || follower->isFinished()) {
+            continue;
+        }
+        FileOperationPrivate *privFollower = FileOperationPrivate::get(follower);
+        privFollower->m_transferStatus = FileOperationPrivate::TransferStatus::Finished;
+        if (!operation->isSucceeded()) {
+            follower->setFinishedWithError(operation->errorDetails());
+            continue;
+        }
+        privFollower->m_descriptor.setSize(privOperation->m_descriptor.size());
+        if (privOperation->m_fileInfo && privFollower->m_fileInfo) {
+            const QString mimeType = FileInfo::Private::get(privOperation->m_fileInfo)->m_mimeType;
+            FileInfo::Private::get(privFollower->m_fileInfo)->setMimeType(mimeType);
+        }
+        privFollower->finalizeDownload();
+        follower->setFinished();
+    }
+}
+
 void FilesApiPrivate::dumpCurrentState() const
 {
-    if (m_currentOperation) {
-        qCInfo(lcFilesApi) << "Current operation:" << m_currentOperation;
-        const FileOperationPrivate *privOperation = FileOperationPrivate::get(m_currentOperation);
-        qCInfo(lcFilesApi) << "  Child:" << privOperation->m_childOperation;
+    if (m_activeOperations.isEmpty()) {
+        qCInfo(lcFilesApi) << "No active operations";
+    }
+    for (FileOperation *operation : m_activeOperations) {
+        qCInfo(lcFilesApi) << "Active operation:" << operation;
+        const FileOperationPrivate *privOperation = FileOperationPrivate::get(operation);
         qCInfo(lcFilesApi) << "  Status:" << privOperation->m_transferStatus;
-    } else {
-        qCInfo(lcFilesApi) << "No current operation";
+        qCInfo(lcFilesApi) << "  Chunks in flight:" << privOperation->m_chunksInFlight
+                           << "out of order:" << privOperation->m_pendingChunks.count();
     }
     if (m_fileRequests.isEmpty()) {
         qCInfo(lcFilesApi) << "No file requests in queue";
@@ -136,108 +331,177 @@ void FilesApiPrivate::dumpCurrentState() const
     }
 }
 
-void FilesApiPrivate::processNextRequest()
+void FilesApiPrivate::processNextRequests()
 {
-    if (m_fileRequests.isEmpty()) {
-        m_currentOperation = nullptr;
-        return;
+    while (!m_fileRequests.isEmpty() && (m_activeOperations.count() < c_maxParallelFiles)) {
+        startOperation(m_fileRequests.dequeue());
     }
+}
 
-    m_currentOperation = m_fileRequests.dequeue();
-    connect(m_currentOperation, &FileOperation::finished,
+void FilesApiPrivate::startOperation(FileOperation *operation)
+{
+    qCDebug(lcFilesApi) << __func__ << operation;
+    m_activeOperations.append(operation);
+    connect(operation, &FileOperation::finished,
             this, &FilesApiPrivate::onFileOperationFinished);
 
-    qCDebug(lcFilesApi) << __func__ << "Current operation:" << m_currentOperation;
-    FileOperationPrivate *privOperation = FileOperationPrivate::get(m_currentOperation);
-    privOperation->prepareForDownload();
+    FileOperationPrivate *privOperation = FileOperationPrivate::get(operation);
+    if (privOperation->m_descriptor.type() == FileRequestDescriptor::Upload) {
+        privOperation->prepareForUpload();
+    } else {
+        privOperation->prepareForDownload();
+        if (m_downloadsByKey.value(privOperation->m_cacheKey) == operation) {
+            // A duplicate request (refused to join a download in progress) does not write the cache
+            privOperation->m_cacheFile = m_mediaCache.beginWrite(privOperation->m_cacheKey);
+        }
+    }
+    privOperation->m_transferStatus = FileOperationPrivate::TransferStatus::WaitingForConnection;
 
-    processCurrentRequest();
+    const quint32 dcId = privOperation->dcId();
+    if (getReadyConnections(dcId).isEmpty()) {
+        connectToDc(dcId);
+    } else {
+        requestChunks(operation);
+    }
 }
 
-void FilesApiPrivate::processCurrentRequest()
+void FilesApiPrivate::connectToDc(quint32 dcId)
 {
-    qCDebug(lcFilesApi) << __func__;
-    FileOperationPrivate *privOperation = FileOperationPrivate::get(m_currentOperation);
-    ConnectOperation *connectionOperation = ensureConnection(privOperation->dcId());
-    privOperation->m_childOperation = connectionOperation;
-
-    if (connectionOperation->isFinished()) {
-        onConnectOperationFinished(connectionOperation);
-    } else {
-        connectionOperation->connectToFinished(this, &FilesApiPrivate::onConnectOperationFinished,
-                                     connectionOperation);
+    for (quint32 i = 0; i < c_mediaConnectionsPerDc; ++i) {
+        ConnectOperation *connectionOperation = ensureConnection(dcId, i);
+        if (m_connectOperations.contains(connectionOperation)) {
+            continue;
+        }
+        if (connectionOperation->isFinished()) {
+            onConnectOperationFinished(dcId, connectionOperation);
+        } else {
+            m_connectOperations.insert(connectionOperation);
+            connectionOperation->connectToFinished(this, &FilesApiPrivate::onConnectOperationFinished,
+                                                   dcId, connectionOperation);
+            // The connection API deletes the operation if the connection is lost on the way
+            connect(connectionOperation, &QObject::destroyed, this, [this, connectionOperation]() {
+                m_connectOperations.remove(connectionOperation);
+            });
+        }
     }
 }
 
 bool FilesApiPrivate::isConnectionNeeded(quint32 dcId) const
 {
-    if (m_currentOperation) {
-        const FileOperationPrivate *privOperation = FileOperationPrivate::get(m_currentOperation);
+    for (const FileOperation *operation : m_activeOperations) {
+        const FileOperationPrivate *privOperation = FileOperationPrivate::get(operation);
         if (privOperation->dcId() == dcId) {
             return true;
         }
     }
 
-// Wanted to parallel operations:
-//    for (const FileOperation *operation : m_fileRequests) {
-//        const FileOperationPrivate *privOperation = FileOperationPrivate::get(operation);
-//        if (privOperation->dcId() == dcId) {
-//            return true;
-//        }
-//    }
-
     return false;
 }
 
-ConnectOperation *FilesApiPrivate::ensureConnection(quint32 dcId)
+ConnectOperation *FilesApiPrivate::ensureConnection(quint32 dcId, quint32 connectionIndex)
 {
     ConnectionApiPrivate *privConnectionApi = ConnectionApiPrivate::get(backend()->connectionApi());
-    const ConnectionSpec spec(dcId, ConnectionSpec::RequestFlag::MediaOnly);
+    const ConnectionSpec spec(dcId, ConnectionSpec::RequestFlag::MediaOnly, connectionIndex);
     return privConnectionApi->connectToExtraDc(spec);
 }
 
-void FilesApiPrivate::processFileRequestForConnection(FileOperation *operation, Connection *connection)
+QVector<Connection *> FilesApiPrivate::getReadyConnections(quint32 dcId) const
+{
+    QVector<Connection *> result;
+    for (Connection *connection : m_mediaConnections.value(dcId)) {
+        if (connection->status() == Connection::Status::Signed) {
+            result.append(connection);
+        }
+    }
+    return result;
+}
+
+/*
+    Keep up to c_maxChunkRequestsPerFile getFile (or saveFilePart) requests in flight
+    for the operation, spreading them over the signed media connections of the DC.
+ */
+void FilesApiPrivate::requestChunks(FileOperation *operation)
+{
+    FileOperationPrivate *privOperation = FileOperationPrivate::get(operation);
+    const QVector<Connection *> connections = getReadyConnections(privOperation->dcId());
+    if (connections.isEmpty()) {
+        return;
+    }
+    if (privOperation->m_descriptor.type() == FileRequestDescriptor::Upload) {
+        sendParts(operation, connections);
+        return;
+    }
+
+    FileRequestDescriptor &descriptor = privOperation->m_descriptor;
+    while (privOperation->m_chunksInFlight < c_maxChunkRequestsPerFile) {
+        quint32 offset = 0;
+        quint32 limit = 0;
+        if (!privOperation->m_retryChunks.isEmpty()) {
+            offset = privOperation->m_retryChunks.firstKey();
+            limit = privOperation->m_retryChunks.take(offset);
+        } else {
+            offset = descriptor.offset();
+            if (descriptor.size() && (offset >= descriptor.size())) {
+                break;
+            }
+            if ((privOperation->m_endOffset >= 0) && (offset >= privOperation->m_endOffset)) {
+                break;
+            }
+            limit = descriptor.chunkSizeAt(offset);
+            descriptor.setOffset(offset + limit);
+        }
+
+        Connection *connection = connections.at(m_chunkRequestsCounter % connections.count());
+        ++m_chunkRequestsCounter;
+        requestChunk(operation, connection, offset, limit);
+    }
+}
+
+void FilesApiPrivate::requestChunk(FileOperation *operation, Connection *connection, quint32 offset, quint32 limit)
 {
     FileOperationPrivate *privOperation = FileOperationPrivate::get(operation);
     privOperation->m_transferStatus = FileOperationPrivate::TransferStatus::TransferringBytes;
     const FileRequestDescriptor &descriptor = privOperation->m_descriptor;
     UploadRpcLayer::PendingUploadFile *rpcOperation = nullptr;
-    rpcOperation = uploadLayer()->getFile(descriptor.inputLocation(), descriptor.offset(), descriptor.chunkSize());
-    qCDebug(lcFilesApi) << __func__ << operation << connection->dcOption().id << rpcOperation;
+    rpcOperation = uploadLayer()->getFile(descriptor.inputLocation(), offset, limit);
+    qCDebug(lcFilesApi) << __func__ << operation << connection->dcOption().id << offset << limit << rpcOperation;
     privOperation->m_childOperation = rpcOperation;
+    privOperation->m_chunkRequestTimes.insert(offset, privOperation->m_transferTimer.elapsed());
+    ++privOperation->m_chunksInFlight;
     connection->rpcLayer()->sendRpc(rpcOperation);
-    rpcOperation->connectToFinished(this, &FilesApiPrivate::onGetFileResult, operation, rpcOperation);
+    rpcOperation->connectToFinished(this, &FilesApiPrivate::onGetFileResult, operation, rpcOperation, offset, limit);
 }
 
-void FilesApiPrivate::onGetFileResult(FileOperation *operation, UploadRpcLayer::PendingUploadFile *rpcOperation)
+void FilesApiPrivate::onGetFileResult(FileOperation *operation, UploadRpcLayer::PendingUploadFile *rpcOperation,
+                                      quint32 offset, quint32 limit)
 {
-    qCDebug(lcFilesApi) << __func__ << operation;
+    qCDebug(lcFilesApi) << __func__ << operation << offset << limit;
+    if (!m_activeOperations.contains(operation)) {
+        // The operation is already finished (e.g. failed on another chunk)
+        return;
+    }
+
+    FileOperationPrivate *privOperation = FileOperationPrivate::get(operation);
+    --privOperation->m_chunksInFlight;
+    const qint64 requestTime = privOperation->m_chunkRequestTimes.take(offset);
+
     TLUploadFile result;
     if (rpcOperation->isFailed()) {
         qCDebug(lcFilesApi) << __func__ << "failed" << rpcOperation->errorDetails();
         if (rpcOperation->errorDetails().contains(Connection::c_statusKey())) {
-            // The operation failed due to connection lost
-            // Schedule full retry
-            if (m_currentOperation == operation) {
-                // We can work only with one queue ATM
-                // Invoke after return
-#if QT_VERSION < QT_VERSION_CHECK(5, 10, 0)
-                QMetaObject::invokeMethod(this, "processCurrentRequest", Qt::QueuedConnection);
-#else
-                QMetaObject::invokeMethod(this, &FilesApiPrivate::processCurrentRequest, Qt::QueuedConnection);
-#endif
-                return;
-            } else {
-                qCCritical(lcFilesApi) << __func__ << "Unprocessed failed operation" << operation << rpcOperation;
-            }
+            // The operation failed due to connection lost.
+            // Request the chunk again via another connection or once the connection is restored.
+            privOperation->m_retryChunks.insert(offset, limit);
+            requestChunks(operation);
+            return;
         }
 
         operation->setFinishedWithError(rpcOperation->errorDetails());
         return;
     }
-    rpcOperation->getResult(&result);
+    // The result bytes refer to the reply data; rpcOperation outlives them
+    rpcOperation->getSharedResult(&result);
 
-    FileOperationPrivate *privOperation = FileOperationPrivate::get(operation);
     static const QVector<TLValue> badTypes = {
         TLValue::StorageFileUnknown,
         TLValue::StorageFilePartial,
@@ -250,19 +514,8 @@ void FilesApiPrivate::onGetFileResult(FileOperation *operation, UploadRpcLayer::
             FileInfo::Private::get(fileInfo)->setMimeType(typeStr);
         }
     }
-    operation->device()->write(result.bytes);
 
     FileRequestDescriptor &descriptor = privOperation->m_descriptor;
-    const quint32 totalBytesDownloaded = descriptor.offset() + result.bytes.size();
-    privOperation->m_totalTransferredBytes = totalBytesDownloaded;
-
-#ifdef DEVELOPER_BUILD
-    qCDebug(lcFilesApi).nospace() << operation
-                                  << " download progress: "
-                                  << totalBytesDownloaded << '/' << descriptor.size();
-#endif // DEVELOPER_BUILD
-
-    bool finished = false;
     if (descriptor.size()) {
         if (result.bytes.isEmpty()) {
             static const QString text = QLatin1String("Invalid download: zero bytes received");
@@ -270,66 +523,182 @@ void FilesApiPrivate::onGetFileResult(FileOperation *operation, UploadRpcLayer::
             qCWarning(lcFilesApi) << __func__ << text;
             return;
         }
-
-        finished = totalBytesDownloaded == descriptor.size();
-    } else {
-        finished = result.bytes.isEmpty() || (result.bytes.size() % 1024);
+    } else if (static_cast<quint32>(result.bytes.size()) < limit) {
+        // The first short chunk marks the end of a file of unknown size
+        const qint64 endOffset = offset + result.bytes.size();
+        if ((privOperation->m_endOffset < 0) || (endOffset < privOperation->m_endOffset)) {
+            privOperation->m_endOffset = endOffset;
+        }
     }
 
-    if (finished) {
-        descriptor.setSize(totalBytesDownloaded);
+    if (!result.bytes.isEmpty()) {
+        privOperation->writeChunk(offset, result.bytes);
     }
+    descriptor.updateChunkSize(limit, result.bytes.size(), privOperation->m_transferTimer.elapsed() - requestTime);
 
-    if (finished) {
+#ifdef DEVELOPER_BUILD
+    qCDebug(lcFilesApi).nospace() << operation
+                                  << " download progress: "
+                                  << privOperation->m_totalTransferredBytes << '/' << descriptor.size();
+#endif // DEVELOPER_BUILD
+
+    if (privOperation->isDownloadComplete()) {
+        if (!descriptor.size()) {
+            descriptor.setSize(privOperation->m_totalTransferredBytes);
+        }
         privOperation->m_transferStatus = FileOperationPrivate::TransferStatus::Finished;
         privOperation->finalizeDownload();
         operation->setFinished();
         return;
     }
 
-    descriptor.setOffset(totalBytesDownloaded);
+    requestChunks(operation);
+}
+
+void FilesApiPrivate::sendParts(FileOperation *operation, const QVector<Connection *> &connections)
+{
+    FileOperationPrivate *privOperation = FileOperationPrivate::get(operation);
+    while (privOperation->m_chunksInFlight < c_maxChunkRequestsPerFile) {
+        quint32 part = 0;
+        if (!privOperation->m_retryParts.isEmpty()) {
+            part = privOperation->m_retryParts.takeFirst();
+        } else {
+            if (privOperation->m_descriptor.finished()) {
+                break;
+            }
+            part = privOperation->m_descriptor.part();
+            if (!privOperation->readNextPart()) {
+                static const QString text = QLatin1String("Unable to read the file to upload");
+                qCWarning(lcFilesApi) << __func__ << operation << text;
+                privOperation->m_transferStatus = FileOperationPrivate::TransferStatus::Finished;
+                operation->setFinishedWithTextError(text);
+                return;
+            }
+        }
 
-    Connection *connection = Connection::fromOperation(rpcOperation);
-    processFileRequestForConnection(operation, connection);
+        Connection *connection = connections.at(m_chunkRequestsCounter % connections.count());
+        ++m_chunkRequestsCounter;
+        sendPart(operation, connection, part);
+    }
 }
 
-void FilesApiPrivate::onOperationCanceled(PendingOperation *operation)
+void FilesApiPrivate::sendPart(FileOperation *operation, Connection *connection, quint32 part)
 {
-    // TODO
+    FileOperationPrivate *privOperation = FileOperationPrivate::get(operation);
+    privOperation->m_transferStatus = FileOperationPrivate::TransferStatus::TransferringBytes;
+    const FileRequestDescriptor &descriptor = privOperation->m_descriptor;
+    const QByteArray bytes = privOperation->m_uploadParts.value(part);
+    UploadRpcLayer::PendingBool *rpcOperation = nullptr;
+    if (descriptor.isBigFile()) {
+        rpcOperation = uploadLayer()->saveBigFilePart(descriptor.fileId(), part, descriptor.parts(), bytes);
+    } else {
+        rpcOperation = uploadLayer()->saveFilePart(descriptor.fileId(), part, bytes);
+    }
+    qCDebug(lcFilesApi) << __func__ << operation << connection->dcOption().id << part << rpcOperation;
+    privOperation->m_childOperation = rpcOperation;
+    ++privOperation->m_chunksInFlight;
+    connection->rpcLayer()->sendRpc(rpcOperation);
+    rpcOperation->connectToFinished(this, &FilesApiPrivate::onSaveFilePartResult, operation, rpcOperation, part);
 }
 
-void FilesApiPrivate::onConnectOperationFinished(ConnectOperation *operation)
+void FilesApiPrivate::onSaveFilePartResult(FileOperation *operation, UploadRpcLayer::PendingBool *rpcOperation,
+                                           quint32 part)
 {
-    Connection *connection = operation->connection();
-    qCDebug(lcFilesApi) << __func__ << operation << operation->errorDetails() << connection;
+    qCDebug(lcFilesApi) << __func__ << operation << part;
+    if (!m_activeOperations.contains(operation)) {
+        // The operation is already finished (e.g. failed on another part)
+        return;
+    }
 
-    if (!m_currentOperation) {
+    FileOperationPrivate *privOperation = FileOperationPrivate::get(operation);
+    --privOperation->m_chunksInFlight;
+
+    if (rpcOperation->isFailed()) {
+        qCDebug(lcFilesApi) << __func__ << "failed" << rpcOperation->errorDetails();
+        if (rpcOperation->errorDetails().contains(Connection::c_statusKey())) {
+            // The operation failed due to connection lost.
+            // Send the part again via another connection or once the connection is restored.
+            privOperation->m_retryParts.append(part);
+            requestChunks(operation);
+            return;
+        }
+
+        privOperation->m_transferStatus = FileOperationPrivate::TransferStatus::Finished;
+        operation->setFinishedWithError(rpcOperation->errorDetails());
         return;
     }
 
-    FileOperationPrivate *privOperation = FileOperationPrivate::get(m_currentOperation);
-    if (privOperation->m_childOperation != operation) {
-        qCWarning(lcFilesApi) << __func__ << "Unexpected connection operation" << operation
-                              << "for" << m_currentOperation;
+    TLBool result;
+    rpcOperation->getResult(&result);
+    if (result.tlType != TLValue::BoolTrue) {
+        static const QString text = QLatin1String("Invalid upload: the server rejected a file part");
+        qCWarning(lcFilesApi) << __func__ << operation << text << part;
+        privOperation->m_transferStatus = FileOperationPrivate::TransferStatus::Finished;
+        operation->setFinishedWithTextError(text);
         return;
     }
 
-    if (connection->dcOption().id != privOperation->dcId()) {
-        qCWarning(lcFilesApi) << "Invalid operation dcOption";
+    const QByteArray bytes = privOperation->m_uploadParts.take(part);
+    privOperation->addUploadedBytes(static_cast<quint32>(bytes.size()));
+
+    if (privOperation->isUploadComplete()) {
+        privOperation->m_transferStatus = FileOperationPrivate::TransferStatus::Finished;
+        privOperation->finalizeUpload();
+        operation->setFinished();
         return;
     }
 
-    privOperation->m_childOperation = nullptr;
+    requestChunks(operation);
+}
+
+void FilesApiPrivate::onOperationCanceled(PendingOperation *operation)
+{
+    // TODO
+}
+
+void FilesApiPrivate::onConnectOperationFinished(quint32 dcId, ConnectOperation *operation)
+{
+    m_connectOperations.remove(operation);
+    Connection *connection = operation->connection();
+    qCDebug(lcFilesApi) << __func__ << operation << operation->errorDetails() << connection;
+
     if (operation->isFailed()) {
-        qCDebug(lcFilesApi) << __func__ << m_currentOperation
-                            << "failed due to connection" << operation->errorDetails();
+        for (const ConnectOperation *connectOperation : m_connectOperations) {
+            if (connectOperation->connection() && (connectOperation->connection()->dcOption().id == dcId)) {
+                // Another connection to the DC is on the way
+                return;
+            }
+        }
+        if (!getReadyConnections(dcId).isEmpty()) {
+            return;
+        }
 
-        privOperation->m_transferStatus = FileOperationPrivate::TransferStatus::Finished;
-        m_currentOperation->setFinishedWithError(operation->errorDetails());
+        const QVector<FileOperation *> operations = m_activeOperations;
+        for (FileOperation *fileOperation : operations) {
+            FileOperationPrivate *privOperation = FileOperationPrivate::get(fileOperation);
+            if (privOperation->dcId() != dcId) {
+                continue;
+            }
+            qCDebug(lcFilesApi) << __func__ << fileOperation
+                                << "failed due to connection" << operation->errorDetails();
+            privOperation->m_transferStatus = FileOperationPrivate::TransferStatus::Finished;
+            fileOperation->setFinishedWithError(operation->errorDetails());
+        }
+        return;
+    }
+
+    if (connection->dcOption().id != dcId) {
+        qCWarning(lcFilesApi) << "Invalid operation dcOption";
         return;
     }
 
-    privOperation->m_transferStatus = FileOperationPrivate::TransferStatus::WaitingForAuthorization;
+    for (FileOperation *fileOperation : m_activeOperations) {
+        FileOperationPrivate *privOperation = FileOperationPrivate::get(fileOperation);
+        if ((privOperation->dcId() == dcId)
+                && (privOperation->m_transferStatus == FileOperationPrivate::TransferStatus::WaitingForConnection)) {
+            privOperation->m_transferStatus = FileOperationPrivate::TransferStatus::WaitingForAuthorization;
+        }
+    }
 
     connect(connection, &Connection::statusChanged, this, &FilesApiPrivate::onConnectionStatusChanged, Qt::UniqueConnection);
     processConnectionStatus(connection);
@@ -337,11 +706,11 @@ void FilesApiPrivate::onConnectOperationFinished(ConnectOperation *operation)
 
 void FilesApiPrivate::onFileOperationFinished(PendingOperation *operation)
 {
-    if (operation != m_currentOperation) {
+    FileOperation *fileOperation = static_cast<FileOperation *>(operation);
+    if (!m_activeOperations.removeOne(fileOperation)) {
         return;
     }
-    m_currentOperation = nullptr;
-    processNextRequest();
+    processNextRequests();
 }
 
 void FilesApiPrivate::onConnectionStatusChanged()
@@ -356,10 +725,6 @@ void FilesApiPrivate::processConnectionStatus(Connection *connection)
         return;
     }
 
-    if (!m_currentOperation) {
-        return;
-    }
-
     qCDebug(lcFilesApi) << __func__ << connection << connection->status();
 
     const bool mediaConnection = connection->dcOption().flags & DcOption::MediaOnly;
@@ -367,19 +732,31 @@ void FilesApiPrivate::processConnectionStatus(Connection *connection)
         qCDebug(lcFilesApi) << __func__ << "not media";
         return;
     }
-    quint32 dcId = connection->dcOption().id;
-    if (!isConnectionNeeded(dcId)) {
-        qCDebug(lcFilesApi) << __func__ << "dc not needed";
-        return;
-    }
-    // DC needed.
+    const quint32 dcId = connection->dcOption().id;
 
     switch (connection->status()) {
     case Connection::Status::Signed:
-        processFileRequestForConnection(m_currentOperation, connection);
+    {
+        QVector<Connection *> &connections = m_mediaConnections[dcId];
+        if (!connections.contains(connection)) {
+            connections.append(connection);
+            connect(connection, &QObject::destroyed, this, [this, dcId, connection]() {
+                m_mediaConnections[dcId].removeOne(connection);
+            });
+        }
+        const QVector<FileOperation *> operations = m_activeOperations;
+        for (FileOperation *operation : operations) {
+            if (FileOperationPrivate::get(operation)->dcId() == dcId) {
+                requestChunks(operation);
+            }
+        }
+    }
         break;
     case Connection::Status::Disconnected:
-        ensureConnection(dcId);
+        m_mediaConnections[dcId].removeOne(connection);
+        if (isConnectionNeeded(dcId)) {
+            connectToDc(dcId);
+        }
         break;
     default:
         break;
@@ -423,6 +800,43 @@ FileOperation *FilesApi::uploadFile(QIODevice *input, const QString &fileName)
     return d->uploadFile(input, fileName);
 }
 
+QString FilesApi::cacheDirectory() const
+{
+    Q_D(const FilesApi);
+    return d->m_mediaCache.directory();
+}
+
+/*!
+    Sets the directory to cache the downloaded files.
+
+    The downloads are served from the cache if the file is already there.
+    An empty directory (the default) disables the cache.
+
+    \sa setCacheMaxSize()
+*/
+void FilesApi::setCacheDirectory(const QString &directory)
+{
+    Q_D(FilesApi);
+    d->m_mediaCache.setDirectory(directory);
+}
+
+qint64 FilesApi::cacheMaxSize() const
+{
+    Q_D(const FilesApi);
+    return d->m_mediaCache.maxSize();
+}
+
+/*!
+    Sets the size budget of the cache in bytes.
+
+    The least recently used files are removed from the cache once it gets bigger than \a size.
+*/
+void FilesApi::setCacheMaxSize(qint64 size)
+{
+    Q_D(FilesApi);
+    d->m_mediaCache.setMaxSize(size);
+}
+
 } // Client namespace
 
 } // Telegram namespace
@@ -43,6 +43,12 @@ public:
     FileOperation *uploadFile(QIODevice *input, const QString &fileName);
     FileOperation *uploadFile(const QByteArray &data, const QString &fileName);
 
+    QString cacheDirectory() const;
+    void setCacheDirectory(const QString &directory);
+
+    qint64 cacheMaxSize() const;
+    void setCacheMaxSize(qint64 size);
+
 protected:
     Q_DECLARE_PRIVATE_D(d, FilesApi)
 };
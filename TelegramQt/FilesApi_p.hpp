@@ -18,13 +18,18 @@
 #ifndef TELEGRAMQT_CLIENT_FILES_API_PRIVATE_HPP
 #define TELEGRAMQT_CLIENT_FILES_API_PRIVATE_HPP
 
+#include <QHash>
+#include <QPointer>
 #include <QQueue>
+#include <QSet>
+#include <QVector>
 
 #include "ClientApi_p.hpp"
 #include "CompatibilityLayer.hpp"
 
 #include "FilesApi.hpp"
 #include "FileRequestDescriptor.hpp"
+#include "MediaCache.hpp"
 
 #include "RpcLayers/ClientRpcUploadLayer.hpp"
 
@@ -52,35 +57,52 @@ public:
     FileOperation *uploadFile(const QByteArray &fileContent, const QString &fileName);
     FileOperation *uploadFile(QIODevice *source, const QString &fileName);
 
-    ConnectOperation *ensureConnection(quint32 dcId);
-
-    void processFileRequestForConnection(FileOperation *operation, Connection *connection);
+    ConnectOperation *ensureConnection(quint32 dcId, quint32 connectionIndex);
 
     UploadRpcLayer *uploadLayer() { return m_uploadLayer; }
+    MediaCache *mediaCache() { return &m_mediaCache; }
 
 TELEGRAMQT_PROTECTED_SLOTS:
-    void onGetFileResult(FileOperation *operation, UploadRpcLayer::PendingUploadFile *rpcOperation);
+    void onGetFileResult(FileOperation *operation, UploadRpcLayer::PendingUploadFile *rpcOperation,
+                         quint32 offset, quint32 limit);
+    void onSaveFilePartResult(FileOperation *operation, UploadRpcLayer::PendingBool *rpcOperation, quint32 part);
 
     void onOperationCanceled(PendingOperation *operation);
 
-    void onConnectOperationFinished(ConnectOperation *operation);
+    void onConnectOperationFinished(quint32 dcId, ConnectOperation *operation);
     void onFileOperationFinished(PendingOperation *operation);
     void onConnectionStatusChanged();
     void processConnectionStatus(Connection *connection);
 
-    void processNextRequest();
-    void processCurrentRequest();
+    void processNextRequests();
 protected:
 //    FileOperation *addFileRequest(const FileInfo *file, QIODevice *device);
     FileOperation *addFileRequest(const FileRequestDescriptor &descriptor, QIODevice *device);
 
+    bool readFromCache(FileOperation *operation);
+    bool joinPendingDownload(FileOperation *operation);
+    void completeDownload(FileOperation *operation);
+    void onDownloadLeaderDestroyed(FileOperation *follower);
+    void onFileOperationDestroyed(FileOperation *operation);
+    void startOperation(FileOperation *operation);
+    void connectToDc(quint32 dcId);
+    void requestChunks(FileOperation *operation);
+    void requestChunk(FileOperation *operation, Connection *connection, quint32 offset, quint32 limit);
+    void sendParts(FileOperation *operation, const QVector<Connection *> &connections);
+    void sendPart(FileOperation *operation, Connection *connection, quint32 part);
+    QVector<Connection *> getReadyConnections(quint32 dcId) const;
+
     void dumpCurrentState() const;
 
     bool isConnectionNeeded(quint32 dcId) const;
 
-    // QHash<quint32, Connection *> m_connections; // dcId to connection
-    QQueue<FileOperation*> m_fileRequests;
-    FileOperation *m_currentOperation = nullptr;
+    QQueue<FileOperation*> m_fileRequests; // Operations waiting for their turn
+    QVector<FileOperation*> m_activeOperations;
+    QHash<quint32, QVector<Connection *>> m_mediaConnections; // dcId to the signed media connections
+    QSet<ConnectOperation *> m_connectOperations; // Unfinished media connection operations
+    quint32 m_chunkRequestsCounter = 0; // Used to spread the chunk requests over the connections
+    QHash<QString, QPointer<FileOperation>> m_downloadsByKey; // Cache key to the download of the file
+    MediaCache m_mediaCache;
     UploadRpcLayer *m_uploadLayer = nullptr;
     QTimer *m_monitorTimer = nullptr;
 };
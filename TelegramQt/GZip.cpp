@@ -0,0 +1,209 @@
+/*
+   Copyright (C) 2020 Alexandr Akulich <akulichalexander@gmail.com>
+
+   This file is a part of TelegramQt library.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+ */
+
+#include "GZip.hpp"
+
+#define ZLIB_CONST
+
+#include <zlib.h>
+
+#include <cstring>
+#include <limits>
+
+namespace Telegram {
+
+// The trailer size is set by the remote side, so we don't trust it for huge allocations
+static constexpr quint32 c_maxPreallocatedSize = 16 * 1024 * 1024;
+static constexpr int c_gzipTrailerSize = 8; // CRC32 and ISIZE
+static constexpr int c_gzipHeaderSize = 10;
+
+static z_stream_s *createStream()
+{
+    z_stream_s *stream = new z_stream_s;
+    std::memset(stream, 0, sizeof(z_stream_s));
+    return stream;
+}
+
+GZipInflater::GZipInflater() :
+    m_stream(createStream())
+{
+}
+
+GZipInflater::~GZipInflater()
+{
+    if (m_initialized) {
+        inflateEnd(m_stream);
+    }
+    delete m_stream;
+}
+
+quint32 GZipInflater::uncompressedSize(const char *data, int size)
+{
+    if ((size < c_gzipHeaderSize + c_gzipTrailerSize)
+            || (static_cast<uchar>(data[0]) != 0x1f) || (static_cast<uchar>(data[1]) != 0x8b)) {
+        return 0;
+    }
+    // ISIZE is stored in the little-endian byte order
+    const uchar *trailer = reinterpret_cast<const uchar *>(data + size - 4);
+    return quint32(trailer[0]) | (quint32(trailer[1]) << 8) | (quint32(trailer[2]) << 16) | (quint32(trailer[3]) << 24);
+}
+
+bool GZipInflater::reset()
+{
+    if (m_initialized) {
+        return inflateReset(m_stream) == Z_OK;
+    }
+    m_initialized = inflateInit2(m_stream, MAX_WBITS + 32) == Z_OK; // gzip decoding
+    return m_initialized;
+}
+
+/*!
+  Inflates \a size bytes of \a data into the \a output memory of \a outputSize bytes.
+
+  Returns the number of the written bytes or -1 if the data is corrupted
+  or the output has not enough space (see uncompressedSize()).
+*/
+int GZipInflater::inflate(const char *data, int size, char *output, int outputSize)
+{
+    if (!reset()) {
+        return -1;
+    }
+    m_stream->next_in = reinterpret_cast<z_const Bytef *>(data);
+    m_stream->avail_in = static_cast<uInt>(size);
+    m_stream->next_out = reinterpret_cast<Bytef *>(output);
+    m_stream->avail_out = static_cast<uInt>(outputSize);
+    if (::inflate(m_stream, Z_FINISH) != Z_STREAM_END) {
+        return -1;
+    }
+    return outputSize - static_cast<int>(m_stream->avail_out);
+}
+
+/*!
+  Inflates \a size bytes of \a data into the \a output array.
+
+  The output is allocated once with the size from the gzip trailer,
+  so a valid package is decoded without reallocations.
+*/
+bool GZipInflater::inflate(const char *data, int size, QByteArray *output)
+{
+    if (!reset()) {
+        output->clear();
+        return false;
+    }
+    int capacity = static_cast<int>(qMin(uncompressedSize(data, size), c_maxPreallocatedSize));
+    if (!capacity) {
+        capacity = qMax(size * 2, 1024);
+    }
+    output->resize(capacity);
+
+    m_stream->next_in = reinterpret_cast<z_const Bytef *>(data);
+    m_stream->avail_in = static_cast<uInt>(size);
+    int produced = 0;
+    forever {
+        m_stream->next_out = reinterpret_cast<Bytef *>(output->data() + produced);
+        m_stream->avail_out = static_cast<uInt>(output->size() - produced);
+        const int result = ::inflate(m_stream, Z_NO_FLUSH);
+        produced = output->size() - static_cast<int>(m_stream->avail_out);
+        if (result == Z_STREAM_END) {
+            break;
+        }
+        if (((result != Z_OK) && (result != Z_BUF_ERROR)) || m_stream->avail_out) {
+            // Corrupted or truncated data
+            output->clear();
+            return false;
+        }
+        if (output->size() > std::numeric_limits<int>::max() / 2) {
+            output->clear();
+            return false;
+        }
+        output->resize(output->size() * 2);
+    }
+    output->resize(produced);
+    return true;
+}
+
+GZipDeflater::GZipDeflater(int compressionLevel) :
+    m_stream(createStream()),
+    m_compressionLevel(compressionLevel)
+{
+}
+
+GZipDeflater::~GZipDeflater()
+{
+    if (m_initialized) {
+        deflateEnd(m_stream);
+    }
+    delete m_stream;
+}
+
+void GZipDeflater::setCompressionLevel(int level)
+{
+    if (m_compressionLevel == level) {
+        return;
+    }
+    m_compressionLevel = level;
+    if (m_initialized) {
+        deflateEnd(m_stream);
+        std::memset(m_stream, 0, sizeof(z_stream_s));
+        m_initialized = false;
+    }
+}
+
+bool GZipDeflater::reset()
+{
+    if (m_initialized) {
+        return deflateReset(m_stream) == Z_OK;
+    }
+    m_initialized = deflateInit2(m_stream,
+                                 m_compressionLevel,
+                                 Z_DEFLATED,
+                                 MAX_WBITS + 16, // (8 to 15) + 16 for gzip
+                                 MAX_MEM_LEVEL,
+                                 Z_DEFAULT_STRATEGY) == Z_OK;
+    return m_initialized;
+}
+
+/*!
+  Deflates \a size bytes of \a data into the \a output array.
+
+  The output is allocated once with the worst case size reported by zlib.
+*/
+bool GZipDeflater::deflate(const char *data, int size, QByteArray *output)
+{
+    if (!reset()) {
+        output->clear();
+        return false;
+    }
+    const uLong bound = deflateBound(m_stream, static_cast<uLong>(size));
+    if (bound > static_cast<uLong>(std::numeric_limits<int>::max())) {
+        output->clear();
+        return false;
+    }
+    output->resize(static_cast<int>(bound));
+    m_stream->next_in = reinterpret_cast<z_const Bytef *>(data);
+    m_stream->avail_in = static_cast<uInt>(size);
+    m_stream->next_out = reinterpret_cast<Bytef *>(output->data());
+    m_stream->avail_out = static_cast<uInt>(bound);
+    if (::deflate(m_stream, Z_FINISH) != Z_STREAM_END) {
+        output->clear();
+        return false;
+    }
+    output->resize(static_cast<int>(bound - m_stream->avail_out));
+    return true;
+}
+
+} // Telegram namespace
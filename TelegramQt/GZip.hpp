@@ -0,0 +1,75 @@
+/*
+   Copyright (C) 2020 Alexandr Akulich <akulichalexander@gmail.com>
+
+   This file is a part of TelegramQt library.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+ */
+
+#ifndef TELEGRAM_GZIP_HPP
+#define TELEGRAM_GZIP_HPP
+
+#include "telegramqt_global.h"
+
+#include <QByteArray>
+
+struct z_stream_s;
+
+namespace Telegram {
+
+// A gzip decoder which keeps the zlib state between the packages
+// (e.g. one instance per connection) and inflates into a caller-provided memory.
+class TELEGRAMQT_INTERNAL_EXPORT GZipInflater
+{
+public:
+    GZipInflater();
+    ~GZipInflater();
+
+    // Returns the uncompressed size from the gzip trailer (ISIZE) or 0 if the data is too small
+    static quint32 uncompressedSize(const char *data, int size);
+
+    int inflate(const char *data, int size, char *output, int outputSize);
+    bool inflate(const char *data, int size, QByteArray *output);
+    bool inflate(const QByteArray &data, QByteArray *output) { return inflate(data.constData(), data.size(), output); }
+
+private:
+    Q_DISABLE_COPY(GZipInflater)
+    bool reset();
+
+    z_stream_s *m_stream = nullptr;
+    bool m_initialized = false;
+};
+
+class TELEGRAMQT_INTERNAL_EXPORT GZipDeflater
+{
+public:
+    explicit GZipDeflater(int compressionLevel);
+    ~GZipDeflater();
+
+    int compressionLevel() const { return m_compressionLevel; }
+    void setCompressionLevel(int level);
+
+    bool deflate(const char *data, int size, QByteArray *output);
+    bool deflate(const QByteArray &data, QByteArray *output) { return deflate(data.constData(), data.size(), output); }
+
+private:
+    Q_DISABLE_COPY(GZipDeflater)
+    bool reset();
+
+    z_stream_s *m_stream = nullptr;
+    int m_compressionLevel;
+    bool m_initialized = false;
+};
+
+} // Telegram namespace
+
+#endif // TELEGRAM_GZIP_HPP
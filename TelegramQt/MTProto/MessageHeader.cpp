@@ -19,6 +19,8 @@
 
 #include "RawStream.hpp"
 
+#include <cstring>
+
 namespace Telegram {
 
 namespace MTProto {
@@ -59,6 +61,41 @@ RawStream &operator<<(RawStream &stream, const FullMessageHeader &header)
     return stream;
 }
 
+void MessageHeader::writeTo(char *data) const
+{
+    std::memcpy(data, &messageId, sizeof(messageId));
+    data += sizeof(messageId);
+    std::memcpy(data, &sequenceNumber, sizeof(sequenceNumber));
+    data += sizeof(sequenceNumber);
+    std::memcpy(data, &contentLength, sizeof(contentLength));
+}
+
+void FullMessageHeader::readFrom(const char *data)
+{
+    std::memcpy(&serverSalt, data, sizeof(serverSalt));
+    data += sizeof(serverSalt);
+    std::memcpy(&sessionId, data, sizeof(sessionId));
+    data += sizeof(sessionId);
+    std::memcpy(&messageId, data, sizeof(messageId));
+    data += sizeof(messageId);
+    std::memcpy(&sequenceNumber, data, sizeof(sequenceNumber));
+    data += sizeof(sequenceNumber);
+    std::memcpy(&contentLength, data, sizeof(contentLength));
+}
+
+void FullMessageHeader::writeTo(char *data) const
+{
+    std::memcpy(data, &serverSalt, sizeof(serverSalt));
+    data += sizeof(serverSalt);
+    std::memcpy(data, &sessionId, sizeof(sessionId));
+    data += sizeof(sessionId);
+    std::memcpy(data, &messageId, sizeof(messageId));
+    data += sizeof(messageId);
+    std::memcpy(data, &sequenceNumber, sizeof(sequenceNumber));
+    data += sizeof(sequenceNumber);
+    std::memcpy(data, &contentLength, sizeof(contentLength));
+}
+
 Message Message::skipBytes(int bytes) const
 {
     Message m = *this;
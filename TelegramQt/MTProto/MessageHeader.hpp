@@ -34,6 +34,9 @@ struct TELEGRAMQT_INTERNAL_EXPORT MessageHeader {
     quint32 sequenceNumber;
     quint32 contentLength;
 
+    // Raw serialization for the message header in a container
+    void writeTo(char *data) const;
+
 #if defined(Q_CC_MSVC)
     static constexpr int headerLength = sizeof(quint64) + sizeof(quint32) + sizeof(quint32);
 #else
@@ -54,6 +57,10 @@ struct TELEGRAMQT_INTERNAL_EXPORT FullMessageHeader : public MessageHeader
     quint64 serverSalt = 0;
     quint64 sessionId = 0;
 
+    // Raw (de)serialization for the fixed-size encrypted message header
+    void readFrom(const char *data);
+    void writeTo(char *data) const;
+
 #if defined(Q_CC_MSVC)
     static constexpr int headerLength = sizeof(quint64) + sizeof(quint64)
             + sizeof(quint64) + sizeof(quint32) + sizeof(quint32);
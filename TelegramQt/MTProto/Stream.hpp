@@ -361,6 +361,13 @@ public:
 
 inline Stream &Stream::operator>>(QString &str)
 {
+    if (hasReadBuffer()) {
+        // Decode right from the stream data without an intermediate QByteArray
+        int size = 0;
+        const char *utf8 = readBytesView(&size);
+        str = QString::fromUtf8(utf8, size);
+        return *this;
+    }
     QByteArray data;
     *this >> data;
     str = QString::fromUtf8(data);
@@ -0,0 +1,256 @@
+/*
+   Copyright (C) 2019 Alexander Akulich <akulichalexander@gmail.com>
+
+   This file is a part of TelegramQt library.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+ */
+
+#include "MediaCache.hpp"
+
+#include "Debug_p.hpp"
+
+#include <QDir>
+#include <QFileInfo>
+#include <QLoggingCategory>
+#include <QSaveFile>
+
+Q_LOGGING_CATEGORY(lcMediaCache, "telegram.client.api.files.cache", QtWarningMsg)
+
+namespace Telegram {
+
+namespace Client {
+
+static constexpr qint64 c_defaultMaxSize = 256 * 1024 * 1024;
+static const QString c_mimeTypeFileSuffix = QStringLiteral(".type");
+
+/*
+    Returns the cache key for the file location or an empty string
+    if the location can not be cached.
+*/
+QString MediaCache::getKey(quint32 dcId, const TLInputFileLocation &location)
+{
+    switch (location.tlType) {
+    case TLValue::InputFileLocation:
+        return QStringLiteral("dc%1-%2-%3")
+                .arg(dcId)
+                .arg(location.volumeId, 0, 16)
+                .arg(location.localId, 0, 16);
+    case TLValue::InputDocumentFileLocation:
+        return QStringLiteral("doc-%1").arg(location.id, 0, 16);
+    default:
+        return QString();
+    }
+}
+
+void MediaCache::setDirectory(const QString &directory)
+{
+    if (m_directory == directory) {
+        return;
+    }
+    m_directory = directory;
+    loadIndex();
+}
+
+void MediaCache::setMaxSize(qint64 size)
+{
+    m_maxSize = size;
+    trim();
+}
+
+bool MediaCache::contains(const QString &key) const
+{
+    return m_entries.contains(key);
+}
+
+/*
+    Opens the cached file for reading and marks it as recently used.
+    The caller takes the ownership of the returned file.
+*/
+QFile *MediaCache::openFile(const QString &key)
+{
+    if (!contains(key)) {
+        return nullptr;
+    }
+    QFile *file = new QFile(getFileName(key));
+    if (!file->open(QIODevice::ReadOnly) || (file->size() != m_entries.value(key).size)) {
+        qCWarning(lcMediaCache) << CALL_INFO << "The cached file is not available" << file->fileName();
+        delete file;
+        remove(key);
+        return nullptr;
+    }
+    touchEntry(key);
+    return file;
+}
+
+QString MediaCache::mimeType(const QString &key) const
+{
+    if (!contains(key)) {
+        return QString();
+    }
+    QFile file(getMimeTypeFileName(key));
+    if (!file.open(QIODevice::ReadOnly)) {
+        return QString();
+    }
+    return QString::fromUtf8(file.readAll());
+}
+
+QSaveFile *MediaCache::beginWrite(const QString &key) const
+{
+    if (!isEnabled() || key.isEmpty()) {
+        return nullptr;
+    }
+    if (!QDir().mkpath(m_directory)) {
+        qCWarning(lcMediaCache) << CALL_INFO << "Unable to create the cache directory" << m_directory;
+        return nullptr;
+    }
+    QSaveFile *file = new QSaveFile(getFileName(key));
+    if (!file->open(QIODevice::WriteOnly)) {
+        qCWarning(lcMediaCache) << CALL_INFO << "Unable to open file" << file->fileName();
+        delete file;
+        return nullptr;
+    }
+    return file;
+}
+
+bool MediaCache::commitWrite(const QString &key, QSaveFile *file, const QString &mimeType)
+{
+    const qint64 size = file->size();
+    const bool committed = file->commit();
+    delete file;
+    if (!committed) {
+        qCWarning(lcMediaCache) << CALL_INFO << "Unable to save file" << key;
+        return false;
+    }
+    QFile mimeTypeFile(getMimeTypeFileName(key));
+    if (mimeType.isEmpty()) {
+        mimeTypeFile.remove();
+    } else if (!mimeTypeFile.open(QIODevice::WriteOnly) || (mimeTypeFile.write(mimeType.toUtf8()) < 0)) {
+        qCWarning(lcMediaCache) << CALL_INFO << "Unable to save the MIME type of" << key;
+    }
+    insertEntry(key, size);
+    trim();
+    return true;
+}
+
+void MediaCache::cancelWrite(QSaveFile *file) const
+{
+    file->cancelWriting();
+    delete file;
+}
+
+void MediaCache::remove(const QString &key)
+{
+    const Entry entry = m_entries.take(key);
+    if (!entry.accessId) {
+        return;
+    }
+    m_accessOrder.remove(entry.accessId);
+    m_size -= entry.size;
+    QFile::remove(getFileName(key));
+    QFile::remove(getMimeTypeFileName(key));
+}
+
+void MediaCache::clear()
+{
+    const QStringList keys = m_entries.keys();
+    for (const QString &key : keys) {
+        remove(key);
+    }
+}
+
+qint64 MediaCache::defaultMaxSize()
+{
+    return c_defaultMaxSize;
+}
+
+QString MediaCache::getFileName(const QString &key) const
+{
+    return m_directory + QLatin1Char('/') + key;
+}
+
+QString MediaCache::getMimeTypeFileName(const QString &key) const
+{
+    return getFileName(key) + c_mimeTypeFileSuffix;
+}
+
+/*
+    Build the index from the directory content. The access time is not
+    persistent, so the files are ordered by the last modification time.
+*/
+void MediaCache::loadIndex()
+{
+    m_entries.clear();
+    m_accessOrder.clear();
+    m_size = 0;
+    if (!isEnabled()) {
+        return;
+    }
+
+    const QDir dir(m_directory);
+    const QFileInfoList files = dir.entryInfoList(QDir::Files, QDir::Time | QDir::Reversed);
+    QStringList mimeTypeFiles;
+    for (const QFileInfo &fileInfo : files) {
+        const QString fileName = fileInfo.fileName();
+        if (fileName.endsWith(c_mimeTypeFileSuffix)) {
+            mimeTypeFiles.append(fileName);
+            continue;
+        }
+        if (fileName.contains(QLatin1Char('.'))) {
+            // Not a cache entry (e.g. a leftover QSaveFile temporary file)
+            continue;
+        }
+        insertEntry(fileName, fileInfo.size());
+    }
+    for (const QString &fileName : mimeTypeFiles) {
+        if (!contains(fileName.left(fileName.size() - c_mimeTypeFileSuffix.size()))) {
+            // The cached file is removed
+            QFile::remove(m_directory + QLatin1Char('/') + fileName);
+        }
+    }
+    qCDebug(lcMediaCache) << CALL_INFO << m_directory << m_entries.count() << "files" << m_size << "bytes";
+    trim();
+}
+
+void MediaCache::insertEntry(const QString &key, qint64 size)
+{
+    Entry &entry = m_entries[key];
+    if (entry.accessId) {
+        m_accessOrder.remove(entry.accessId);
+        m_size -= entry.size;
+    }
+    entry.size = size;
+    entry.accessId = ++m_lastAccessId;
+    m_accessOrder.insert(entry.accessId, key);
+    m_size += size;
+}
+
+void MediaCache::touchEntry(const QString &key)
+{
+    Entry &entry = m_entries[key];
+    m_accessOrder.remove(entry.accessId);
+    entry.accessId = ++m_lastAccessId;
+    m_accessOrder.insert(entry.accessId, key);
+}
+
+void MediaCache::trim()
+{
+    while ((m_size > m_maxSize) && !m_accessOrder.isEmpty()) {
+        const QString key = m_accessOrder.first();
+        qCDebug(lcMediaCache) << CALL_INFO << "Evict" << key;
+        remove(key);
+    }
+}
+
+} // Client namespace
+
+} // Telegram namespace
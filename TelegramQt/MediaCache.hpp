@@ -0,0 +1,96 @@
+/*
+   Copyright (C) 2019 Alexander Akulich <akulichalexander@gmail.com>
+
+   This file is a part of TelegramQt library.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+ */
+
+#ifndef TELEGRAMQT_CLIENT_MEDIA_CACHE_HPP
+#define TELEGRAMQT_CLIENT_MEDIA_CACHE_HPP
+
+#include "MTProto/TLTypes.hpp"
+
+#include <QHash>
+#include <QMap>
+#include <QString>
+
+QT_FORWARD_DECLARE_CLASS(QFile)
+QT_FORWARD_DECLARE_CLASS(QSaveFile)
+
+namespace Telegram {
+
+namespace Client {
+
+/*
+    The on-disk cache of downloaded files with a byte-size LRU budget.
+
+    Each file is stored as a separate file named by its key; the MIME type
+    of the file (if known) is stored next to it in "<key>.type". The in-memory
+    index is built on setDirectory() from the directory content; the files
+    are written via QSaveFile, so the cache never exposes a partial file.
+ */
+class MediaCache
+{
+public:
+    static QString getKey(quint32 dcId, const TLInputFileLocation &location);
+
+    bool isEnabled() const { return !m_directory.isEmpty(); }
+
+    QString directory() const { return m_directory; }
+    void setDirectory(const QString &directory);
+
+    qint64 maxSize() const { return m_maxSize; }
+    void setMaxSize(qint64 size);
+
+    qint64 size() const { return m_size; }
+    int count() const { return m_entries.count(); }
+
+    bool contains(const QString &key) const;
+    QFile *openFile(const QString &key);
+    QString mimeType(const QString &key) const;
+
+    QSaveFile *beginWrite(const QString &key) const;
+    bool commitWrite(const QString &key, QSaveFile *file, const QString &mimeType = QString());
+    void cancelWrite(QSaveFile *file) const;
+
+    void remove(const QString &key);
+    void clear();
+
+    static qint64 defaultMaxSize();
+
+protected:
+    struct Entry {
+        qint64 size = 0;
+        quint64 accessId = 0;
+    };
+
+    QString getFileName(const QString &key) const;
+    QString getMimeTypeFileName(const QString &key) const;
+    void loadIndex();
+    void insertEntry(const QString &key, qint64 size);
+    void touchEntry(const QString &key);
+    void trim();
+
+    QString m_directory;
+    QHash<QString, Entry> m_entries;
+    QMap<quint64, QString> m_accessOrder; // Access id to key, the least recently used first
+    quint64 m_lastAccessId = 0;
+    qint64 m_size = 0;
+    qint64 m_maxSize = defaultMaxSize();
+};
+
+} // Client namespace
+
+} // Telegram namespace
+
+#endif // TELEGRAMQT_CLIENT_MEDIA_CACHE_HPP
@@ -1,6 +1,10 @@
 #include "FileOperation_p.hpp"
 
+#include "TelegramNamespace_p.hpp"
+
 #include <QBuffer>
+#include <QCryptographicHash>
+#include <QSaveFile>
 
 namespace Telegram {
 
@@ -36,6 +40,15 @@ quint32 FileOperation::bytesTransferred() const
     return d->m_totalTransferredBytes;
 }
 
+/*!
+    Returns the size of the file or 0 if the size is not known yet.
+*/
+quint32 FileOperation::totalBytes() const
+{
+    Q_D(const FileOperation);
+    return d->m_descriptor.size();
+}
+
 void FileOperation::cancel()
 {
     emit canceled(this);
@@ -55,6 +68,15 @@ FileOperationPrivate::~FileOperationPrivate()
         delete m_ownBuffer;
         m_ownBuffer = nullptr;
     }
+
+    delete m_md5Hash;
+    m_md5Hash = nullptr;
+
+    if (m_cacheFile) {
+        m_cacheFile->cancelWriting();
+        delete m_cacheFile;
+        m_cacheFile = nullptr;
+    }
 }
 
 FileOperationPrivate *FileOperationPrivate::get(FileOperation *parent)
@@ -77,6 +99,84 @@ void FileOperationPrivate::prepareForDownload()
         m_ownBuffer->open(QIODevice::WriteOnly);
     }
     m_totalTransferredBytes = 0;
+    m_pendingChunks.clear();
+    m_retryChunks.clear();
+    m_chunkRequestTimes.clear();
+    m_endOffset = -1;
+    m_chunksInFlight = 0;
+    m_transferTimer.start();
+}
+
+/*
+    Write the chunk received at the given offset. The chunks can arrive in any
+    order; a chunk that does not follow the written data is kept until the gap
+    is filled.
+ */
+void FileOperationPrivate::writeChunk(quint32 offset, const QByteArray &bytes)
+{
+    if (offset != m_totalTransferredBytes) {
+        if (offset > m_totalTransferredBytes) {
+            // Detach from the reply data
+            m_pendingChunks.insert(offset, QByteArray(bytes.constData(), bytes.size()));
+        }
+        return;
+    }
+
+    writeBytes(bytes);
+    quint32 writtenBytes = m_totalTransferredBytes + static_cast<quint32>(bytes.size());
+
+    while (!m_pendingChunks.isEmpty() && (m_pendingChunks.firstKey() == writtenBytes)) {
+        const QByteArray chunk = m_pendingChunks.take(writtenBytes);
+        writeBytes(chunk);
+        writtenBytes += static_cast<quint32>(chunk.size());
+    }
+    setTransferredBytes(writtenBytes);
+    for (FileOperation *follower : m_followers) {
+        if (follower) {
+            FileOperationPrivate::get(follower)->setTransferredBytes(writtenBytes);
+        }
+    }
+}
+
+/*
+    Write the whole content of the source device (e.g. a cached file).
+ */
+bool FileOperationPrivate::writeFromDevice(QIODevice *source)
+{
+    static constexpr qint64 c_bufferSize = 64 * 1024;
+    while (!source->atEnd()) {
+        const QByteArray bytes = source->read(c_bufferSize);
+        if (bytes.isEmpty()) {
+            return false;
+        }
+        writeChunk(m_totalTransferredBytes, bytes);
+    }
+    return true;
+}
+
+/*
+    Write the in-order data to the operation device, to the devices
+    of the followers and to the cache.
+ */
+void FileOperationPrivate::writeBytes(const QByteArray &bytes)
+{
+    m_device->write(bytes);
+    for (FileOperation *follower : m_followers) {
+        if (follower) {
+            FileOperationPrivate::get(follower)->m_device->write(bytes);
+        }
+    }
+    if (m_cacheFile) {
+        m_cacheFile->write(bytes);
+    }
+}
+
+bool FileOperationPrivate::isDownloadComplete() const
+{
+    if (m_descriptor.size()) {
+        return m_totalTransferredBytes >= m_descriptor.size();
+    }
+    return (m_endOffset >= 0) && (m_totalTransferredBytes >= m_endOffset);
 }
 
 void FileOperationPrivate::finalizeDownload()
@@ -87,6 +187,79 @@ void FileOperationPrivate::finalizeDownload()
     }
 }
 
+void FileOperationPrivate::prepareForUpload()
+{
+    m_totalTransferredBytes = 0;
+    m_uploadParts.clear();
+    m_retryParts.clear();
+    m_chunksInFlight = 0;
+
+    delete m_md5Hash;
+    m_md5Hash = nullptr;
+    if (!m_descriptor.isBigFile()) {
+        m_md5Hash = new QCryptographicHash(QCryptographicHash::Md5);
+    }
+}
+
+/*
+    Read the next part of the file from the device. Only the parts which are
+    in flight (or wait for a retry) are kept in memory.
+ */
+bool FileOperationPrivate::readNextPart()
+{
+    const quint32 part = m_descriptor.part();
+    const qint64 partSize = qMin<qint64>(m_descriptor.chunkSize(), m_descriptor.size() - m_descriptor.offset());
+    const QByteArray bytes = m_device->read(partSize);
+    if (bytes.size() != partSize) {
+        return false;
+    }
+    m_uploadParts.insert(part, bytes);
+    m_descriptor.bumpPart();
+
+    if (m_md5Hash) {
+        m_md5Hash->addData(bytes);
+        if (m_descriptor.finished()) {
+            m_descriptor.setMd5Sum(m_md5Hash->result());
+            delete m_md5Hash;
+            m_md5Hash = nullptr;
+        }
+    }
+    return true;
+}
+
+void FileOperationPrivate::addUploadedBytes(quint32 bytes)
+{
+    setTransferredBytes(m_totalTransferredBytes + bytes);
+}
+
+bool FileOperationPrivate::isUploadComplete() const
+{
+    return m_descriptor.finished() && m_uploadParts.isEmpty();
+}
+
+void FileOperationPrivate::finalizeUpload()
+{
+    const TLInputFile inputFile = m_descriptor.inputFile();
+    FileInfo *fileInfo = new FileInfo();
+    FileInfo::Private *filePrivate = FileInfo::Private::get(fileInfo);
+    filePrivate->setInputFile(&inputFile);
+    filePrivate->m_size = m_descriptor.size();
+    filePrivate->m_dcId = m_descriptor.dcId();
+
+    delete m_fileInfo;
+    m_fileInfo = fileInfo;
+}
+
+void FileOperationPrivate::setTransferredBytes(quint32 bytes)
+{
+    if (m_totalTransferredBytes == bytes) {
+        return;
+    }
+    Q_Q(FileOperation);
+    m_totalTransferredBytes = bytes;
+    emit q->bytesTransferredChanged(bytes);
+}
+
 } // Client namespace
 
 } // Telegram namespace
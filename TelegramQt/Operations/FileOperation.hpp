@@ -22,12 +22,14 @@ public:
     QIODevice *device() const;
 
     quint32 bytesTransferred() const;
+    quint32 totalBytes() const;
 
 public slots:
     void cancel();
 
 signals:
     void canceled(FileOperation *operation);
+    void bytesTransferredChanged(quint32 bytesTransferred);
 
 protected:
     Q_DECLARE_PRIVATE_D(d, FileOperation)
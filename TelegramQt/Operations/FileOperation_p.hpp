@@ -5,15 +5,21 @@
 #include "FileOperation.hpp"
 #include "FileRequestDescriptor.hpp"
 
+#include <QElapsedTimer>
+#include <QHash>
+#include <QMap>
+#include <QPointer>
 #include <QVector>
 
 QT_FORWARD_DECLARE_CLASS(QBuffer)
+QT_FORWARD_DECLARE_CLASS(QCryptographicHash)
+QT_FORWARD_DECLARE_CLASS(QSaveFile)
 
 namespace Telegram {
 
 namespace Client {
 
-class FileOperationPrivate : public PendingOperationPrivate
+class TELEGRAMQT_INTERNAL_EXPORT FileOperationPrivate : public PendingOperationPrivate
 {
     Q_GADGET
 public:
@@ -41,13 +47,42 @@ public:
     void prepareForDownload();
     void finalizeDownload();
 
+    void writeChunk(quint32 offset, const QByteArray &bytes);
+    bool writeFromDevice(QIODevice *source);
+    bool isDownloadComplete() const;
+
+    void prepareForUpload();
+    void finalizeUpload();
+    bool readNextPart();
+    void addUploadedBytes(quint32 bytes);
+    bool isUploadComplete() const;
+
     FileRequestDescriptor m_descriptor;
     FileInfo *m_fileInfo = nullptr;
     quint32 m_totalTransferredBytes = 0;
     TransferStatus m_transferStatus = TransferStatus::Invalid;
     PendingOperation *m_childOperation = nullptr;
 
+    // Download state
+    QMap<quint32, QByteArray> m_pendingChunks; // offset to out-of-order received bytes
+    QMap<quint32, quint32> m_retryChunks; // offset to limit of the chunks to request again
+    QHash<quint32, qint64> m_chunkRequestTimes; // offset to the request time of the chunks in flight
+    QElapsedTimer m_transferTimer;
+    qint64 m_endOffset = -1; // The end of a file of unknown size (detected on a short chunk)
+    int m_chunksInFlight = 0;
+    QString m_cacheKey;
+    QSaveFile *m_cacheFile = nullptr; // Receives the downloaded data on the way to the cache
+    QVector<QPointer<FileOperation>> m_followers; // Duplicate requests served by this download
+
+    // Upload state
+    QHash<quint32, QByteArray> m_uploadParts; // part to bytes of the parts in flight or to retry
+    QVector<quint32> m_retryParts; // parts to send again
+
 private:
+    void writeBytes(const QByteArray &bytes);
+    void setTransferredBytes(quint32 bytes);
+
+    QCryptographicHash *m_md5Hash = nullptr; // Small files only
     QIODevice *m_device = nullptr;
     QBuffer *m_ownBuffer = nullptr;
 };
@@ -35,6 +35,11 @@ public:
     {
         return isSucceeded() && m_layer->processReply(this, output);
     }
+
+    bool getSharedResult(TLTypePtr output)
+    {
+        return isSucceeded() && m_layer->processSharedReply(this, output);
+    }
 };
 
 } // Client namespace
@@ -19,38 +19,35 @@
 #include "AbridgedLength.hpp"
 
 #include <QIODevice>
-#include <QBuffer>
 
 static const char s_nulls[4] = { 0, 0, 0, 0 };
 
 namespace Telegram {
 
-RawStream::RawStream(QByteArray *data, bool write) :
-    m_ownDevice(true)
+RawStream::RawStream(QByteArray *data, bool write)
 {
-    setDevice(new QBuffer(data));
     if (write) {
-        m_device->open(QIODevice::Append);
+        // Append to the given array
+        m_backend = Backend::WriteBuffer;
+        m_writeBuffer = data;
     } else {
-        m_device->open(QIODevice::ReadOnly);
+        setReadBuffer(*data);
     }
 }
 
 RawStream::RawStream(const QByteArray &data)
 {
-    setData(data);
+    setReadBuffer(data);
 }
 
 RawStream::RawStream(Mode m, quint32 reserveBytes) :
-    m_ownDevice(true)
+    m_writeBuffer(&m_buffer),
+    m_backend(Backend::WriteBuffer)
 {
     Q_UNUSED(m)
-    QBuffer *buffer = new QBuffer();
     if (reserveBytes) {
-        buffer->buffer().reserve(static_cast<int>(reserveBytes));
+        m_buffer.reserve(static_cast<int>(reserveBytes));
     }
-    setDevice(buffer);
-    m_device->open(QIODevice::WriteOnly);
 }
 
 RawStream::RawStream(QIODevice *d)
@@ -60,38 +57,43 @@ RawStream::RawStream(QIODevice *d)
 
 RawStream::~RawStream()
 {
-    if (m_device && m_ownDevice) {
-        delete m_device;
-    }
 }
 
 void RawStream::setData(const QByteArray &data)
 {
-    QBuffer *buffer = new QBuffer();
-    buffer->setData(data);
-    setDevice(buffer);
-    m_device->open(QIODevice::ReadOnly);
-    m_ownDevice = true;
+    setReadBuffer(data);
+}
+
+void RawStream::setReadBuffer(const QByteArray &data)
+{
+    m_device = nullptr;
+    m_writeBuffer = nullptr;
+    m_backend = Backend::ReadBuffer;
+    m_buffer = data;
+    m_readPosition = m_buffer.constData();
+    m_readEnd = m_readPosition + m_buffer.size();
 }
 
 QByteArray RawStream::getData() const
 {
-    if (m_ownDevice) {
-        QBuffer *buffer = static_cast<QBuffer*>(m_device);
-        return buffer->data();
+    switch (m_backend) {
+    case Backend::ReadBuffer:
+        return m_buffer;
+    case Backend::WriteBuffer:
+        return *m_writeBuffer;
+    case Backend::Device:
+        break;
     }
     return QByteArray();
 }
 
 void RawStream::setDevice(QIODevice *newDevice)
 {
-    if (m_device) {
-        if (m_ownDevice) {
-            delete m_device;
-            m_ownDevice = false;
-        }
-    }
-
+    m_buffer.clear();
+    m_writeBuffer = nullptr;
+    m_readPosition = nullptr;
+    m_readEnd = nullptr;
+    m_backend = Backend::Device;
     m_device = newDevice;
 }
 
@@ -102,32 +104,47 @@ void RawStream::unsetDevice()
 
 bool RawStream::atEnd() const
 {
+    switch (m_backend) {
+    case Backend::ReadBuffer:
+        return m_readPosition >= m_readEnd;
+    case Backend::WriteBuffer:
+        return true;
+    case Backend::Device:
+        break;
+    }
     return m_device ? m_device->atEnd() : true;
 }
 
 int RawStream::bytesAvailable() const
 {
+    switch (m_backend) {
+    case Backend::ReadBuffer:
+        return static_cast<int>(m_readEnd - m_readPosition);
+    case Backend::WriteBuffer:
+        return 0;
+    case Backend::Device:
+        break;
+    }
     return m_device ? static_cast<int>(m_device->bytesAvailable()) : 0;
 }
 
 bool RawStream::writeBytes(const QByteArray &data)
 {
-    m_error = m_error || m_device->write(data) != data.size();
-    return m_error;
+    return write(data.constData(), data.size());
 }
 
-bool RawStream::read(void *data, qint64 size)
+bool RawStream::readFromDevice(void *data, qint64 size)
 {
     if (size) {
-        m_error = m_error || m_device->read(static_cast<char *>(data), size) != size;
+        m_error = m_error || !m_device || m_device->read(static_cast<char *>(data), size) != size;
     }
     return m_error;
 }
 
-bool RawStream::write(const void *data, qint64 size)
+bool RawStream::writeToDevice(const void *data, qint64 size)
 {
     if (size) {
-        m_error = m_error || m_device->write(static_cast<const char *>(data), size) != size;
+        m_error = m_error || !m_device || m_device->write(static_cast<const char *>(data), size) != size;
     }
     return m_error;
 }
@@ -139,11 +156,56 @@ void RawStream::setError(bool error)
 
 QByteArray RawStream::readBytes(int count)
 {
+    if (m_backend == Backend::ReadBuffer) {
+        const int bytes = qBound(0, count, bytesAvailable());
+        const QByteArray result(m_readPosition, bytes);
+        m_readPosition += bytes;
+        m_error = m_error || bytes != count;
+        return result;
+    }
+    if (!m_device) {
+        m_error = m_error || (count != 0);
+        return QByteArray();
+    }
     QByteArray result = m_device->read(count);
     m_error = m_error || result.size() != count;
     return result;
 }
 
+/*!
+  Returns a pointer to the next \a size bytes of the stream data and moves the read position.
+
+  Returns nullptr (and sets the error) if the stream has less than \a size bytes or
+  there is no in-memory data (the device backend).
+*/
+const char *RawStream::readRaw(int size)
+{
+    if (Q_UNLIKELY((m_backend != Backend::ReadBuffer) || (size < 0) || (size > m_readEnd - m_readPosition))) {
+        m_error = true;
+        return nullptr;
+    }
+    const char *result = m_readPosition;
+    m_readPosition += size;
+    return result;
+}
+
+bool RawStream::skipBytes(int count)
+{
+    if (m_backend == Backend::ReadBuffer) {
+        readRaw(count);
+        return m_error;
+    }
+    char buffer[64];
+    while (count > 0) {
+        const int chunkSize = qMin<int>(count, sizeof(buffer));
+        if (readFromDevice(buffer, chunkSize)) {
+            break;
+        }
+        count -= chunkSize;
+    }
+    return m_error;
+}
+
 RawStream &RawStream::operator>>(qint8 &i)
 {
     return protectedRead(i);
@@ -240,13 +302,39 @@ RawStreamEx &RawStreamEx::operator<<(const Telegram::AbridgedLength &data)
     return *this;
 }
 
+/*!
+  Reads a TL bytes value in place and returns a pointer to its data in the stream buffer.
+
+  Should be used only if the stream has the in-memory data (see hasReadBuffer()).
+*/
+const char *RawStreamEx::readBytesView(int *size)
+{
+    Telegram::AbridgedLength length;
+    *this >> length;
+    const char *data = readRaw(static_cast<int>(length));
+    *size = data ? static_cast<int>(length) : 0;
+    skipBytes(length.paddingForAlignment(4));
+    return data;
+}
+
 RawStreamEx &RawStreamEx::operator>>(QByteArray &data)
 {
+    if (hasReadBuffer()) {
+        int size = 0;
+        const char *bytes = readBytesView(&size);
+        if (sharedBytes()) {
+            data = QByteArray::fromRawData(bytes, size);
+        } else {
+            data = QByteArray(bytes, size);
+        }
+        return *this;
+    }
+
     Telegram::AbridgedLength length;
     *this >> length;
     data.resize(static_cast<int>(length));
     read(data.data(), data.size());
-    readBytes(length.paddingForAlignment(4));
+    skipBytes(length.paddingForAlignment(4));
     return *this;
 }
 
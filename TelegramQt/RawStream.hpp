@@ -22,12 +22,16 @@
 
 #include <QByteArray>
 
+#include <cstring>
+
 QT_FORWARD_DECLARE_CLASS(QIODevice)
 
 namespace Telegram {
 
 class AbridgedLength;
 
+// The stream reads and writes in-memory data directly via a cursor over a contiguous buffer.
+// A QIODevice backend is used only if the device is explicitly set.
 class TELEGRAMQT_INTERNAL_EXPORT RawStream
 {
 public:
@@ -50,11 +54,17 @@ public:
     bool error() const { return m_error; }
     void resetError();
 
+    // If enabled, the read byte arrays refer to the stream data instead of a copy,
+    // so the source data must outlive them. Works only for in-memory (not device) data.
+    bool sharedBytes() const { return m_sharedBytes; }
+    void setSharedBytes(bool shared) { m_sharedBytes = shared; }
+
     bool atEnd() const;
     int bytesAvailable() const;
 
     bool writeBytes(const QByteArray &bytes);
     QByteArray readBytes(int count);
+    bool skipBytes(int count);
 
     QByteArray readAll();
 
@@ -83,8 +93,19 @@ public:
     RawStream &operator<<(const QByteArray &data);
 
 protected:
-    bool read(void *data, qint64 size);
-    bool write(const void *data, qint64 size);
+    enum class Backend : quint8 {
+        Device,
+        ReadBuffer,
+        WriteBuffer,
+    };
+
+    inline bool read(void *data, qint64 size);
+    inline bool write(const void *data, qint64 size);
+    bool readFromDevice(void *data, qint64 size);
+    bool writeToDevice(const void *data, qint64 size);
+    void setReadBuffer(const QByteArray &data);
+    bool hasReadBuffer() const { return m_backend == Backend::ReadBuffer; }
+    const char *readRaw(int size);
 
     template<typename Int>
     inline RawStream &protectedWrite(Int i);
@@ -95,9 +116,17 @@ protected:
     void setError(bool error);
 
 private:
+    // m_writeBuffer can point to the own m_buffer and m_readPosition to the buffer data
+    Q_DISABLE_COPY(RawStream)
+
+    QByteArray m_buffer; // The data to read or the written data
+    QByteArray *m_writeBuffer = nullptr;
+    const char *m_readPosition = nullptr;
+    const char *m_readEnd = nullptr;
     QIODevice *m_device = nullptr;
-    bool m_ownDevice = false;
+    Backend m_backend = Backend::Device;
     bool m_error = false;
+    bool m_sharedBytes = false;
 
 };
 
@@ -113,8 +142,39 @@ public:
 
     RawStreamEx &operator>>(Telegram::AbridgedLength &data);
     RawStreamEx &operator<<(const Telegram::AbridgedLength &data);
+
+protected:
+    const char *readBytesView(int *size);
 };
 
+inline bool RawStream::read(void *data, qint64 size)
+{
+    if (Q_LIKELY(m_backend == Backend::ReadBuffer)) {
+        const qint64 available = m_readEnd - m_readPosition;
+        if (Q_UNLIKELY(size > available)) {
+            size = available;
+            m_error = true;
+        }
+        if (size > 0) {
+            std::memcpy(data, m_readPosition, static_cast<size_t>(size));
+            m_readPosition += size;
+        }
+        return m_error;
+    }
+    return readFromDevice(data, size);
+}
+
+inline bool RawStream::write(const void *data, qint64 size)
+{
+    if (Q_LIKELY(m_backend == Backend::WriteBuffer)) {
+        if (size > 0) {
+            m_writeBuffer->append(static_cast<const char *>(data), static_cast<int>(size));
+        }
+        return m_error;
+    }
+    return writeToDevice(data, size);
+}
+
 inline void RawStream::resetError()
 {
     m_error = false;
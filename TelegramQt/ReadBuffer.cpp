@@ -0,0 +1,102 @@
+/*
+   Copyright (C) 2020 Alexandr Akulich <akulichalexander@gmail.com>
+
+   This file is a part of TelegramQt library.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+ */
+
+#include "ReadBuffer.hpp"
+
+#include <cstring>
+
+namespace Telegram {
+
+ReadBuffer::ReadBuffer(int initialCapacity) :
+    m_data(initialCapacity, Qt::Uninitialized)
+{
+}
+
+/*!
+  Returns a pointer to at least \a bytes of writable memory right after the unread data.
+
+  The pointer stays valid until the next call to reserve() or append().
+  Call commit() to make the written bytes available for reading.
+*/
+char *ReadBuffer::reserve(int bytes)
+{
+    if (m_data.size() - m_writePosition >= bytes) {
+        return m_data.data() + m_writePosition;
+    }
+
+    const int pendingBytes = size();
+    if (m_data.size() - pendingBytes >= bytes) {
+        // There is enough room if we move the unread bytes to the front
+        std::memmove(m_data.data(), m_data.constData() + m_readPosition, static_cast<size_t>(pendingBytes));
+    } else {
+        QByteArray grownData(qMax(pendingBytes + bytes, m_data.size() * 2), Qt::Uninitialized);
+        if (pendingBytes) {
+            std::memcpy(grownData.data(), m_data.constData() + m_readPosition, static_cast<size_t>(pendingBytes));
+        }
+        m_data.swap(grownData);
+    }
+    m_readPosition = 0;
+    m_writePosition = pendingBytes;
+    return m_data.data() + m_writePosition;
+}
+
+void ReadBuffer::commit(int bytes)
+{
+    Q_ASSERT(m_writePosition + bytes <= m_data.size());
+    m_writePosition += bytes;
+}
+
+void ReadBuffer::append(const char *data, int bytes)
+{
+    if (bytes <= 0) {
+        return;
+    }
+    std::memcpy(reserve(bytes), data, static_cast<size_t>(bytes));
+    commit(bytes);
+}
+
+/*!
+  Returns the first \a bytes of the unread data without copying.
+
+  The returned array references the buffer memory, so it is valid only until
+  the next write to the buffer. Detach the data if it should outlive the buffer state.
+*/
+QByteArray ReadBuffer::slice(int bytes) const
+{
+    Q_ASSERT(bytes <= size());
+    return QByteArray::fromRawData(data(), bytes);
+}
+
+void ReadBuffer::skip(int bytes)
+{
+    Q_ASSERT(bytes <= size());
+    m_readPosition += bytes;
+    if (m_readPosition == m_writePosition) {
+        // Rewind the cursors to use the buffer from the beginning
+        m_readPosition = 0;
+        m_writePosition = 0;
+    }
+}
+
+void ReadBuffer::clear()
+{
+    // Keep the allocated memory for the future reads
+    m_readPosition = 0;
+    m_writePosition = 0;
+}
+
+} // Telegram namespace
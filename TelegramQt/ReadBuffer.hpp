@@ -0,0 +1,61 @@
+/*
+   Copyright (C) 2020 Alexandr Akulich <akulichalexander@gmail.com>
+
+   This file is a part of TelegramQt library.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+ */
+
+#ifndef TELEGRAM_READ_BUFFER_HPP
+#define TELEGRAM_READ_BUFFER_HPP
+
+#include "telegramqt_global.h"
+
+#include <QByteArray>
+
+namespace Telegram {
+
+// A reusable receive buffer with read and write cursors.
+// Incoming bytes are written directly into the free tail (see reserve() and commit()),
+// consumed bytes are dropped by moving the read cursor (see skip()).
+// The unread bytes are moved to the front only when the tail has no room,
+// so the cost of framing is linear to the amount of received data.
+class TELEGRAMQT_INTERNAL_EXPORT ReadBuffer
+{
+public:
+    explicit ReadBuffer(int initialCapacity = 0);
+
+    int size() const { return m_writePosition - m_readPosition; }
+    bool isEmpty() const { return m_writePosition == m_readPosition; }
+    int capacity() const { return m_data.size(); }
+
+    const char *data() const { return m_data.constData() + m_readPosition; }
+
+    char *reserve(int bytes);
+    void commit(int bytes);
+
+    void append(const char *data, int bytes);
+    void append(const QByteArray &data) { append(data.constData(), data.size()); }
+
+    QByteArray slice(int bytes) const;
+    void skip(int bytes);
+    void clear();
+
+protected:
+    QByteArray m_data;
+    int m_readPosition = 0;
+    int m_writePosition = 0;
+};
+
+} // Telegram namespace
+
+#endif // TELEGRAM_READ_BUFFER_HPP
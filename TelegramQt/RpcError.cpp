@@ -158,6 +158,7 @@ void RpcError::setReason(RpcError::Reason reason, quint32 arg)
         m_type = Internal;
         break;
     case ApiIdInvalid:
+    case ChannelInvalid:
     case DcIdInvalid:
     case FilePartXMissing:
     case FirstnameInvalid:
@@ -172,6 +173,8 @@ void RpcError::setReason(RpcError::Reason reason, quint32 arg)
     case OffsetInvalid: // Offset must be divisible by 1KB
     case PasswordHashInvalid:
     case PeerIdInvalid:
+    case PersistentTimestampEmpty:
+    case PersistentTimestampInvalid:
     case PhoneCodeEmpty:
     case PhoneCodeExpired:
     case PhoneCodeHashEmpty:
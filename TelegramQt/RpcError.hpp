@@ -49,6 +49,7 @@ public:
         AuthKeyInvalid,
         AuthKeyPermEmpty,
         AuthKeyUnregistered,
+        ChannelInvalid,
         DcIdInvalid,
         FileMigrateX,
         FilePartXMissing,
@@ -66,6 +67,8 @@ public:
         OffsetInvalid,
         PasswordHashInvalid,
         PeerIdInvalid,
+        PersistentTimestampEmpty,
+        PersistentTimestampInvalid,
         PhoneCodeEmpty,
         PhoneCodeExpired,
         PhoneCodeHashEmpty,
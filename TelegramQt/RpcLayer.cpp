@@ -18,6 +18,7 @@
 #include "RpcLayer.hpp"
 
 #include "AbridgedLength.hpp"
+#include "CompatibilityLayer.hpp"
 #include "RandomGenerator.hpp"
 #include "RawStream.hpp"
 #include "SendPackageHelper.hpp"
@@ -31,14 +32,23 @@
 
 #include <QLoggingCategory>
 
+#include <openssl/sha.h>
+
+#include <cstring>
+
 Q_LOGGING_CATEGORY(c_baseRpcLayerCategory, "telegram.base.rpclayer", QtWarningMsg)
 Q_LOGGING_CATEGORY(c_baseRpcLayerCategoryIn, "telegram.base.rpclayer.in", QtWarningMsg)
 Q_LOGGING_CATEGORY(c_baseRpcLayerCategoryOut, "telegram.base.rpclayer.out", QtWarningMsg)
 
 namespace Telegram {
 
+// https://core.telegram.org/mtproto/service_messages#packed-object
+static constexpr int c_defaultGzipThreshold = 255;
+
 BaseRpcLayer::BaseRpcLayer(QObject *parent) :
-    QObject(parent)
+    QObject(parent),
+    m_gzipThreshold(c_defaultGzipThreshold),
+    m_deflater(Utils::c_gzipDefaultCompressionLevel)
 {
 }
 
@@ -47,33 +57,86 @@ void BaseRpcLayer::setSendHelper(BaseMTProtoSendHelper *helper)
     m_sendHelper = helper;
 }
 
+// auth_key_id (8 bytes) and msg_key (16 bytes) followed by the encrypted data
+static constexpr int c_encryptedPacketPrefixLength = 24;
+static constexpr int c_messageKeyOffset = 8;
+static constexpr int c_messageKeyLength = 16;
+
+static void calculateMessageKey(char *messageKey, const QByteArray &keyPart, const char *data, int size)
+{
+#ifdef USE_MTProto_V1
+    Q_UNUSED(keyPart)
+    uchar hash[SHA_DIGEST_LENGTH];
+    SHA1(reinterpret_cast<const uchar *>(data), static_cast<size_t>(size), hash);
+    memcpy(messageKey, hash + 4, c_messageKeyLength);
+#else // MTProto_V2
+    // msg_key = substr(SHA256(substr(auth_key, 88 + x, 32) + plaintext + padding), 8, 16)
+    uchar hash[SHA256_DIGEST_LENGTH];
+    SHA256_CTX context;
+    SHA256_Init(&context);
+    SHA256_Update(&context, keyPart.constData(), static_cast<size_t>(keyPart.size()));
+    SHA256_Update(&context, data, static_cast<size_t>(size));
+    SHA256_Final(hash, &context);
+    memcpy(messageKey, hash + 8, c_messageKeyLength);
+#endif
+}
+
+static bool isWorthCompressing(const TLValue value)
+{
+    // File parts are mostly already compressed media
+    switch (value) {
+    case TLValue::UploadSaveFilePart:
+    case TLValue::UploadSaveBigFilePart:
+    case TLValue::UploadFile:
+    case TLValue::UploadCdnFile:
+    case TLValue::UploadWebFile:
+    case TLValue::GzipPacked:
+        return false;
+    default:
+        return true;
+    }
+}
+
 bool BaseRpcLayer::processPacket(const QByteArray &package)
 {
-    if (package.size() < 24) {
+    if (package.size() < c_encryptedPacketPrefixLength) {
         qCWarning(c_baseRpcLayerCategoryIn) << CALL_INFO
                                             << "Packet is too small:" << package.size() << " < 24";
         return false;
     }
     qCDebug(c_baseRpcLayerCategoryIn) << CALL_INFO
                                       << "Read" << package.length() << "bytes:";
+    const int encryptedLength = package.size() - c_encryptedPacketPrefixLength;
+    if (encryptedLength < MTProto::FullMessageHeader::headerLength) {
+        qCWarning(c_baseRpcLayerCategoryIn) << CALL_INFO
+                                            << "Packet is too small to contain the message header";
+        return false;
+    }
     // Encrypted Message
 #ifdef BASE_RPC_IO_DEBUG
     const quint64 *authKeyIdBytes = reinterpret_cast<const quint64*>(package.constData());
 #endif
-    const QByteArray messageKey = package.mid(8, 16);
-    const QByteArray encryptedData = package.mid(24);
-    const Crypto::AesKey key = getDecryptionAesKey(messageKey);
-    const QByteArray decryptedData = Crypto::aesDecrypt(encryptedData, key).left(encryptedData.length());
+    const char *messageKey = package.constData() + c_messageKeyOffset;
+    const Crypto::AesKey key = getDecryptionAesKey(QByteArray::fromRawData(messageKey, c_messageKeyLength));
+
+    // Reserve the buffer to keep the capacity on truncation to the message content below
+    QByteArray decryptedData;
+    decryptedData.reserve(encryptedLength);
+    decryptedData.resize(encryptedLength);
+    if (!Crypto::aesDecrypt(package.constData() + c_encryptedPacketPrefixLength,
+                            decryptedData.data(), encryptedLength, key)) {
+        qCWarning(c_baseRpcLayerCategoryIn) << CALL_INFO << "Unable to decrypt the packet";
+        return false;
+    }
 #ifdef BASE_RPC_IO_DEBUG
     qCDebug(c_baseRpcLayerCategoryIn) << "authKeyId:" << hex << showbase << *authKeyIdBytes;
-    qCDebug(c_baseRpcLayerCategoryIn) << "messageKey:" << messageKey.toHex();
-    qCDebug(c_baseRpcLayerCategoryIn) << "encryptedData:" << encryptedData.toHex();
+    qCDebug(c_baseRpcLayerCategoryIn) << "messageKey:" << QByteArray(messageKey, c_messageKeyLength).toHex();
+    qCDebug(c_baseRpcLayerCategoryIn) << "encryptedData:" << package.mid(c_encryptedPacketPrefixLength).toHex();
     qCDebug(c_baseRpcLayerCategoryIn) << "decryptedData:" << decryptedData.toHex();
 #endif
-    RawStream decryptedStream(decryptedData);
 
     MTProto::FullMessageHeader messageHeader;
-    decryptedStream >> messageHeader;
+    messageHeader.readFrom(decryptedData.constData());
 
 #ifdef DEVELOPER_BUILD
     qCDebug(c_baseRpcLayerCategoryIn) << CALL_INFO << messageHeader;
@@ -84,47 +147,45 @@ bool BaseRpcLayer::processPacket(const QByteArray &package)
         return false;
     }
 
-    if (int(messageHeader.contentLength) > decryptedStream.bytesAvailable()) {
+    const int bytesAvailable = encryptedLength - MTProto::FullMessageHeader::headerLength;
+    if (messageHeader.contentLength > static_cast<quint32>(bytesAvailable)) {
         qCWarning(c_baseRpcLayerCategoryIn) << CALL_INFO << "Expected more data than actually available."
-                                            << "Actual:" << decryptedStream.bytesAvailable()
+                                            << "Actual:" << bytesAvailable
                                             << "Expected:" << messageHeader.contentLength;
         return false;
     }
+    const int contentLength = static_cast<int>(messageHeader.contentLength);
+
+    char expectedMessageKey[c_messageKeyLength];
 #ifdef USE_MTProto_V1
-    QByteArray expectedMessageKey = Utils::sha1(
-                decryptedData.left(MTProto::FullMessageHeader::headerLength + messageHeader.contentLength)).mid(4);
+    calculateMessageKey(expectedMessageKey, QByteArray(), decryptedData.constData(),
+                        MTProto::FullMessageHeader::headerLength + contentLength);
 #else // MTProto_V2
-    QByteArray expectedMessageKey = Utils::sha256(getVerificationKeyPart() + decryptedData).mid(8, 16);
+    calculateMessageKey(expectedMessageKey, getVerificationKeyPart(), decryptedData.constData(), encryptedLength);
 #endif
 
-    if (messageKey != expectedMessageKey) {
+    if (memcmp(messageKey, expectedMessageKey, c_messageKeyLength) != 0) {
         qCWarning(c_baseRpcLayerCategoryIn) << CALL_INFO << "Invalid message key";
         return false;
     }
 
-    QByteArray innerData = decryptedStream.readBytes(messageHeader.contentLength);
-    if (decryptedStream.error()) {
-        qCWarning(c_baseRpcLayerCategoryIn) << CALL_INFO << "Decrypted content read error";
+    // Drop the header and the padding in place
+    memmove(decryptedData.data(),
+            decryptedData.constData() + MTProto::FullMessageHeader::headerLength,
+            static_cast<size_t>(contentLength));
+    decryptedData.resize(contentLength);
+
+    MTProto::Message message(messageHeader, decryptedData);
+    if (!unpackGZipMessage(&message)) {
         return false;
     }
-    MTProto::Message message(messageHeader, innerData);
-    if (message.firstValue() == TLValue::GzipPacked) {
-        qCDebug(c_baseRpcLayerCategoryIn) << CALL_INFO << "message is GzipPacked";
-        QByteArray data;
-        MTProto::Stream packedStream(innerData);
-        TLValue gzipValue;
-        packedStream >> gzipValue;
-        packedStream >> data;
-        data = Utils::unpackGZip(data);
-        message.setData(data);
-    }
     return processMTProtoMessage(message);
 }
 
 Crypto::AesKey BaseRpcLayer::generateAesKey(const QByteArray &messageKey, int x) const
 {
-    const QByteArray authKey = m_sendHelper->authKey();
 #ifdef USE_MTProto_V1
+    const QByteArray authKey = m_sendHelper->authKey();
     QByteArray sha1_a = Utils::sha1(messageKey + authKey.mid(x, 32));
     QByteArray sha1_b = Utils::sha1(authKey.mid(32 + x, 16) + messageKey + authKey.mid(48 + x, 16));
     QByteArray sha1_c = Utils::sha1(authKey.mid(64 + x, 32) + messageKey);
@@ -132,14 +193,128 @@ Crypto::AesKey BaseRpcLayer::generateAesKey(const QByteArray &messageKey, int x)
 
     const QByteArray key = sha1_a.mid(0, 8) + sha1_b.mid(8, 12) + sha1_c.mid(4, 12);
     const QByteArray iv  = sha1_a.mid(8, 12) + sha1_b.left(8) + sha1_c.mid(16, 4) + sha1_d.left(8);
+    return Crypto::AesKey(key, iv);
 #else // MTProto_V2
-    QByteArray sha256_a = Utils::sha256(messageKey + authKey.mid(x, 36));
-    QByteArray sha256_b = Utils::sha256(authKey.mid(40 + x, 36) + messageKey);
-    const QByteArray key = sha256_a.left(8) + sha256_b.mid(8, 16) + sha256_a.mid(24, 8);
-    const QByteArray iv  = sha256_b.left(8) + sha256_a.mid(8, 16) + sha256_b.mid(24, 8);
+    // sha256_a = SHA256(msg_key + substr(auth_key, x, 36))
+    // sha256_b = SHA256(substr(auth_key, 40 + x, 36) + msg_key)
+    const QByteArray &sliceA = m_sendHelper->getAesKeySliceA(x);
+    const QByteArray &sliceB = m_sendHelper->getAesKeySliceB(x);
+    const int messageKeySize = qMin<int>(messageKey.size(), c_messageKeyLength);
+
+    uchar input[c_messageKeyLength + 36];
+    uchar sha256_a[SHA256_DIGEST_LENGTH];
+    uchar sha256_b[SHA256_DIGEST_LENGTH];
+
+    memcpy(input, messageKey.constData(), static_cast<size_t>(messageKeySize));
+    memcpy(input + messageKeySize, sliceA.constData(), static_cast<size_t>(sliceA.size()));
+    SHA256(input, static_cast<size_t>(messageKeySize + sliceA.size()), sha256_a);
+
+    memcpy(input, sliceB.constData(), static_cast<size_t>(sliceB.size()));
+    memcpy(input + sliceB.size(), messageKey.constData(), static_cast<size_t>(messageKeySize));
+    SHA256(input, static_cast<size_t>(sliceB.size() + messageKeySize), sha256_b);
+
+    // key = substr(sha256_a, 0, 8) + substr(sha256_b, 8, 16) + substr(sha256_a, 24, 8)
+    // iv = substr(sha256_b, 0, 8) + substr(sha256_a, 8, 16) + substr(sha256_b, 24, 8)
+    QByteArray key(32, Qt::Uninitialized);
+    QByteArray iv(32, Qt::Uninitialized);
+    char *keyData = key.data();
+    char *ivData = iv.data();
+    memcpy(keyData, sha256_a, 8);
+    memcpy(keyData + 8, sha256_b + 8, 16);
+    memcpy(keyData + 24, sha256_a + 24, 8);
+    memcpy(ivData, sha256_b, 8);
+    memcpy(ivData + 8, sha256_a + 8, 16);
+    memcpy(ivData + 24, sha256_b + 24, 8);
+    return Crypto::AesKey(key, iv);
 #endif
+}
 
-    return Crypto::AesKey(key, iv);
+void BaseRpcLayer::setGzipThreshold(int bytes)
+{
+    m_gzipThreshold = qMax(0, bytes);
+}
+
+void BaseRpcLayer::setGzipCompressionLevel(int level)
+{
+    m_deflater.setCompressionLevel(qBound(0, level, 9));
+}
+
+QByteArray BaseRpcLayer::packGZipIfBeneficial(const QByteArray &data)
+{
+    if (!gzipCompressionLevel() || (data.size() <= m_gzipThreshold)) {
+        return data;
+    }
+    if (!isWorthCompressing(TLValue::firstFromArray(data))) {
+        return data;
+    }
+    QByteArray packedData;
+    // gzip_packed#3072cfa1 packed_data:bytes = Object;
+    // The constructor, the bytes length prefix and the alignment take up to 12 bytes
+    if (!m_deflater.deflate(data, &packedData) || (packedData.size() + 12 >= data.size())) {
+        return data;
+    }
+    MTProto::Stream output(MTProto::Stream::WriteOnly);
+    output << TLValue::GzipPacked;
+    output << packedData;
+    return output.getData();
+}
+
+/*!
+  Inflates the gzip_packed \a packedObject into the \a output.
+
+  The packed data is read in place (without a copy) and inflated by the
+  connection zlib stream into a buffer allocated once for the whole result.
+*/
+bool BaseRpcLayer::unpackGZipPacked(const QByteArray &packedObject, QByteArray *output)
+{
+    // gzip_packed#3072cfa1 packed_data:bytes = Object;
+    const char *data = packedObject.constData();
+    int size = packedObject.size();
+    if ((size < 8) || (TLValue::firstFromArray(packedObject) != TLValue::GzipPacked)) {
+        return false;
+    }
+    data += sizeof(quint32);
+    size -= sizeof(quint32);
+
+    const uchar lengthByte = static_cast<uchar>(data[0]);
+    int length = 0;
+    if (lengthByte < 254) {
+        length = lengthByte;
+        data += 1;
+        size -= 1;
+    } else {
+        length = static_cast<uchar>(data[1])
+                | (static_cast<uchar>(data[2]) << 8)
+                | (static_cast<uchar>(data[3]) << 16);
+        data += 4;
+        size -= 4;
+    }
+    if (length > size) {
+        qCWarning(c_baseRpcLayerCategoryIn) << CALL_INFO << "Truncated gzip_packed object";
+        return false;
+    }
+    return m_inflater.inflate(data, length, output);
+}
+
+/*
+    Replaces the gzip_packed message data with the unpacked one.
+    Returns false if the data can not be unpacked; the message must be dropped then.
+*/
+bool BaseRpcLayer::unpackGZipMessage(MTProto::Message *message)
+{
+    if (message->firstValue() != TLValue::GzipPacked) {
+        return true;
+    }
+    qCDebug(c_baseRpcLayerCategoryIn) << CALL_INFO << "message is GzipPacked";
+    QByteArray data;
+    if (!unpackGZipPacked(message->data, &data)) {
+        qCWarning(c_baseRpcLayerCategoryIn) << CALL_INFO << "Unable to unpack gzip_packed message"
+                                            << TELEGRAMQT_HEX_SHOWBASE << message->messageId
+                                            << "(the message is dropped)";
+        return false;
+    }
+    message->setData(data);
+    return true;
 }
 
 quint32 BaseRpcLayer::contentRelatedMessagesNumber() const
@@ -159,65 +334,81 @@ quint32 BaseRpcLayer::getNextMessageSequenceNumber(MessageType messageType)
 }
 
 bool BaseRpcLayer::sendPacket(const MTProto::Message &message)
+{
+    return sendPacket(message, { message.data });
+}
+
+/*!
+  Sends the message with the content given as a sequence of \a contentParts.
+
+  The parts are copied right into the encryption buffer, so a large
+  payload (e.g. a file chunk) does not need to be joined with the
+  serialized message data beforehand. The header contentLength is ignored
+  and calculated from the parts.
+*/
+bool BaseRpcLayer::sendPacket(const MTProto::MessageHeader &header, std::initializer_list<QByteArray> contentParts)
 {
     if (!m_sendHelper->authId()) {
         qCCritical(c_baseRpcLayerCategoryOut) << CALL_INFO << "Auth key is not set!";
         return 0;
     }
-    QByteArray encryptedPackage;
-    QByteArray messageKey;
     constexpr int c_alignment = 16;
     constexpr int c_v2_minimumPadding = 12;
-    {
-        const MTProto::FullMessageHeader messageHeader(message, serverSalt(), sessionId());
+    int contentLength = 0;
+    for (const QByteArray &part : contentParts) {
+        contentLength += part.size();
+    }
+    MTProto::FullMessageHeader messageHeader(header, serverSalt(), sessionId());
+    messageHeader.contentLength = static_cast<quint32>(contentLength);
 #ifdef DEVELOPER_BUILD
-        qCDebug(c_baseRpcLayerCategoryOut) << "RpcLayer::sendPackage():" << messageHeader;
+    qCDebug(c_baseRpcLayerCategoryOut) << "RpcLayer::sendPackage():" << messageHeader;
 #endif
-        RawStream stream(RawStream::WriteOnly);
-        stream << messageHeader;
-        stream.writeBytes(message.data);
+    const int messageLength = MTProto::FullMessageHeader::headerLength + contentLength;
+    int padding = AbridgedLength::paddingForAlignment(c_alignment, messageLength);
+#ifndef USE_MTProto_V1
+    if (padding < c_v2_minimumPadding) {
+        padding += c_alignment;
+    }
+#endif
+    const int encryptedLength = messageLength + padding;
+
+    // The whole packet is serialized into a single buffer and encrypted in place:
+    // auth_key_id | msg_key | header | payload | padding
+    QByteArray packet(c_encryptedPacketPrefixLength + encryptedLength, Qt::Uninitialized);
+    const quint64 authId = m_sendHelper->authId();
+    memcpy(packet.data(), &authId, sizeof(authId));
+    char *messageKey = packet.data() + c_messageKeyOffset;
+    char *plainData = packet.data() + c_encryptedPacketPrefixLength;
+    messageHeader.writeTo(plainData);
+    char *content = plainData + MTProto::FullMessageHeader::headerLength;
+    for (const QByteArray &part : contentParts) {
+        memcpy(content, part.constData(), static_cast<size_t>(part.size()));
+        content += part.size();
+    }
+    if (padding) {
+        RandomGenerator::instance()->generate(plainData + messageLength, padding);
+    }
 
-        int packageLength = stream.getData().length();
-        int padding = AbridgedLength::paddingForAlignment(c_alignment, packageLength);
 #ifdef USE_MTProto_V1
-        if (padding) {
-            QByteArray randomPadding(padding, Qt::Uninitialized);
-             RandomGenerator::instance()->generate(&randomPadding);
-            stream << randomPadding;
-            packageLength += padding;
-        }
-        const QByteArray data = stream.getData();
-        messageKey = Utils::sha1(data).mid(4);
+    calculateMessageKey(messageKey, QByteArray(), plainData, encryptedLength);
 #else // MTProto_V2
-        if (padding < c_v2_minimumPadding) {
-            padding += c_alignment;
-        }
-        {
-            QByteArray randomPadding(padding, Qt::Uninitialized);
-            RandomGenerator::instance()->generate(&randomPadding);
-            stream << randomPadding;
-            packageLength += padding;
-        }
-        const QByteArray decryptedData = stream.getData();
-        messageKey = Utils::sha256(getEncryptionKeyPart() + decryptedData).mid(8, 16);
+    calculateMessageKey(messageKey, getEncryptionKeyPart(), plainData, encryptedLength);
 #endif
-        const Crypto::AesKey key = getEncryptionAesKey(messageKey);
-        encryptedPackage = Crypto::aesEncrypt(decryptedData, key).left(packageLength);
-
 #ifdef BASE_RPC_IO_DEBUG
-        qCDebug(c_baseRpcLayerCategoryOut) << "authKeyId:"
-                                           << hex << showbase << m_sendHelper->authId();
-        qCDebug(c_baseRpcLayerCategoryOut) << "messageKey:" << messageKey.toHex();
-        qCDebug(c_baseRpcLayerCategoryOut) << "encryptedData:" << encryptedPackage.toHex();
-        qCDebug(c_baseRpcLayerCategoryOut) << "decryptedData:" << decryptedData.toHex();
+    qCDebug(c_baseRpcLayerCategoryOut) << "authKeyId:" << hex << showbase << authId;
+    qCDebug(c_baseRpcLayerCategoryOut) << "messageKey:" << QByteArray(messageKey, c_messageKeyLength).toHex();
+    qCDebug(c_baseRpcLayerCategoryOut) << "decryptedData:" << QByteArray(plainData, encryptedLength).toHex();
 #endif
+    const Crypto::AesKey key = getEncryptionAesKey(QByteArray::fromRawData(messageKey, c_messageKeyLength));
+    if (!Crypto::aesEncrypt(plainData, plainData, encryptedLength, key)) {
+        qCCritical(c_baseRpcLayerCategoryOut) << CALL_INFO << "Unable to encrypt the packet";
+        return false;
     }
+#ifdef BASE_RPC_IO_DEBUG
+    qCDebug(c_baseRpcLayerCategoryOut) << "encryptedData:" << QByteArray(plainData, encryptedLength).toHex();
+#endif
 
-    RawStream output(RawStream::WriteOnly);
-    output << m_sendHelper->authId(); // keyId
-    output << messageKey;
-    output << encryptedPackage;
-    m_sendHelper->sendPacket(output.getData());
+    m_sendHelper->sendPacket(packet);
     return true;
 }
 
@@ -237,26 +428,30 @@ static QLatin1String getModeText(SendMode mode)
 
 quint64 BaseRpcLayer::sendPacket(const QByteArray &buffer, SendMode mode, MessageType messageType)
 {
-    MTProto::Message message;
-    message.setData(buffer);
+    return sendPacket({ buffer }, mode, messageType);
+}
 
+quint64 BaseRpcLayer::sendPacket(std::initializer_list<QByteArray> contentParts, SendMode mode, MessageType messageType)
+{
     if (!m_sendHelper->authId()) {
         qCCritical(c_baseRpcLayerCategoryOut) << CALL_INFO
                                               << "Auth key is not set!";
         return 0;
     }
-    message.messageId = m_sendHelper->newMessageId(mode);
-    message.sequenceNumber = getNextMessageSequenceNumber(messageType);
+    MTProto::MessageHeader header;
+    header.messageId = m_sendHelper->newMessageId(mode);
+    header.sequenceNumber = getNextMessageSequenceNumber(messageType);
+    header.contentLength = 0;
 
     qCDebug(c_baseRpcLayerCategoryOut) << CALL_INFO
             << "(" << getModeText(mode) << "):"
-            << "message" << message.firstValue()
-            << "with id" << message.messageId;
+            << "message" << TLValue::firstFromArray(*contentParts.begin())
+            << "with id" << header.messageId;
 
-    if (!sendPacket(message)) {
+    if (!sendPacket(header, contentParts)) {
         return 0;
     }
-    return message.messageId;
+    return header.messageId;
 }
 
 bool BaseRpcLayer::processMsgContainer(const MTProto::Message &message)
@@ -273,6 +468,10 @@ bool BaseRpcLayer::processMsgContainer(const MTProto::Message &message)
         stream >> header;
         QByteArray innerData = stream.readBytes(header.contentLength);
         MTProto::Message innerMessage(header, innerData);
+        if (!unpackGZipMessage(&innerMessage)) {
+            processed = false;
+            continue;
+        }
 
         // There is no break and the 'processed' variable goes last,
         // so we process next messages even if something fails.
@@ -22,7 +22,10 @@
 
 #include <QObject>
 
+#include <initializer_list>
+
 #include "Crypto/Aes.hpp"
+#include "GZip.hpp"
 
 namespace Telegram {
 
@@ -31,6 +34,7 @@ namespace MTProto {
 class Stream;
 struct FullMessageHeader;
 struct Message;
+struct MessageHeader;
 
 } // MTProto namespace
 
@@ -60,6 +64,13 @@ public:
 
     virtual void onConnectionLost(const QVariantHash &details);
 
+    // Outgoing messages larger than the threshold are sent as gzip_packed if it makes them smaller.
+    // The compression level 0 disables the compression.
+    int gzipThreshold() const { return m_gzipThreshold; }
+    void setGzipThreshold(int bytes);
+    int gzipCompressionLevel() const { return m_deflater.compressionLevel(); }
+    void setGzipCompressionLevel(int level);
+
 protected:
     Crypto::AesKey generateAesKey(const QByteArray &messageKey, int x) const;
     Crypto::AesKey generateClientToServerAesKey(const QByteArray &messageKey) const { return generateAesKey(messageKey, 0); }
@@ -70,13 +81,21 @@ protected:
     virtual QByteArray getEncryptionKeyPart() const = 0;
     virtual QByteArray getVerificationKeyPart() const = 0;
     quint32 getNextMessageSequenceNumber(MessageType messageType);
+    QByteArray packGZipIfBeneficial(const QByteArray &data);
+    bool unpackGZipPacked(const QByteArray &packedObject, QByteArray *output);
+    bool unpackGZipMessage(MTProto::Message *message);
 
     bool sendPacket(const MTProto::Message &message);
+    bool sendPacket(const MTProto::MessageHeader &header, std::initializer_list<QByteArray> contentParts);
     quint64 sendPacket(const QByteArray &buffer, SendMode mode, MessageType messageType);
+    quint64 sendPacket(std::initializer_list<QByteArray> contentParts, SendMode mode, MessageType messageType);
 
     BaseMTProtoSendHelper *m_sendHelper = nullptr;
     quint32 m_sequenceNumber = 0;
     quint32 m_contentRelatedMessages = 0;
+    int m_gzipThreshold;
+    GZipInflater m_inflater;
+    GZipDeflater m_deflater;
 };
 
 } // Telegram namespace
@@ -35,6 +35,8 @@ template bool BaseRpcLayerExtension::processReply(PendingRpcOperation *operation
 template bool BaseRpcLayerExtension::processReply(PendingRpcOperation *operation, TLUploadWebFile *output);
 // End of generated Telegram API reply template specializations
 
+template bool BaseRpcLayerExtension::processSharedReply(PendingRpcOperation *operation, TLUploadFile *output);
+
 UploadRpcLayer::UploadRpcLayer(QObject *parent) :
     BaseRpcLayerExtension(parent)
 {
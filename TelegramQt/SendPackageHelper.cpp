@@ -34,6 +34,15 @@ void BaseMTProtoSendHelper::setAuthKey(const QByteArray &authKey)
         m_authKey = authKey;
         m_authId = Utils::getFingerprints(authKey, Utils::Lower64Bits);
     }
+
+    // Cut the slices once per key instead of once per message
+    m_serverKeyPart = m_authKey.mid(96, 32);
+    m_clientKeyPart = m_authKey.mid(88, 32);
+    for (int i = 0; i < 2; ++i) {
+        const int x = i * 8;
+        m_aesKeySliceA[i] = m_authKey.mid(x, 36);
+        m_aesKeySliceB[i] = m_authKey.mid(40 + x, 36);
+    }
 }
 
 } // Telegram namespace
@@ -45,17 +45,25 @@ public:
     void setDeltaTime(const qint32 newDt);
 
     quint64 authId() const { return m_authId; }
-    QByteArray getServerKeyPart() const { return m_authKey.mid(96, 32); }
-    QByteArray getClientKeyPart() const { return m_authKey.mid(88, 32); }
+    QByteArray getServerKeyPart() const { return m_serverKeyPart; }
+    QByteArray getClientKeyPart() const { return m_clientKeyPart; }
     QByteArray authKey() const { return m_authKey; }
     void setAuthKey(const QByteArray &authKey);
 
+    // The auth key slices hashed together with msg_key on the AES key derivation (x is 0 or 8)
+    const QByteArray &getAesKeySliceA(int x) const { return m_aesKeySliceA[x ? 1 : 0]; }
+    const QByteArray &getAesKeySliceB(int x) const { return m_aesKeySliceB[x ? 1 : 0]; }
+
 protected:
     BaseConnection *m_connection = nullptr;
     quint64 m_lastMessageId = 0;
 
     quint64 m_authId = 0;
     QByteArray m_authKey;
+    QByteArray m_serverKeyPart;
+    QByteArray m_clientKeyPart;
+    QByteArray m_aesKeySliceA[2];
+    QByteArray m_aesKeySliceB[2];
     qint32 m_deltaTime = 0;
 };
 
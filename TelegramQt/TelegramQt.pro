@@ -72,11 +72,14 @@ SOURCES += \
     Connection.cpp \
     ConnectionError.cpp \
     RawStream.cpp \
+    ReadBuffer.cpp \
     Debug.cpp \
     Utils.cpp \
+    GZip.cpp \
     FileRequestDescriptor.cpp \
     TelegramNamespace.cpp \
     LegacySecretReader.cpp \
+    MediaCache.cpp \
     MessagingApi.cpp \
     PendingOperation.cpp \
     PendingRpcOperation.cpp \
@@ -154,14 +157,17 @@ HEADERS += \
     Connection.hpp \
     ConnectionError.hpp \
     RawStream.hpp \
+    ReadBuffer.hpp \
     UniqueLazyPointer.hpp \
     Utils.hpp \
+    GZip.hpp \
     FileRequestDescriptor.hpp \
     TLFunctions.hpp \
     TLTypes.hpp \
     TLNumbers.hpp \
     crypto-rsa.hpp \
     LegacySecretReader.hpp \
+    MediaCache.hpp \
     PendingOperation.hpp \
     PendingOperation_p.hpp \
     PendingRpcOperation.hpp \
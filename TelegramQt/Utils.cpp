@@ -16,9 +16,7 @@
  */
 
 #include "Utils.hpp"
-
-#define ZLIB_CONST
-#include <zlib.h>
+#include "GZip.hpp"
 
 #include <QCryptographicHash>
 #include <QDebug>
@@ -134,38 +132,11 @@ QByteArray Utils::binaryNumberModExp(const QByteArray &data, const QByteArray &m
     return resultNum.toByteArray();
 }
 
-QByteArray Utils::packGZip(const QByteArray &data)
+QByteArray Utils::packGZip(const QByteArray &data, int compressionLevel)
 {
-    z_stream stream;
-    stream.zalloc = nullptr;
-    stream.zfree = nullptr;
-    stream.opaque = nullptr;
-    stream.avail_in = static_cast<uInt>(data.size());
-    stream.next_in = reinterpret_cast<z_const Bytef*>(data.constData());
-
-    constexpr int compressionLevel = 6; // It seems that Telegram uses this compression level
-    int deflateResult = deflateInit2(&stream,
-                                     compressionLevel,
-                                     Z_DEFLATED,
-                                     MAX_WBITS + 16, // (8 to 15) + 16 for gzip
-                                     MAX_MEM_LEVEL,
-                                     Z_DEFAULT_STRATEGY);
-    if (deflateResult != Z_OK) {
-        return QByteArray(); // deflate init failed
-    }
-
-    char buffer[c_gzipBufferSize];
+    GZipDeflater deflater(compressionLevel);
     QByteArray result;
-
-    do {
-        stream.avail_out = c_gzipBufferSize;
-        stream.next_out = reinterpret_cast<Bytef*>(buffer);
-        deflate(&stream, Z_FINISH); // Z_FINISH
-        result.append(buffer, static_cast<int>(c_gzipBufferSize - stream.avail_out));
-    } while (stream.avail_out == 0);
-
-    deflateEnd(&stream);
-
+    deflater.deflate(data, &result);
     return result;
 }
 
@@ -176,40 +147,9 @@ QByteArray Utils::unpackGZip(const QByteArray &data)
         return QByteArray();
     }
 
-    z_stream stream;
-    stream.zalloc = nullptr;
-    stream.zfree = nullptr;
-    stream.opaque = nullptr;
-    stream.avail_in = static_cast<uInt>(data.size());
-    stream.next_in = reinterpret_cast<z_const Bytef*>(data.constData());
-
-    int inflateResult = inflateInit2(&stream, MAX_WBITS + 32); // gzip decoding
-    if (inflateResult != Z_OK) {
-        return QByteArray(); // inflate init failed
-    }
-
-    char buffer[c_gzipBufferSize];
+    GZipInflater inflater;
     QByteArray result;
-
-    do {
-        stream.avail_out = c_gzipBufferSize;
-        stream.next_out = reinterpret_cast<Bytef*>(buffer);
-        inflateResult = inflate(&stream, Z_NO_FLUSH);
-        switch (inflateResult) {
-        case Z_NEED_DICT:
-        case Z_DATA_ERROR:
-        case Z_MEM_ERROR:
-        case Z_STREAM_ERROR:
-            inflateEnd(&stream);
-            return QByteArray();
-        default:
-            break;
-        }
-        result.append(buffer, static_cast<int>(c_gzipBufferSize - stream.avail_out));
-    } while (stream.avail_out == 0);
-
-    inflateEnd(&stream);
-
+    inflater.inflate(data, &result);
     return result;
 }
 
@@ -18,6 +18,7 @@
 #include <QObject>
 
 #include "ApiUtils.hpp"
+#include "BaseTcpTransport.hpp"
 #include "../utils/TestTransport.hpp"
 
 #include <QTest>
@@ -25,6 +26,81 @@
 
 #include <QDateTime>
 
+namespace Telegram {
+
+namespace Test {
+
+class TcpTransport : public BaseTcpTransport
+{
+public:
+    using BaseTcpTransport::BaseTcpTransport;
+
+    void connectToHost(const QString &, quint16) override { }
+
+    void startAbridgedSession() { setSessionType(Abridged); }
+    void startSession(SessionType type) { setSessionType(type); }
+    void feed(const QByteArray &data)
+    {
+        m_readBuffer.append(data);
+        processReadBuffer();
+    }
+};
+
+} // Test namespace
+
+} // Telegram namespace
+
+static QByteArray abridgedFrame(const QByteArray &payload)
+{
+    QByteArray frame;
+    const quint32 length = static_cast<quint32>(payload.size() / 4);
+    if (length < 0x7f) {
+        frame.append(char(length));
+    } else {
+        frame.append(char(0x7f));
+        frame.append(reinterpret_cast<const char *>(&length), 3);
+    }
+    frame.append(payload);
+    return frame;
+}
+
+static void appendUInt32(QByteArray *frame, quint32 value)
+{
+    frame->append(reinterpret_cast<const char *>(&value), 4);
+}
+
+// CRC-32 (IEEE 802.3), computed bitwise to verify the transport implementation
+static quint32 crc32(const QByteArray &data)
+{
+    quint32 crc = 0xffffffffu;
+    for (const char c : data) {
+        crc ^= static_cast<quint8>(c);
+        for (int i = 0; i < 8; ++i) {
+            crc = (crc >> 1) ^ (0xedb88320u & (0u - (crc & 1u)));
+        }
+    }
+    return ~crc;
+}
+
+static QByteArray intermediateFrame(const QByteArray &payload, int paddingLength = 0)
+{
+    QByteArray frame;
+    appendUInt32(&frame, static_cast<quint32>(payload.size() + paddingLength));
+    frame.append(payload);
+    frame.append(QByteArray(paddingLength, char(0x5a)));
+    return frame;
+}
+
+static QByteArray fullFrame(const QByteArray &payload, quint32 packetNumber)
+{
+    QByteArray frame;
+    appendUInt32(&frame, static_cast<quint32>(payload.size() + 12));
+    appendUInt32(&frame, packetNumber);
+    frame.append(payload);
+    appendUInt32(&frame, crc32(frame));
+    return frame;
+}
+
 class tst_CTelegramTransport : public QObject
 {
     Q_OBJECT
@@ -34,6 +110,12 @@ public:
 private slots:
     void testNewMessageId();
     void testNewMessageIdExtra();
+    void abridgedFraming();
+    void intermediateFraming_data();
+    void intermediateFraming();
+    void invalidFrameLength_data();
+    void invalidFrameLength();
+    void benchmarkAbridgedFraming();
 
 };
 
@@ -102,6 +184,165 @@ void tst_CTelegramTransport::testNewMessageIdExtra()
     }
 }
 
+void tst_CTelegramTransport::abridgedFraming()
+{
+    const QVector<QByteArray> payloads = {
+        QByteArray(4, 'a'),
+        QByteArray(0x7e * 4, 'b'), // The longest payload with one byte length
+        QByteArray(0x7f * 4, 'c'), // The shortest payload with four bytes length
+        QByteArray(8, 'd'),
+        QByteArray(4096, 'e'),
+        QByteArray(12, 'f'),
+    };
+    QByteArray stream;
+    for (const QByteArray &payload : payloads) {
+        stream.append(abridgedFrame(payload));
+    }
+
+    // Feed the data with different chunk sizes to split the frames at all possible positions
+    for (int chunkSize : { 1, 3, 7, 64, 509, static_cast<int>(stream.size()) }) {
+        Telegram::Test::TcpTransport transport;
+        transport.startAbridgedSession();
+        QVector<QByteArray> received;
+        connect(&transport, &Telegram::BaseTransport::packetReceived, [&received](const QByteArray &payload) {
+            // The payload references the transport buffer, so we have to make a deep copy
+            received.append(QByteArray(payload.constData(), payload.size()));
+        });
+        for (int offset = 0; offset < stream.size(); offset += chunkSize) {
+            transport.feed(stream.mid(offset, chunkSize));
+        }
+        QCOMPARE(received, payloads);
+    }
+}
+
+void tst_CTelegramTransport::intermediateFraming_data()
+{
+    QTest::addColumn<int>("sessionType");
+
+    QTest::newRow("Intermediate") << int(Telegram::BaseTcpTransport::Intermediate);
+    QTest::newRow("Padded intermediate") << int(Telegram::BaseTcpTransport::PaddedIntermediate);
+    QTest::newRow("Full") << int(Telegram::BaseTcpTransport::FullSize);
+}
+
+void tst_CTelegramTransport::intermediateFraming()
+{
+    QFETCH(int, sessionType);
+    const auto type = static_cast<Telegram::BaseTcpTransport::SessionType>(sessionType);
+
+    // Encrypted-like (non-zero auth key id, 24 + 16 * n bytes) and plain-like packets
+    // to let the padded framing derive the packet length from the packet header
+    QByteArray plainPacket(8, char(0));
+    plainPacket.append(QByteArray(8, 'm'));
+    appendUInt32(&plainPacket, 12);
+    plainPacket.append(QByteArray(12, 'p'));
+    QByteArray errorPacket;
+    appendUInt32(&errorPacket, static_cast<quint32>(-404));
+
+    const QVector<QByteArray> payloads = {
+        QByteArray(24 + 16, 'a'),
+        plainPacket,
+        QByteArray(24 + 16 * 300, 'b'),
+        errorPacket,
+        QByteArray(24 + 16 * 2, 'c'),
+    };
+    QByteArray stream;
+    for (int i = 0; i < payloads.count(); ++i) {
+        const QByteArray &payload = payloads.at(i);
+        switch (type) {
+        case Telegram::BaseTcpTransport::Intermediate:
+            stream.append(intermediateFrame(payload));
+            break;
+        case Telegram::BaseTcpTransport::PaddedIntermediate:
+            stream.append(intermediateFrame(payload, (i * 7) % 16));
+            break;
+        case Telegram::BaseTcpTransport::FullSize:
+            stream.append(fullFrame(payload, static_cast<quint32>(i)));
+            break;
+        default:
+            QFAIL("Unexpected session type");
+        }
+    }
+
+    for (int chunkSize : { 1, 3, 7, 64, 509, static_cast<int>(stream.size()) }) {
+        Telegram::Test::TcpTransport transport;
+        transport.startSession(type);
+        QVector<QByteArray> received;
+        connect(&transport, &Telegram::BaseTransport::packetReceived, [&received](const QByteArray &payload) {
+            received.append(QByteArray(payload.constData(), payload.size()));
+        });
+        for (int offset = 0; offset < stream.size(); offset += chunkSize) {
+            transport.feed(stream.mid(offset, chunkSize));
+        }
+        QCOMPARE(received, payloads);
+    }
+}
+
+void tst_CTelegramTransport::invalidFrameLength_data()
+{
+    QTest::addColumn<int>("sessionType");
+    QTest::addColumn<quint32>("length");
+
+    QTest::newRow("Intermediate too long")
+            << int(Telegram::BaseTcpTransport::Intermediate) << 0x7ffffffcu;
+    QTest::newRow("Intermediate not aligned")
+            << int(Telegram::BaseTcpTransport::Intermediate) << 42u;
+    QTest::newRow("Padded intermediate too long")
+            << int(Telegram::BaseTcpTransport::PaddedIntermediate) << 0x40000001u;
+    QTest::newRow("Full too long")
+            << int(Telegram::BaseTcpTransport::FullSize) << 0xfffffffcu;
+    QTest::newRow("Full too short")
+            << int(Telegram::BaseTcpTransport::FullSize) << 8u;
+}
+
+void tst_CTelegramTransport::invalidFrameLength()
+{
+    QFETCH(int, sessionType);
+    QFETCH(quint32, length);
+
+    QByteArray stream;
+    appendUInt32(&stream, length);
+    appendUInt32(&stream, 0);
+    stream.append(QByteArray(64, 'x'));
+
+    Telegram::Test::TcpTransport transport;
+    transport.startSession(static_cast<Telegram::BaseTcpTransport::SessionType>(sessionType));
+    int receivedPackets = 0;
+    connect(&transport, &Telegram::BaseTransport::packetReceived, [&receivedPackets]() {
+        ++receivedPackets;
+    });
+    int errors = 0;
+    connect(&transport, &Telegram::BaseTransport::errorOccurred, [&errors]() {
+        ++errors;
+    });
+    transport.feed(stream);
+    QCOMPARE(receivedPackets, 0);
+    QCOMPARE(errors, 1);
+    QCOMPARE(transport.sessionType(), Telegram::BaseTcpTransport::Unknown);
+}
+
+void tst_CTelegramTransport::benchmarkAbridgedFraming()
+{
+    constexpr int c_framesCount = 10000;
+    QByteArray stream;
+    for (int i = 0; i < c_framesCount; ++i) {
+        const int payloadSize = (i % 8 + 1) * 16;
+        stream.append(abridgedFrame(QByteArray(payloadSize, char(i))));
+    }
+
+    Telegram::Test::TcpTransport transport;
+    transport.startAbridgedSession();
+    int receivedFrames = 0;
+    connect(&transport, &Telegram::BaseTransport::packetReceived, [&receivedFrames](const QByteArray &) {
+        ++receivedFrames;
+    });
+
+    QBENCHMARK {
+        receivedFrames = 0;
+        transport.feed(stream);
+    }
+    QCOMPARE(receivedFrames, c_framesCount);
+}
+
 QTEST_MAIN(tst_CTelegramTransport)
 
 #include "tst_CTelegramTransport.moc"
@@ -212,6 +212,8 @@ private slots:
     void benchmarkEncodePlacement2();
     void benchmarkEncodePlacement3();
     void benchmarkEncodePlacement4();
+    void benchmarkDecodeObjects_data();
+    void benchmarkDecodeObjects();
     void stringsLimitSerialization();
     void shortStringSerialization();
     void longStringSerialization();
@@ -225,6 +227,7 @@ private slots:
     void recursiveTypeWriteRead();
     void readError();
     void byteArrays();
+    void sharedByteArrays();
     void reqPqData();
 
 };
@@ -461,6 +464,97 @@ void tst_MTProtoStream::shortStringSerialization()
     }
 }
 
+enum class DecodedObjectType {
+    User,
+    Message,
+};
+
+Q_DECLARE_METATYPE(DecodedObjectType)
+
+static constexpr int c_decodedObjectsCount = 100000;
+
+static QByteArray encodeObjects(DecodedObjectType type)
+{
+    TLUser user;
+    user.tlType = TLValue::User;
+    user.flags = TLUser::AccessHash|TLUser::FirstName|TLUser::LastName|TLUser::Username|TLUser::Phone;
+    user.id = 123456;
+    user.accessHash = 0xabcdef0123456789ull;
+    user.firstName = QStringLiteral("First");
+    user.lastName = QStringLiteral("Last name");
+    user.username = QStringLiteral("username");
+    user.phone = QStringLiteral("123456789");
+
+    TLMessage message;
+    message.tlType = TLValue::Message;
+    message.flags = TLMessage::FromId|TLMessage::ReplyToMsgId;
+    message.id = 100;
+    message.fromId = 123456;
+    message.toId.tlType = TLValue::PeerUser;
+    message.toId.userId = 654321;
+    message.replyToMsgId = 99;
+    message.date = 1500000000;
+    message.message = QStringLiteral("Hello, this is a message text of a usual length");
+
+    Telegram::MTProto::Stream stream(Telegram::MTProto::Stream::WriteOnly);
+    for (int i = 0; i < c_decodedObjectsCount; ++i) {
+        if (type == DecodedObjectType::User) {
+            stream << user;
+        } else {
+            stream << message;
+        }
+    }
+    return stream.getData();
+}
+
+template <typename T>
+static bool decodeObjects(Telegram::MTProto::Stream *stream)
+{
+    T object;
+    for (int i = 0; i < c_decodedObjectsCount; ++i) {
+        *stream >> object;
+    }
+    return !stream->error() && stream->atEnd() && object.isValid();
+}
+
+void tst_MTProtoStream::benchmarkDecodeObjects_data()
+{
+    QTest::addColumn<DecodedObjectType>("type");
+    QTest::addColumn<bool>("useDevice");
+
+    QTest::newRow("TLUser (QIODevice)") << DecodedObjectType::User << true;
+    QTest::newRow("TLUser (buffer)") << DecodedObjectType::User << false;
+    QTest::newRow("TLMessage (QIODevice)") << DecodedObjectType::Message << true;
+    QTest::newRow("TLMessage (buffer)") << DecodedObjectType::Message << false;
+}
+
+void tst_MTProtoStream::benchmarkDecodeObjects()
+{
+    QFETCH(DecodedObjectType, type);
+    QFETCH(bool, useDevice);
+
+    const QByteArray encoded = encodeObjects(type);
+    bool decoded = false;
+
+    QBENCHMARK {
+        QBuffer device;
+        Telegram::MTProto::Stream stream;
+        if (useDevice) {
+            device.setData(encoded);
+            device.open(QBuffer::ReadOnly);
+            stream.setDevice(&device);
+        } else {
+            stream.setData(encoded);
+        }
+        if (type == DecodedObjectType::User) {
+            decoded = decodeObjects<TLUser>(&stream);
+        } else {
+            decoded = decodeObjects<TLMessage>(&stream);
+        }
+    }
+    QVERIFY(decoded);
+}
+
 void tst_MTProtoStream::stringsLimitSerialization()
 {
     QList<STestData> data;
@@ -913,6 +1007,50 @@ void tst_MTProtoStream::byteArrays()
     QCOMPARE(array2, a2);
 }
 
+void tst_MTProtoStream::sharedByteArrays()
+{
+    QByteArray output;
+    Telegram::MTProto::Stream stream(&output, /* write */ true);
+    const QByteArray array1 = QByteArrayLiteral("array1");
+    const QByteArray array2 = QByteArray(300, 'x'); // Long length and padding
+    const QString text = QString::fromUtf8("Text \xc3\xa9t\xc3\xa9");
+    const quint32 tail = 0xdeadbeef;
+
+    stream << array1;
+    stream << array2;
+    stream << text;
+    stream << tail;
+
+    Telegram::MTProto::Stream inputStream(output);
+    inputStream.setSharedBytes(true);
+    QByteArray a1;
+    QByteArray a2;
+    QString t;
+    quint32 tailValue = 0;
+    inputStream >> a1;
+    inputStream >> a2;
+    inputStream >> t;
+    inputStream >> tailValue;
+    QVERIFY(!inputStream.error());
+    QVERIFY(inputStream.atEnd());
+    QCOMPARE(a1, array1);
+    QCOMPARE(a2, array2);
+    QCOMPARE(t, text);
+    QCOMPARE(tailValue, tail);
+
+    // The arrays must refer to the source data
+    QCOMPARE(a1.constData(), output.constData() + 1);
+    QCOMPARE(a2.constData(), output.constData() + 8 + 4);
+
+    // A truncated input must not be read out of the bounds
+    Telegram::MTProto::Stream truncatedStream(output.left(8 + 4 + 100));
+    truncatedStream.setSharedBytes(true);
+    truncatedStream >> a1;
+    truncatedStream >> a2;
+    QVERIFY(truncatedStream.error());
+    QVERIFY(a2.isEmpty());
+}
+
 void tst_MTProtoStream::reqPqData()
 {
     TLNumber128 clientNonce;
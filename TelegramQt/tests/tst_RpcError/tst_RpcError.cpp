@@ -68,6 +68,10 @@ void tst_RpcError::errorReasonToString_data()
             << QStringLiteral("PHONE_CODE_EXPIRED")
             << RpcError::PhoneCodeExpired
             << 0u;
+    QTest::newRow("Invalid pts")
+            << QStringLiteral("PERSISTENT_TIMESTAMP_INVALID")
+            << RpcError::PersistentTimestampInvalid
+            << 0u;
     QTest::newRow("Invalid phone number")
             << QStringLiteral("API_ID_INVALID")
             << RpcError::ApiIdInvalid
@@ -18,12 +18,15 @@
 #include <QObject>
 
 #include "BaseTransport.hpp"
+#include "ClientRpcLayer.hpp"
+#include "PendingRpcOperation.hpp"
 #include "RandomGenerator.hpp"
 #include "RpcLayer.hpp"
 #include "SendPackageHelper.hpp"
 #include "TelegramNamespace.hpp"
 #include "../utils/TestTransport.hpp"
 
+#include "IgnoredMessageNotification.hpp"
 #include "MTProto/MessageHeader.hpp"
 
 #include <QTest>
@@ -103,6 +106,8 @@ public:
 
     MTProto::Message lastProcessedMessage() const { return m_lastProcessedMessage; }
 
+    using BaseRpcLayer::packGZipIfBeneficial;
+
     bool processMessageHeader(const MTProto::FullMessageHeader &) override { return true; }
     bool processMTProtoMessage(const MTProto::Message &message) override { m_lastProcessedMessage = message; return false; }
 
@@ -190,6 +195,13 @@ private slots:
     void sendClientRequest();
     void sendServerReply();
     void processServerReply();
+    void sendClientContainer();
+    void sendClientContainerLimits();
+    void resendIgnoredContainer();
+    void clientResendStore();
+    void sendGzipPacked();
+    void benchmarkSendPacket();
+    void benchmarkProcessPacket();
 
 private:
     Telegram::DeterministicGenerator *m_generator = nullptr;
@@ -270,6 +282,334 @@ void tst_RpcLayer::processServerReply()
     QCOMPARE(m.data, data);
 }
 
-QTEST_APPLESS_MAIN(tst_RpcLayer)
+void tst_RpcLayer::sendClientContainer()
+{
+    const QVector<QByteArray> requests = {
+        QByteArrayLiteral("abcd"),
+        QByteArrayLiteral("efghijkl"),
+        QByteArray(64, 'x'),
+    };
+
+    Telegram::Test::Transport transport;
+    Telegram::Test::MTProtoSendHelper sendHelper(&transport);
+    sendHelper.setBaseTimestamp(1537207803787ull);
+    sendHelper.setAuthKey(c_authKey);
+
+    Telegram::Client::RpcLayer clientLayer;
+    clientLayer.setSendHelper(&sendHelper);
+    // Skip the first message to not wrap it into InitConnection
+    clientLayer.setSessionData(123456789ull, 1);
+    clientLayer.setServerSalt(3720780378715ull);
+
+    QSignalSpy sentPackagesSpy(&transport, &Telegram::Test::Transport::packetSent);
+    QVector<quint64> messageIds;
+    for (const QByteArray &request : requests) {
+        Telegram::PendingRpcOperation *operation = new Telegram::PendingRpcOperation(request, &clientLayer);
+        messageIds.append(clientLayer.sendRpc(operation));
+    }
+    QCOMPARE(sentPackagesSpy.count(), 0);
+    QTRY_COMPARE(sentPackagesSpy.count(), 1);
+
+    Telegram::Test::ServerRpcLayer serverLayer;
+    serverLayer.sendHelper()->setAuthKey(c_authKey);
+    serverLayer.processPacket(sentPackagesSpy.takeFirst().first().toByteArray());
+    const Telegram::MTProto::Message container = serverLayer.lastProcessedMessage();
+    QVERIFY(container.firstValue() == Telegram::TLValue::MsgContainer);
+    QVERIFY(container.messageId > messageIds.last());
+    QCOMPARE(container.sequenceNumber % 2, 0u);
+
+    Telegram::RawStream stream(container.skipTLValue().data);
+    quint32 itemsCount = 0;
+    stream >> itemsCount;
+    QCOMPARE(itemsCount, static_cast<quint32>(requests.count()));
+    for (int i = 0; i < requests.count(); ++i) {
+        Telegram::MTProto::MessageHeader header;
+        stream >> header;
+        QCOMPARE(header.messageId, messageIds.at(i));
+        QCOMPARE(header.sequenceNumber, static_cast<quint32>(3 + i * 2));
+        QCOMPARE(stream.readBytes(header.contentLength), requests.at(i));
+    }
+    QVERIFY(stream.atEnd());
+}
+
+void tst_RpcLayer::sendClientContainerLimits()
+{
+    const int headerLength = Telegram::MTProto::MessageHeader::headerLength;
+    const QVector<QByteArray> requests = {
+        QByteArrayLiteral("abcd"),
+        QByteArray(64, 'x'),
+        // Does not fit the container with the messages above
+        QByteArray(8, 'y'),
+        // Bigger than the container size limit
+        QByteArray(200, 'z'),
+    };
+
+    Telegram::Test::Transport transport;
+    Telegram::Test::MTProtoSendHelper sendHelper(&transport);
+    sendHelper.setBaseTimestamp(1537207803787ull);
+    sendHelper.setAuthKey(c_authKey);
+
+    Telegram::Client::RpcLayer clientLayer;
+    clientLayer.setSendHelper(&sendHelper);
+    // Skip the first message to not wrap it into InitConnection
+    clientLayer.setSessionData(123456789ull, 1);
+    clientLayer.setServerSalt(3720780378715ull);
+    clientLayer.setMaxContainerSize(requests.at(0).size() + requests.at(1).size() + headerLength * 2 + 4);
+
+    QSignalSpy sentPackagesSpy(&transport, &Telegram::Test::Transport::packetSent);
+    QVector<quint64> messageIds;
+    for (const QByteArray &request : requests) {
+        Telegram::PendingRpcOperation *operation = new Telegram::PendingRpcOperation(request, &clientLayer);
+        messageIds.append(clientLayer.sendRpc(operation));
+    }
+    // The first container is flushed on the third message, the oversized message flushes the third one
+    QCOMPARE(sentPackagesSpy.count(), 3);
+
+    Telegram::Test::ServerRpcLayer serverLayer;
+    serverLayer.sendHelper()->setAuthKey(c_authKey);
+
+    serverLayer.processPacket(sentPackagesSpy.takeFirst().first().toByteArray());
+    const Telegram::MTProto::Message container = serverLayer.lastProcessedMessage();
+    QVERIFY(container.firstValue() == Telegram::TLValue::MsgContainer);
+    Telegram::RawStream stream(container.skipTLValue().data);
+    quint32 itemsCount = 0;
+    stream >> itemsCount;
+    QCOMPARE(itemsCount, 2u);
+
+    // The messages which do not fit a container are sent alone
+    for (int i = 2; i < requests.count(); ++i) {
+        serverLayer.processPacket(sentPackagesSpy.takeFirst().first().toByteArray());
+        const Telegram::MTProto::Message message = serverLayer.lastProcessedMessage();
+        QCOMPARE(message.messageId, messageIds.at(i));
+        QCOMPARE(message.data, requests.at(i));
+    }
+}
+
+void tst_RpcLayer::resendIgnoredContainer()
+{
+    const QVector<QByteArray> requests = {
+        QByteArrayLiteral("abcd"),
+        QByteArrayLiteral("efghijkl"),
+    };
+
+    Telegram::Test::Transport transport;
+    Telegram::Test::MTProtoSendHelper sendHelper(&transport);
+    sendHelper.setBaseTimestamp(1537207803787ull);
+    sendHelper.setAuthKey(c_authKey);
+
+    Telegram::Client::RpcLayer clientLayer;
+    clientLayer.setSendHelper(&sendHelper);
+    // Skip the first message to not wrap it into InitConnection
+    clientLayer.setSessionData(123456789ull, 1);
+    clientLayer.setServerSalt(3720780378715ull);
+
+    QSignalSpy sentPackagesSpy(&transport, &Telegram::Test::Transport::packetSent);
+    QVector<quint64> messageIds;
+    for (const QByteArray &request : requests) {
+        Telegram::PendingRpcOperation *operation = new Telegram::PendingRpcOperation(request, &clientLayer);
+        messageIds.append(clientLayer.sendRpc(operation));
+    }
+    QTRY_COMPARE(sentPackagesSpy.count(), 1);
+
+    Telegram::Test::ServerRpcLayer serverLayer;
+    serverLayer.sendHelper()->setAuthKey(c_authKey);
+    serverLayer.processPacket(sentPackagesSpy.takeFirst().first().toByteArray());
+    const quint64 containerId = serverLayer.lastProcessedMessage().messageId;
+
+    // bad_msg_notification#a7eff811 bad_msg_id:long bad_msg_seqno:int error_code:int = BadMsgNotification;
+    {
+        Telegram::RawStream stream(Telegram::RawStream::WriteOnly);
+        stream << quint32(Telegram::TLValue::BadMsgNotification);
+        stream << containerId;
+        stream << serverLayer.lastProcessedMessage().sequenceNumber;
+        stream << quint32(Telegram::MTProto::IgnoredMessageNotification::SequenceNumberTooLow);
+        Telegram::MTProto::Message notification;
+        notification.setData(stream.getData());
+        QVERIFY(clientLayer.processIgnoredMessageNotification(notification));
+    }
+
+    // The inner messages are resent with new ids and fixed sequence numbers
+    QTRY_COMPARE(sentPackagesSpy.count(), 1);
+    serverLayer.processPacket(sentPackagesSpy.takeFirst().first().toByteArray());
+    const Telegram::MTProto::Message container = serverLayer.lastProcessedMessage();
+    QVERIFY(container.firstValue() == Telegram::TLValue::MsgContainer);
+    QVERIFY(container.messageId > containerId);
+
+    Telegram::RawStream stream(container.skipTLValue().data);
+    quint32 itemsCount = 0;
+    stream >> itemsCount;
+    QCOMPARE(itemsCount, static_cast<quint32>(requests.count()));
+    for (int i = 0; i < requests.count(); ++i) {
+        Telegram::MTProto::MessageHeader header;
+        stream >> header;
+        QVERIFY(header.messageId > containerId);
+        QCOMPARE(header.sequenceNumber, static_cast<quint32>(3 + i * 2 + 2));
+        QCOMPARE(stream.readBytes(header.contentLength), requests.at(i));
+    }
+}
+
+void tst_RpcLayer::clientResendStore()
+{
+    const QVector<QByteArray> requests = {
+        QByteArrayLiteral("abcd"),
+        QByteArrayLiteral("efghijkl"),
+        QByteArray(64, 'x'),
+    };
+
+    Telegram::Test::Transport transport;
+    Telegram::Test::MTProtoSendHelper sendHelper(&transport);
+    sendHelper.setBaseTimestamp(1537207803787ull);
+    sendHelper.setAuthKey(c_authKey);
+
+    Telegram::Client::RpcLayer clientLayer;
+    clientLayer.setSendHelper(&sendHelper);
+    // Skip the first message to not wrap it into InitConnection
+    clientLayer.setSessionData(123456789ull, 1);
+    clientLayer.setServerSalt(3720780378715ull);
+
+    QSignalSpy sentPackagesSpy(&transport, &Telegram::Test::Transport::packetSent);
+    QVector<quint64> messageIds;
+    QVector<Telegram::PendingRpcOperation *> operations;
+    for (const QByteArray &request : requests) {
+        Telegram::PendingRpcOperation *operation = new Telegram::PendingRpcOperation(request, &clientLayer);
+        operations.append(operation);
+        messageIds.append(clientLayer.sendRpc(operation));
+    }
+    QTRY_COMPARE(sentPackagesSpy.count(), 1);
+    QCOMPARE(clientLayer.resendStoreSize(), requests.at(0).size() + requests.at(1).size() + requests.at(2).size());
+
+    // msgs_ack releases the message, but the operation still waits for the result
+    {
+        Telegram::RawStream stream(Telegram::RawStream::WriteOnly);
+        stream << quint32(Telegram::TLValue::Vector);
+        stream << quint32(1);
+        stream << messageIds.at(0);
+        Telegram::MTProto::Message ack;
+        ack.setData(stream.getData());
+        QVERIFY(clientLayer.processMessageAck(ack));
+    }
+    QCOMPARE(clientLayer.resendStoreSize(), requests.at(1).size() + requests.at(2).size());
+    QVERIFY(!operations.at(0)->isFinished());
+
+    // The result releases the message
+    {
+        Telegram::RawStream stream(Telegram::RawStream::WriteOnly);
+        stream << messageIds.at(1);
+        stream << quint32(Telegram::TLValue::BoolTrue);
+        Telegram::MTProto::Message result;
+        result.setData(stream.getData());
+        QVERIFY(clientLayer.processRpcResult(result));
+    }
+    QVERIFY(operations.at(1)->isFinished());
+    QCOMPARE(clientLayer.resendStoreSize(), requests.at(2).size());
+
+    // The messages without a pending operation are dropped before the older pending ones
+    {
+        const QByteArray request = QByteArrayLiteral("mnop");
+        Telegram::PendingRpcOperation *operation = new Telegram::PendingRpcOperation(request, &clientLayer);
+        clientLayer.sendRpc(operation);
+        QTRY_COMPARE(sentPackagesSpy.count(), 2);
+        QCOMPARE(clientLayer.resendStoreSize(), requests.at(2).size() + request.size());
+        operation->setFinished();
+        clientLayer.setMaxResendStoreSize(requests.at(2).size());
+        QCOMPARE(clientLayer.resendStoreSize(), requests.at(2).size());
+        QVERIFY(!operations.at(2)->isFinished());
+    }
+
+    // The byte budget drops the sent messages, so they can not be resent anymore
+    clientLayer.setMaxResendStoreSize(0);
+    QCOMPARE(clientLayer.resendStoreSize(), 0);
+    QVERIFY(!clientLayer.resendIgnoredMessage(messageIds.at(2)));
+    QVERIFY(operations.at(2)->isFinished());
+    QVERIFY(!operations.at(2)->isSucceeded());
+}
+
+void tst_RpcLayer::sendGzipPacked()
+{
+    QByteArray data;
+    for (int i = 0; i < 64; ++i) {
+        data += QByteArrayLiteral("compressible text ") + QByteArray::number(i);
+    }
+
+    Telegram::Test::ClientRpcLayer rpcLayer;
+    rpcLayer.sendHelper()->setAuthKey(c_authKey);
+    QSignalSpy sentPackagesSpy(rpcLayer.transport(), &Telegram::Test::Transport::packetSent);
+
+    const QByteArray smallData = data.left(rpcLayer.gzipThreshold());
+    QCOMPARE(rpcLayer.packGZipIfBeneficial(smallData), smallData);
+
+    const QByteArray packedData = rpcLayer.packGZipIfBeneficial(data);
+    QVERIFY(packedData.size() < data.size());
+    QVERIFY(Telegram::TLValue::firstFromArray(packedData) == Telegram::TLValue::GzipPacked);
+
+    rpcLayer.sendPackageAsClient(packedData);
+    QCOMPARE(sentPackagesSpy.count(), 1);
+
+    Telegram::Test::ServerRpcLayer serverLayer;
+    serverLayer.sendHelper()->setAuthKey(c_authKey);
+    serverLayer.processPacket(sentPackagesSpy.takeFirst().first().toByteArray());
+    QCOMPARE(serverLayer.lastProcessedMessage().data, data);
+
+    // A message that can not be unpacked is dropped
+    QByteArray corruptedData = packedData;
+    for (int i = 8; i < corruptedData.size(); ++i) {
+        corruptedData[i] = static_cast<char>(~corruptedData.at(i));
+    }
+    const quint64 corruptedMessageId = rpcLayer.sendPackageAsClient(corruptedData);
+    QCOMPARE(sentPackagesSpy.count(), 1);
+    serverLayer.processPacket(sentPackagesSpy.takeFirst().first().toByteArray());
+    QVERIFY(serverLayer.lastProcessedMessage().messageId != corruptedMessageId);
+    QCOMPARE(serverLayer.lastProcessedMessage().data, data);
+
+    rpcLayer.setGzipCompressionLevel(0);
+    QCOMPARE(rpcLayer.packGZipIfBeneficial(data), data);
+}
+
+/*
+    The benchmarks report the time per message. The test does not replace the process allocator,
+    so the allocations per message are measured externally, e.g. with
+    valgrind --tool=dhat ./tst_RpcLayer benchmarkSendPacket -iterations 10000
+    (the total blocks divided by the iterations count, minus the run with -iterations 1).
+*/
+void tst_RpcLayer::benchmarkSendPacket()
+{
+    const QByteArray data(256, 'x');
+
+    Telegram::Test::ClientRpcLayer rpcLayer;
+    rpcLayer.sendHelper()->setAuthKey(c_authKey);
+    int sentPackets = 0;
+    connect(rpcLayer.transport(), &Telegram::Test::Transport::packetSent, [&sentPackets]() {
+        ++sentPackets;
+    });
+
+    int sentMessages = 0;
+    QBENCHMARK {
+        rpcLayer.sendPackageAsClient(data);
+        ++sentMessages;
+    }
+    QCOMPARE(sentPackets, sentMessages);
+}
+
+void tst_RpcLayer::benchmarkProcessPacket()
+{
+    const QByteArray data(256, 'x');
+
+    Telegram::Test::ServerRpcLayer serverLayer;
+    serverLayer.sendHelper()->setAuthKey(c_authKey);
+    QSignalSpy sentPackagesSpy(serverLayer.transport(), &Telegram::Test::Transport::packetSent);
+    serverLayer.sendPackageAsServerReply(data);
+    QCOMPARE(sentPackagesSpy.count(), 1);
+    const QByteArray package = sentPackagesSpy.takeFirst().first().toByteArray();
+
+    Telegram::Test::ClientRpcLayer rpcLayer;
+    rpcLayer.sendHelper()->setAuthKey(c_authKey);
+
+    QBENCHMARK {
+        rpcLayer.processPacket(package);
+    }
+    QCOMPARE(rpcLayer.lastProcessedMessage().data, data);
+}
+
+QTEST_GUILESS_MAIN(tst_RpcLayer)
 
 #include "tst_RpcLayer.moc"
@@ -17,6 +17,7 @@
 
 #include <QObject>
 #include <QTest>
+#include <QVector>
 
 #include "Crypto/AesCtr.hpp"
 
@@ -25,6 +26,7 @@ class tst_crypto : public QObject
     Q_OBJECT
 private slots:
     void aesCtrContext();
+    void aesCtrContextInPlace();
 };
 
 void tst_crypto::aesCtrContext()
@@ -93,6 +95,54 @@ void tst_crypto::aesCtrContext()
     QCOMPARE(words.toHex(), (decrypted31 + decrypted32).toHex());
 }
 
+void tst_crypto::aesCtrContextInPlace()
+{
+    // The same vectors as in aesCtrContext(), processed in place with chunks not aligned to the block size
+    const QByteArray key = QByteArray::fromHex(QByteArrayLiteral("452114b9fbd4a919a27a256821dd1e72"
+                                                                 "13c562f26f94883c4c7449b74fc8fb96"));
+    const QByteArray iv = QByteArray::fromHex(QByteArrayLiteral("d4c0727f2043d69fcc94eb639cc9486a"));
+    const QByteArray decrypted = QByteArray::fromHex(QByteArrayLiteral("c6c021e092aff8f9452114b9fbd4a919"
+                                                                       "a27a256821dd1e7213c562f26f94883c"
+                                                                       "4c7449b74fc8fb96d4c0727f2043d69f"
+                                                                       "cc94eb639cc9486aefefefef39175b65"
+                                                                       "3936a545059585f4cf1bc7b6d62fc9ba"
+                                                                       "0e520c5aded80d0f6159d468b99336cd"));
+    const QByteArray encrypted = QByteArray::fromHex(QByteArrayLiteral("03d6cd84351bfb08df7faa6e2c5b727b"
+                                                                       "6db368b1880ce7d6e1ccec708fbe098a"
+                                                                       "cee6e68f6c0358efcaf9e08dfe593f16"
+                                                                       "dd484f07170c583a61b2c3998de93b24"
+                                                                       "c9f2ce37f3c3116cc43821018460a599"
+                                                                       "c0ed8af0f358ca971c0876503b5d7933"));
+    const QByteArray finalIv = QByteArray::fromHex(QByteArrayLiteral("d4c0727f2043d69fcc94eb639cc94870"));
+    const QByteArray finalEc = QByteArray::fromHex(QByteArrayLiteral("cebf86aa2d80c7987d51a23882ce4ffe"));
+
+    const QVector<QVector<int>> splits = {
+        { 96 },
+        { 5, 11, 27, 1, 52 },
+        { 15, 17, 16, 3, 45 },
+        { 1, 1, 1, 93 },
+        { 33, 63 },
+    };
+    for (const QVector<int> &chunkSizes : splits) {
+        for (const bool encrypt : { true, false }) {
+            Telegram::Crypto::AesCtrContext context;
+            context.setKey(key);
+            context.setIVec(iv);
+            QByteArray data = encrypt ? decrypted : encrypted;
+            int offset = 0;
+            for (int chunkSize : chunkSizes) {
+                QVERIFY(context.crypt(data.data() + offset, chunkSize));
+                offset += chunkSize;
+            }
+            QCOMPARE(offset, data.size());
+            QCOMPARE(data.toHex(), (encrypt ? encrypted : decrypted).toHex());
+            QCOMPARE(context.ivec().toHex(), finalIv.toHex());
+            QCOMPARE(context.ecount().toHex(), finalEc.toHex());
+            QCOMPARE(context.num(), 0u);
+        }
+    }
+}
+
 QTEST_APPLESS_MAIN(tst_crypto)
 
 #include "tst_crypto.moc"
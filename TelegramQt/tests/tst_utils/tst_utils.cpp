@@ -18,13 +18,19 @@
 #include <QObject>
 
 #include "Utils.hpp"
+#include "GZip.hpp"
 #include "TelegramNamespace.hpp"
 #include "RandomGenerator.hpp"
 #include "RsaKey.hpp"
 #include "Crypto/Aes.hpp"
+#include "FileRequestDescriptor.hpp"
+#include "MediaCache.hpp"
 
 #include <QTest>
 #include <QDebug>
+#include <QFile>
+#include <QSaveFile>
+#include <QTemporaryDir>
 
 #include "keys_data.hpp"
 
@@ -48,8 +54,13 @@ private slots:
     void testDeterministicRandom();
     void testGzipPack();
     void testGzipUnpack();
+    void testGzipStreamReuse();
     void testGzipOnDifferentDataSizes_data();
     void testGzipOnDifferentDataSizes();
+    void testInitialDownloadPartSize_data();
+    void testInitialDownloadPartSize();
+    void testAdaptiveDownloadPartSize();
+    void testMediaCache();
 };
 
 void tst_utils::initTestCase()
@@ -286,6 +297,34 @@ void tst_utils::testGzipUnpack()
     QCOMPARE(result.toHex(), c_gzipUnpackedData.toHex());
 }
 
+void tst_utils::testGzipStreamReuse()
+{
+    GZipInflater inflater;
+    GZipDeflater deflater(Utils::c_gzipDefaultCompressionLevel);
+
+    QCOMPARE(GZipInflater::uncompressedSize(c_gzipPackedData.constData(), c_gzipPackedData.size()),
+             static_cast<quint32>(c_gzipUnpackedData.size()));
+
+    QByteArray packed;
+    QByteArray unpacked;
+    for (int i = 0; i < 3; ++i) {
+        QVERIFY(deflater.deflate(c_gzipUnpackedData, &packed));
+        QCOMPARE(packed.toHex(), c_gzipPackedData.toHex());
+        QVERIFY(inflater.inflate(packed, &unpacked));
+        QCOMPARE(unpacked.toHex(), c_gzipUnpackedData.toHex());
+    }
+
+    // Inflate into a caller-provided memory
+    QByteArray arena(c_gzipUnpackedData.size(), Qt::Uninitialized);
+    QCOMPARE(inflater.inflate(packed.constData(), packed.size(), arena.data(), arena.size()), arena.size());
+    QCOMPARE(arena.toHex(), c_gzipUnpackedData.toHex());
+    QCOMPARE(inflater.inflate(packed.constData(), packed.size(), arena.data(), arena.size() - 1), -1);
+
+    // Truncated data
+    QVERIFY(!inflater.inflate(packed.left(packed.size() / 2), &unpacked));
+    QVERIFY(unpacked.isEmpty());
+}
+
 void tst_utils::testGzipOnDifferentDataSizes_data()
 {
     QTest::addColumn<uint>("dataSize");
@@ -314,6 +353,132 @@ void tst_utils::testGzipOnDifferentDataSizes()
     QCOMPARE(unpacked.size(), dataSizeInt);
 }
 
+void tst_utils::testInitialDownloadPartSize_data()
+{
+    QTest::addColumn<uint>("fileSize");
+    QTest::addColumn<uint>("partSize");
+    QTest::newRow("Unknown size") << 0u << 128u * 1024;
+    QTest::newRow("Tiny") << 1000u << 4u * 1024;
+    QTest::newRow("Avatar") << 100000u << 128u * 1024;
+    QTest::newRow("Max part") << 512u * 1024 << 512u * 1024;
+    QTest::newRow("Large") << 512u * 1024 + 1 << 128u * 1024;
+}
+
+void tst_utils::testInitialDownloadPartSize()
+{
+    QFETCH(uint, fileSize);
+    QFETCH(uint, partSize);
+    QCOMPARE(Client::FileRequestDescriptor::initialDownloadPartSize(fileSize), partSize);
+}
+
+void tst_utils::testAdaptiveDownloadPartSize()
+{
+    using Client::FileRequestDescriptor;
+    static constexpr quint32 c_megabyte = 1024 * 1024;
+    const quint32 fileSize = 200 * c_megabyte;
+    FileRequestDescriptor descriptor = FileRequestDescriptor::downloadRequest(2, TLInputFileLocation(), fileSize);
+
+    int requests = 0;
+    quint32 offset = 0;
+    while (offset < fileSize) {
+        const quint32 limit = descriptor.chunkSizeAt(offset);
+        // The getFile constraints
+        QCOMPARE(offset % 1024, 0u);
+        QCOMPARE(limit % 1024, 0u);
+        QCOMPARE(c_megabyte % limit, 0u);
+        QCOMPARE(offset / c_megabyte, (offset + limit - 1) / c_megabyte);
+
+        offset += limit;
+        descriptor.setOffset(offset);
+        // Shrink the chunk on a slow link for a while
+        const qint64 elapsedMs = (requests >= 10) && (requests < 12) ? 5000 : 10;
+        descriptor.updateChunkSize(limit, limit, elapsedMs);
+        ++requests;
+    }
+    QCOMPARE(descriptor.chunkSize(), FileRequestDescriptor::maxDownloadPartSize());
+    QVERIFY(requests < 420);
+
+    // An explicitly set chunk size is fixed
+    descriptor.setChunkSize(32 * 1024);
+    descriptor.updateChunkSize(32 * 1024, 32 * 1024, 10);
+    QCOMPARE(descriptor.chunkSize(), 32u * 1024);
+}
+
+void tst_utils::testMediaCache()
+{
+    using Client::MediaCache;
+    TLInputFileLocation location;
+    location.tlType = TLValue::InputFileLocation;
+    location.volumeId = 0x1234;
+    location.localId = 1;
+    QCOMPARE(MediaCache::getKey(2, location), QStringLiteral("dc2-1234-1"));
+    location.tlType = TLValue::InputDocumentFileLocation;
+    location.id = 0xabcd;
+    QCOMPARE(MediaCache::getKey(2, location), QStringLiteral("doc-abcd"));
+    location.tlType = TLValue::InputEncryptedFileLocation;
+    QVERIFY(MediaCache::getKey(2, location).isEmpty());
+
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+
+    MediaCache cache;
+    QVERIFY(!cache.isEnabled());
+    QVERIFY(!cache.beginWrite(QStringLiteral("a")));
+    cache.setDirectory(dir.path());
+    cache.setMaxSize(250);
+
+    const QByteArray data(100, 'x');
+    for (const QString &key : { QStringLiteral("a"), QStringLiteral("b") }) {
+        QSaveFile *file = cache.beginWrite(key);
+        QVERIFY(file);
+        file->write(data);
+        QVERIFY(cache.commitWrite(key, file));
+    }
+    // A canceled write leaves nothing
+    QSaveFile *canceledFile = cache.beginWrite(QStringLiteral("c"));
+    canceledFile->write(data);
+    cache.cancelWrite(canceledFile);
+    QVERIFY(!cache.contains(QStringLiteral("c")));
+    QCOMPARE(cache.size(), qint64(200));
+
+    // The MIME type is stored along with the file
+    QVERIFY(cache.mimeType(QStringLiteral("a")).isEmpty());
+    {
+        QSaveFile *typedFile = cache.beginWrite(QStringLiteral("a"));
+        typedFile->write(data);
+        QVERIFY(cache.commitWrite(QStringLiteral("a"), typedFile, QStringLiteral("image/jpeg")));
+        QCOMPARE(cache.mimeType(QStringLiteral("a")), QStringLiteral("image/jpeg"));
+        QCOMPARE(cache.size(), qint64(200));
+    }
+
+    // Use "a" to make "b" the least recently used one
+    QFile *cachedFile = cache.openFile(QStringLiteral("a"));
+    QVERIFY(cachedFile);
+    QCOMPARE(cachedFile->readAll(), data);
+    delete cachedFile;
+
+    QSaveFile *file = cache.beginWrite(QStringLiteral("c"));
+    file->write(data);
+    QVERIFY(cache.commitWrite(QStringLiteral("c"), file));
+    QCOMPARE(cache.count(), 2);
+    QVERIFY(cache.contains(QStringLiteral("a")));
+    QVERIFY(!cache.contains(QStringLiteral("b")));
+    QVERIFY(!QFile::exists(dir.path() + QStringLiteral("/b")));
+
+    // The index is restored from the directory
+    MediaCache anotherCache;
+    anotherCache.setMaxSize(250);
+    anotherCache.setDirectory(dir.path());
+    QCOMPARE(anotherCache.count(), 2);
+    QCOMPARE(anotherCache.size(), qint64(200));
+    QCOMPARE(anotherCache.mimeType(QStringLiteral("a")), QStringLiteral("image/jpeg"));
+
+    cache.clear();
+    QCOMPARE(cache.count(), 0);
+    QVERIFY(!QFile::exists(dir.path() + QStringLiteral("/a")));
+    QVERIFY(!QFile::exists(dir.path() + QStringLiteral("/a.type")));
+}
+
 QTEST_APPLESS_MAIN(tst_utils)
 
 #include "tst_utils.moc"
@@ -18,18 +18,33 @@
 #ifndef TELEGRAM_QT_SERVER_IMEDIA_SERVICE_HPP
 #define TELEGRAM_QT_SERVER_IMEDIA_SERVICE_HPP
 
+#include "PendingOperation.hpp"
 #include "ServerNamespace.hpp"
 
-QT_FORWARD_DECLARE_CLASS(QIODevice)
-
 namespace Telegram {
 
 namespace Server {
 
+class PendingImageOperation : public PendingOperation
+{
+public:
+    explicit PendingImageOperation(QObject *parent = nullptr) :
+        PendingOperation(parent)
+    {
+    }
+
+    ImageDescriptor image() const { return m_image; }
+    void setImage(const ImageDescriptor &image) { m_image = image; }
+
+protected:
+    ImageDescriptor m_image;
+};
+
 class IMediaService
 {
 public:
     virtual bool uploadFilePart(quint64 fileId, quint32 filePart, const QByteArray &bytes) = 0;
+    virtual bool uploadBigFilePart(quint64 fileId, quint32 filePart, quint32 totalParts, const QByteArray &bytes) = 0;
     virtual UploadDescriptor getUploadedData(quint64 fileId) const = 0;
     virtual void freeUploadedData(qint64 fileId) = 0;
 
@@ -39,12 +54,12 @@ public:
     virtual FileDescriptor getDocumentFileDescriptor(quint64 fileId,
                                                      quint64 accessHash) const = 0;
 
-    virtual QIODevice *beginReadFile(const FileDescriptor &descriptor) = 0;
-    virtual void endReadFile(QIODevice *device) = 0;
+    // The returned data can refer to a memory-mapped file and is valid until the next call to the service
+    virtual bool readFileChunk(const FileDescriptor &descriptor, quint32 offset, quint32 limit, QByteArray *output) = 0;
 
-    // TODO: Make processImageFile() async and return a PendingOperation?
-    virtual ImageDescriptor processImageFile(const UploadDescriptor &upload,
-                                             const QString &name = QString()) = 0;
+    // The image is decoded and scaled in background; the result is available via the operation image()
+    virtual PendingImageOperation *processImageFile(const UploadDescriptor &upload,
+                                                    const QString &name) = 0;
     virtual FileDescriptor saveDocumentFile(const UploadDescriptor &upload,
                                             const QString &fileName,
                                             const QString &mimeType) = 0;
@@ -19,16 +19,37 @@
 
 #include "ApiUtils.hpp"
 #include "Debug_p.hpp"
+#include "PendingOperation.hpp"
 #include "RandomGenerator.hpp"
 
 #include <QBuffer>
+#include <QDataStream>
 #include <QDir>
+#include <QFile>
 #include <QImage>
 #include <QLoggingCategory>
+#include <QPointer>
+#include <QRunnable>
+#include <QSaveFile>
+
+#include <functional>
 
 Q_LOGGING_CATEGORY(lcMediaService, "telegram.server.media", QtWarningMsg)
 
 static const QString c_storageFileDir = QLatin1String("storage%1/volume%2");
+static const QString c_storageUploadsDir = QLatin1String("storage%1/uploads");
+static const QString c_descriptorsFileSuffix = QLatin1String(".descriptors");
+static const quint32 c_descriptorsFileMagic = 0x54514644; // "TQFD"
+static const quint32 c_descriptorsFileVersion = 1;
+// The stream version must not follow the Qt runtime; the file has to be readable by any build
+static const QDataStream::Version c_descriptorsStreamVersion = QDataStream::Qt_5_6;
+static const int c_readFilesCacheSize = 32;
+static const int c_uploadFilesCacheSize = 32;
+static const quint32 c_uploadExpirationTime = 60 * 60; // seconds since the last written part
+static const quint32 c_uploadsExpirationInterval = 60;
+static const quint32 c_maxFileParts = 4000;
+static const int c_maxFilePartSize = 512 * 1024;
+static const int c_filePartSizeAlignment = 1024;
 
 namespace Telegram {
 
@@ -41,12 +62,36 @@ const QVector<int> ImageSizeDescriptor::Sizes = {
     ImageSizeDescriptor::Max
 };
 
+static void writeFileDescriptor(QDataStream &stream, const FileDescriptor &descriptor)
+{
+    stream << descriptor.volumeId << descriptor.localId << descriptor.secret << descriptor.dcId
+           << descriptor.id << descriptor.accessHash << descriptor.parts << descriptor.date
+           << descriptor.size << descriptor.name << descriptor.md5Checksum << descriptor.mimeType;
+}
+
+static void readFileDescriptor(QDataStream &stream, FileDescriptor *descriptor)
+{
+    stream >> descriptor->volumeId >> descriptor->localId >> descriptor->secret >> descriptor->dcId
+           >> descriptor->id >> descriptor->accessHash >> descriptor->parts >> descriptor->date
+           >> descriptor->size >> descriptor->name >> descriptor->md5Checksum >> descriptor->mimeType;
+}
+
 MediaService::MediaService(QObject *parent) :
-    QObject(parent)
+    QObject(parent),
+    m_readFiles(c_readFilesCacheSize),
+    m_uploadFiles(c_uploadFilesCacheSize)
 {
     RandomGenerator::instance()->generate(&m_lastFileLocalId);
 }
 
+MediaService::~MediaService()
+{
+    // The workers report to the service, so make sure that no one is running
+    m_imageProcessingPool.clear();
+    m_imageProcessingPool.waitForDone();
+    qDeleteAll(m_allFileDescriptors);
+}
+
 quint32 MediaService::dcId() const
 {
     return m_dcId;
@@ -56,20 +101,186 @@ void MediaService::setDcId(quint32 dcId)
 {
     m_dcId = dcId;
     setObjectName(QStringLiteral("MediaService(dc%1)").arg(dcId));
+    removeStaleUploadFiles();
+    loadFileDescriptors();
+}
+
+/*!
+  Loads the descriptors of the files stored by the previous runs.
+
+  The descriptors file is an append-only log; a later record of a file overrides the earlier ones.
+  If the log has superseded (or truncated) records, then it is rewritten with the actual ones.
+*/
+bool MediaService::loadFileDescriptors()
+{
+    QFile file(getDescriptorsFileName(volumeId()));
+    if (!file.exists()) {
+        return true;
+    }
+    if (!file.open(QIODevice::ReadOnly)) {
+        qCWarning(lcMediaService) << CALL_INFO << "Unable to open" << file.fileName();
+        return false;
+    }
+    QDataStream stream(&file);
+    stream.setVersion(c_descriptorsStreamVersion);
+    quint32 magic = 0;
+    quint32 version = 0;
+    stream >> magic >> version;
+    if ((magic != c_descriptorsFileMagic) || (version != c_descriptorsFileVersion)) {
+        qCWarning(lcMediaService) << CALL_INFO << "Invalid descriptors file" << file.fileName();
+        return false;
+    }
+    QVector<FileLocation> loadedLocations; // In order of the first record
+    QSet<FileLocation> loadedLocationsSet;
+    int recordsCount = 0;
+    bool truncated = false;
+    while (!stream.atEnd()) {
+        FileDescriptor descriptor;
+        readFileDescriptor(stream, &descriptor);
+        if (stream.status() != QDataStream::Ok) {
+            qCWarning(lcMediaService) << CALL_INFO << "Truncated descriptors file" << file.fileName();
+            truncated = true;
+            break;
+        }
+        ++recordsCount;
+        const FileLocation location(descriptor.volumeId, descriptor.localId);
+        if (!loadedLocationsSet.contains(location)) {
+            loadedLocationsSet.insert(location);
+            loadedLocations.append(location);
+        }
+        FileDescriptor *existing = m_locationToDescriptor.value(location);
+        if (existing) {
+            m_idToDescriptor.remove(existing->id);
+            *existing = descriptor;
+            m_idToDescriptor.insert(existing->id, existing);
+        } else {
+            insertFileDescriptor(new FileDescriptor(descriptor));
+        }
+        if ((descriptor.volumeId == volumeId()) && (descriptor.localId > m_lastFileLocalId)) {
+            m_lastFileLocalId = descriptor.localId;
+        }
+    }
+    file.close();
+
+    if (truncated || (recordsCount > loadedLocations.count())) {
+        qCDebug(lcMediaService) << CALL_INFO << "Compact" << file.fileName() << recordsCount
+                                << "records to" << loadedLocations.count();
+        QVector<const FileDescriptor *> descriptors;
+        descriptors.reserve(loadedLocations.count());
+        for (const FileLocation &location : loadedLocations) {
+            descriptors.append(m_locationToDescriptor.value(location));
+        }
+        return rewriteFileDescriptors(volumeId(), descriptors);
+    }
+    return true;
 }
 
 bool MediaService::uploadFilePart(quint64 fileId, quint32 filePart, const QByteArray &bytes)
 {
+    return writeFilePart(fileId, filePart, /* totalParts */ 0, bytes);
+}
+
+bool MediaService::uploadBigFilePart(quint64 fileId, quint32 filePart, quint32 totalParts, const QByteArray &bytes)
+{
+    if (!totalParts || (filePart >= totalParts)) {
+        return false;
+    }
+    return writeFilePart(fileId, filePart, totalParts, bytes);
+}
+
+/*!
+  Writes the part right to its place in the upload file.
+
+  All parts except the last one have the same size, so the parts can be received in any order.
+*/
+bool MediaService::writeFilePart(quint64 fileId, quint32 filePart, quint32 totalParts, const QByteArray &bytes)
+{
+    if (!isValidFilePart(m_tmpFiles.value(fileId), filePart, totalParts, bytes.size())) {
+        qCWarning(lcMediaService) << CALL_INFO << "Invalid part" << filePart << "of" << totalParts
+                                  << "with size" << bytes.size() << "for" << fileId;
+        return false;
+    }
     if (!m_tmpFiles.contains(fileId)) {
-        UploadDescriptor newFile;
-        newFile.fileId = fileId;
-        m_tmpFiles.insert(fileId, newFile);
+        expireUploads();
     }
     UploadDescriptor &data = m_tmpFiles[fileId];
-    if (filePart != static_cast<quint32>(data.partList.count())) {
+    QFile *file = m_uploadFiles.object(fileId);
+    if (!file) {
+        QIODevice::OpenMode mode = QIODevice::ReadWrite;
+        if (!data.fileId) {
+            data.fileId = fileId;
+            data.fileName = getUploadsDirName() + QLatin1Char('/') + QString::number(fileId);
+            QDir().mkpath(getUploadsDirName());
+            mode |= QIODevice::Truncate;
+        }
+        file = new QFile(data.fileName);
+        if (!file->open(mode)) {
+            qCWarning(lcMediaService) << CALL_INFO << "Unable to open file" << data.fileName;
+            delete file;
+            m_tmpFiles.remove(fileId);
+            return false;
+        }
+        m_uploadFiles.insert(fileId, file);
+    }
+    if (totalParts) {
+        if (data.totalParts && (data.totalParts != totalParts)) {
+            return false;
+        }
+        data.totalParts = totalParts;
+    }
+
+    const quint32 partSize = static_cast<quint32>(bytes.size());
+    if (!data.partSize) {
+        data.partSize = partSize;
+    } else if (partSize > data.partSize) {
+        // The only received part could be the last (short) one; relocate it to fit the real part size
+        const int lastPart = data.parts.size() - 1;
+        if ((data.parts.count(true) != 1) || !data.parts.testBit(lastPart) || (filePart >= static_cast<quint32>(lastPart))) {
+            qCWarning(lcMediaService) << CALL_INFO << "Unexpected part size" << partSize << "of" << fileId;
+            return false;
+        }
+        file->seek(static_cast<qint64>(lastPart) * data.partSize);
+        const QByteArray lastPartData = file->read(static_cast<qint64>(data.size - static_cast<quint64>(lastPart) * data.partSize));
+        data.partSize = partSize;
+        data.size = static_cast<quint64>(lastPart) * partSize + static_cast<quint64>(lastPartData.size());
+        file->seek(static_cast<qint64>(lastPart) * partSize);
+        file->write(lastPartData);
+    }
+
+    const quint64 offset = static_cast<quint64>(filePart) * data.partSize;
+    if (!file->seek(static_cast<qint64>(offset)) || (file->write(bytes) != bytes.size())) {
+        qCWarning(lcMediaService) << CALL_INFO << "Unable to write part" << filePart << "of" << fileId;
+        return false;
+    }
+    data.size = qMax<quint64>(data.size, offset + partSize);
+    if (filePart >= static_cast<quint32>(data.parts.size())) {
+        data.parts.resize(static_cast<int>(filePart) + 1);
+    }
+    data.parts.setBit(static_cast<int>(filePart));
+    data.lastPartDate = Telegram::Utils::getCurrentTime();
+    return true;
+}
+
+/*!
+  Checks the part against the upload.saveFilePart limits before anything is written:
+  up to 4000 parts of at most 512 KiB, and only the last part can be not aligned to 1 KiB.
+*/
+bool MediaService::isValidFilePart(const UploadDescriptor &data, quint32 filePart, quint32 totalParts, int partSize)
+{
+    if ((partSize <= 0) || (partSize > c_maxFilePartSize)) {
+        return false;
+    }
+    if ((filePart >= c_maxFileParts) || (totalParts > c_maxFileParts)) {
         return false;
     }
-    data.partList.append(bytes);
+    if (partSize % c_filePartSizeAlignment) {
+        const quint32 knownTotalParts = totalParts ? totalParts : data.totalParts;
+        if (knownTotalParts) {
+            return filePart + 1 == knownTotalParts;
+        }
+        // The total number of parts is not known for small files; the last part can not precede received parts
+        return static_cast<int>(filePart) + 1 >= data.parts.size();
+    }
     return true;
 }
 
@@ -80,60 +291,136 @@ UploadDescriptor MediaService::getUploadedData(quint64 fileId) const
 
 void MediaService::freeUploadedData(qint64 fileId)
 {
-    m_tmpFiles.remove(fileId);
+    const quint64 id = static_cast<quint64>(fileId);
+    closeUploadFile(id);
+    const UploadDescriptor data = m_tmpFiles.take(id);
+    if (!data.fileName.isEmpty()) {
+        QFile::remove(data.fileName);
+    }
+}
+
+void MediaService::closeUploadFile(quint64 fileId)
+{
+    QFile *file = m_uploadFiles.take(fileId);
+    if (file) {
+        file->close();
+        delete file;
+    }
+}
+
+/*!
+  Frees the uploads that have not received a part for c_uploadExpirationTime.
+
+  The check is done at most once per c_uploadsExpirationInterval.
+*/
+void MediaService::expireUploads()
+{
+    const quint32 currentTime = Telegram::Utils::getCurrentTime();
+    if (currentTime - m_lastUploadsExpiration < c_uploadsExpirationInterval) {
+        return;
+    }
+    m_lastUploadsExpiration = currentTime;
+
+    QVector<quint64> expiredUploads;
+    for (const UploadDescriptor &data : m_tmpFiles) {
+        if (currentTime - data.lastPartDate >= c_uploadExpirationTime) {
+            expiredUploads.append(data.fileId);
+        }
+    }
+    for (const quint64 fileId : expiredUploads) {
+        qCDebug(lcMediaService) << CALL_INFO << "Expire upload" << fileId;
+        freeUploadedData(static_cast<qint64>(fileId));
+    }
+}
+
+/*!
+  Removes the upload files left by the previous runs (the uploads are not persistent).
+*/
+void MediaService::removeStaleUploadFiles()
+{
+    QDir uploadsDir(getUploadsDirName());
+    if (!uploadsDir.exists()) {
+        return;
+    }
+    const QStringList fileNames = uploadsDir.entryList(QDir::Files);
+    for (const QString &fileName : fileNames) {
+        if (m_tmpFiles.contains(fileName.toULongLong())) {
+            continue;
+        }
+        uploadsDir.remove(fileName);
+    }
 }
 
 FileDescriptor MediaService::getSecretFileDescriptor(quint64 volumeId,
                                                 quint32 localId,
                                                 quint64 secret) const
 {
-    for (const FileDescriptor &descriptor : m_allFileDescriptors) {
-        if ((descriptor.volumeId == volumeId) && (descriptor.localId == localId)) {
-            if (descriptor.secret == secret) {
-                return descriptor;
-            }
-            break;
-        }
+    const FileDescriptor *descriptor = m_locationToDescriptor.value(FileLocation(volumeId, localId));
+    if (descriptor && (descriptor->secret == secret)) {
+        return *descriptor;
     }
     return FileDescriptor();
 }
 
 FileDescriptor MediaService::getDocumentFileDescriptor(quint64 fileId, quint64 accessHash) const
 {
-    for (const FileDescriptor &descriptor : m_allFileDescriptors) {
-        if (descriptor.id == fileId) {
-            if (descriptor.accessHash == accessHash) {
-                return descriptor;
-            }
-            break;
-        }
+    const FileDescriptor *descriptor = m_idToDescriptor.value(fileId);
+    if (descriptor && (descriptor->accessHash == accessHash)) {
+        return *descriptor;
     }
     return FileDescriptor();
 }
 
-QIODevice *MediaService::beginReadFile(const FileDescriptor &descriptor)
+/*!
+  Reads up to \a limit bytes of the file starting from \a offset to the \a output.
+
+  The file is opened (and mapped into memory) once and then kept in a small cache,
+  so the sequential chunk requests of a download slice the data right from the mapping.
+*/
+bool MediaService::readFileChunk(const FileDescriptor &descriptor, quint32 offset, quint32 limit, QByteArray *output)
 {
-    QFile *file = new QFile();
-    m_openFiles.insert(file);
-    file->setFileName(getFileName(descriptor.volumeId, descriptor.localId));
-    qCDebug(lcMediaService) << CALL_INFO << file->fileName();
-    if (!file->open(QIODevice::ReadOnly)) {
-        qCWarning(lcMediaService) << CALL_INFO << "Unable to open file!";
-        return nullptr;
+    ReadFile *readFile = getReadFile(descriptor);
+    if (!readFile) {
+        return false;
     }
-    return file;
+    if (offset >= readFile->size) {
+        output->clear();
+        return true;
+    }
+    const int length = static_cast<int>(qMin<qint64>(limit, readFile->size - offset));
+    if (readFile->data) {
+        *output = QByteArray::fromRawData(reinterpret_cast<const char *>(readFile->data) + offset, length);
+        return true;
+    }
+    if (!readFile->file.seek(offset)) {
+        return false;
+    }
+    *output = readFile->file.read(length);
+    return output->size() == length;
 }
 
-void MediaService::endReadFile(QIODevice *device)
+MediaService::ReadFile *MediaService::getReadFile(const FileDescriptor &descriptor)
 {
-    QFile *file = static_cast<QFile *>(device);
-    if (!m_openFiles.contains(file)) {
-        qCWarning(lcMediaService) << CALL_INFO << "not such file" << device;
-        return;
+    const FileLocation location(descriptor.volumeId, descriptor.localId);
+    ReadFile *readFile = m_readFiles.object(location);
+    if (readFile) {
+        return readFile;
     }
 
-    m_openFiles.remove(file);
-    delete file;
+    readFile = new ReadFile(getFileName(descriptor.volumeId, descriptor.localId));
+    qCDebug(lcMediaService) << CALL_INFO << readFile->file.fileName();
+    if (!readFile->file.open(QIODevice::ReadOnly)) {
+        qCWarning(lcMediaService) << CALL_INFO << "Unable to open file" << readFile->file.fileName();
+        delete readFile;
+        return nullptr;
+    }
+    readFile->size = readFile->file.size();
+    if (readFile->size) {
+        // Fallback to the regular reading if the file can not be mapped
+        readFile->data = readFile->file.map(0, readFile->size);
+    }
+    m_readFiles.insert(location, readFile);
+    return readFile;
 }
 
 QIODevice *MediaService::beginWriteFile()
@@ -158,23 +445,101 @@ FileDescriptor *MediaService::endWriteFile(QIODevice *device, const QString &nam
         return nullptr;
     }
 
-    FileDescriptor result;
-    RandomGenerator::instance()->generate(&result.id);
-    result.dcId = dcId();
-    result.volumeId = volumeId();
-    result.localId = m_lastFileLocalId;
-    RandomGenerator::instance()->generate(&result.secret);
-    result.date = Telegram::Utils::getCurrentTime();
-    result.name = name;
-
     m_openFiles.remove(file);
     file->close();
-    result.size = static_cast<quint32>(file->size());
+    const quint32 size = static_cast<quint32>(file->size());
     delete file;
 
-    m_allFileDescriptors.append(result);
+    return addFileDescriptor(m_lastFileLocalId, size, name);
+}
+
+FileDescriptor *MediaService::addFileDescriptor(quint32 localId, quint32 size, const QString &name)
+{
+    FileDescriptor *result = new FileDescriptor();
+    RandomGenerator::instance()->generate(&result->id);
+    result->dcId = dcId();
+    result->volumeId = volumeId();
+    result->localId = localId;
+    RandomGenerator::instance()->generate(&result->secret);
+    result->date = Telegram::Utils::getCurrentTime();
+    result->name = name;
+    result->size = size;
+
+    insertFileDescriptor(result);
+
+    return result;
+}
+
+/*!
+  Moves the uploaded file into the volume (without copying the data) and registers it.
+*/
+FileDescriptor *MediaService::moveUploadToStorage(const UploadDescriptor &upload, const QString &name)
+{
+    if (!upload.isComplete()) {
+        qCWarning(lcMediaService) << CALL_INFO << "The upload is not complete" << upload.fileId;
+        return nullptr;
+    }
+    closeUploadFile(upload.fileId);
+
+    QDir().mkpath(getVolumeDirName(volumeId()));
+    const quint32 localId = ++m_lastFileLocalId;
+    const QString fileName = getFileName(volumeId(), localId);
+    QFile::remove(fileName);
+    if (!QFile::rename(upload.fileName, fileName)) {
+        qCWarning(lcMediaService) << CALL_INFO << "Unable to move" << upload.fileName << "to" << fileName;
+        return nullptr;
+    }
+    m_tmpFiles.remove(upload.fileId);
+
+    return addFileDescriptor(localId, static_cast<quint32>(upload.size), name);
+}
 
-    return &m_allFileDescriptors.last();
+void MediaService::insertFileDescriptor(FileDescriptor *descriptor)
+{
+    m_allFileDescriptors.append(descriptor);
+    m_locationToDescriptor.insert(FileLocation(descriptor->volumeId, descriptor->localId), descriptor);
+    m_idToDescriptor.insert(descriptor->id, descriptor);
+}
+
+bool MediaService::storeFileDescriptor(const FileDescriptor &descriptor)
+{
+    QFile file(getDescriptorsFileName(descriptor.volumeId));
+    const bool isNew = !file.exists() || (file.size() == 0);
+    if (!file.open(QIODevice::WriteOnly|QIODevice::Append)) {
+        qCWarning(lcMediaService) << CALL_INFO << "Unable to open" << file.fileName();
+        return false;
+    }
+    QDataStream stream(&file);
+    stream.setVersion(c_descriptorsStreamVersion);
+    if (isNew) {
+        stream << c_descriptorsFileMagic << c_descriptorsFileVersion;
+    }
+    writeFileDescriptor(stream, descriptor);
+    return stream.status() == QDataStream::Ok;
+}
+
+/*!
+  Replaces the descriptors file of the volume with a file that contains only the given descriptors.
+*/
+bool MediaService::rewriteFileDescriptors(quint64 volumeId, const QVector<const FileDescriptor *> &descriptors)
+{
+    QSaveFile file(getDescriptorsFileName(volumeId));
+    if (!file.open(QIODevice::WriteOnly)) {
+        qCWarning(lcMediaService) << CALL_INFO << "Unable to open" << file.fileName();
+        return false;
+    }
+    QDataStream stream(&file);
+    stream.setVersion(c_descriptorsStreamVersion);
+    stream << c_descriptorsFileMagic << c_descriptorsFileVersion;
+    for (const FileDescriptor *descriptor : descriptors) {
+        writeFileDescriptor(stream, *descriptor);
+    }
+    if (stream.status() != QDataStream::Ok) {
+        qCWarning(lcMediaService) << CALL_INFO << "Unable to write" << file.fileName();
+        file.cancelWriting();
+        return false;
+    }
+    return file.commit();
 }
 
 QString MediaService::getVolumeDirName(quint64 volumeId) const
@@ -187,79 +552,208 @@ QString MediaService::getFileName(quint64 volumeId, quint32 localId) const
     return getVolumeDirName(volumeId) + QLatin1Char('/') + QString::number(localId);
 }
 
+QString MediaService::getDescriptorsFileName(quint64 volumeId) const
+{
+    return getVolumeDirName(volumeId) + c_descriptorsFileSuffix;
+}
+
+QString MediaService::getUploadsDirName() const
+{
+    return c_storageUploadsDir.arg(dcId());
+}
+
 FileDescriptor MediaService::saveDocumentFile(const UploadDescriptor &upload,
                                          const QString &fileName,
                                          const QString &mimeType)
 {
-    QIODevice *output = beginWriteFile();
-    QByteArray data = upload.partList.join();
-    output->write(data);
-    FileDescriptor *savedFile = endWriteFile(output, fileName);
+    FileDescriptor *savedFile = moveUploadToStorage(upload, fileName);
     if (!savedFile) {
         return FileDescriptor();
     }
     savedFile->mimeType = mimeType;
     RandomGenerator::instance()->generate(&savedFile->accessHash);
+    storeFileDescriptor(*savedFile);
 
     freeUploadedData(upload.fileId);
 
     return *savedFile;
 }
 
-ImageDescriptor MediaService::processImageFile(const UploadDescriptor &upload, const QString &name)
+struct MediaService::ImageProcessingJob
+{
+    struct ProcessedSize
+    {
+        int sizeType = 0;
+        int width = 0;
+        int height = 0;
+        QByteArray data; // PNG
+    };
+
+    MediaService *service = nullptr;
+    QThreadPool *pool = nullptr;
+    quint64 id = 0;
+    UploadDescriptor upload;
+    QString name;
+    QPointer<PendingImageOperation> operation;
+
+    // Written by the workers
+    QImage originalImage;
+    QVector<ProcessedSize> sizes;
+    QAtomicInt pendingSizes;
+};
+
+class ImageProcessingRunnable : public QRunnable
+{
+public:
+    explicit ImageProcessingRunnable(const std::function<void()> &function) :
+        m_function(function)
+    {
+    }
+
+    void run() override { m_function(); }
+
+protected:
+    std::function<void()> m_function;
+};
+
+/*!
+  Starts processing of the uploaded image and returns the operation which finishes
+  once all the image sizes are saved. The result is available via the operation image().
+
+  The image is decoded and the sizes are scaled and encoded in the worker threads
+  (the sizes in parallel), so a big image does not block the server event loop.
+  The files are written and registered back in the service thread.
+*/
+PendingImageOperation *MediaService::processImageFile(const UploadDescriptor &upload, const QString &name)
 {
     if (!upload.fileId) {
-        return ImageDescriptor();
+        return PendingOperation::failOperation<PendingImageOperation>(QLatin1String("Invalid upload"), this);
+    }
+
+    // Close the file to flush the written parts
+    closeUploadFile(upload.fileId);
+
+    QSharedPointer<ImageProcessingJob> job = QSharedPointer<ImageProcessingJob>::create();
+    job->service = this;
+    job->pool = &m_imageProcessingPool;
+    job->id = ++m_lastImageJobId;
+    job->upload = upload;
+    job->name = name;
+
+    PendingImageOperation *operation = new PendingImageOperation(this);
+    operation->setObjectName(QStringLiteral("ProcessImage(file %1)").arg(upload.fileId));
+    operation->deleteOnFinished();
+    job->operation = operation;
+    m_imageJobs.insert(job->id, job);
+
+    m_imageProcessingPool.start(new ImageProcessingRunnable([job]() { decodeImage(job); }));
+    return operation;
+}
+
+void MediaService::decodeImage(const QSharedPointer<ImageProcessingJob> &job)
+{
+    job->originalImage = QImage(job->upload.fileName);
+    if (job->originalImage.isNull()) {
+        reportImageProcessed(job);
+        return;
+    }
+
+    const int imageMaxDimension = qMax(job->originalImage.width(), job->originalImage.height());
+    for (const int maxDimension : ImageSizeDescriptor::Sizes) {
+        ImageProcessingJob::ProcessedSize size;
+        size.sizeType = maxDimension;
+        job->sizes.append(size);
+        if (imageMaxDimension <= maxDimension) {
+            break;
+        }
+    }
+
+    // The vector is not resized anymore, so each worker writes its own item
+    job->pendingSizes.storeRelease(job->sizes.count());
+    for (int i = 0; i < job->sizes.count(); ++i) {
+        job->pool->start(new ImageProcessingRunnable([job, i]() { processImageSize(job, i); }));
+    }
+}
+
+void MediaService::processImageSize(const QSharedPointer<ImageProcessingJob> &job, int sizeIndex)
+{
+    ImageProcessingJob::ProcessedSize &size = job->sizes[sizeIndex];
+    const QImage &originalImage = job->originalImage;
+    const int imageMaxDimension = qMax(originalImage.width(), originalImage.height());
+    QImage sizedImage = originalImage;
+    if (imageMaxDimension > size.sizeType) {
+        sizedImage = originalImage.scaled(size.sizeType, size.sizeType, Qt::KeepAspectRatio);
     }
+    size.width = sizedImage.width();
+    size.height = sizedImage.height();
 
-    QByteArray data = upload.partList.join();
-    QImage originalImage = QImage::fromData(data);
+    QBuffer buffer(&size.data);
+    buffer.open(QIODevice::WriteOnly);
+    if (!sizedImage.save(&buffer, "PNG")) {
+        qCWarning(lcMediaService) << Q_FUNC_INFO << "Unable to save image size" << size.sizeType;
+    }
 
-    if (originalImage.isNull()) {
-        return ImageDescriptor();
+    if (!job->pendingSizes.deref()) {
+        reportImageProcessed(job);
+    }
+}
+
+void MediaService::reportImageProcessed(const QSharedPointer<ImageProcessingJob> &job)
+{
+    QMetaObject::invokeMethod(job->service, "onImageProcessed", Qt::QueuedConnection, Q_ARG(quint64, job->id));
+}
+
+void MediaService::onImageProcessed(quint64 jobId)
+{
+    const QSharedPointer<ImageProcessingJob> job = m_imageJobs.take(jobId);
+    if (!job) {
+        return;
+    }
+    if (job->originalImage.isNull()) {
+        if (job->operation) {
+            job->operation->setFinishedWithTextError(QLatin1String("Unable to decode the image"));
+        }
+        return;
     }
 
     ImageDescriptor result;
     result.date = Telegram::Utils::getCurrentTime();
-    result.id = upload.fileId;
+    result.id = job->upload.fileId;
     result.accessHash = 0xdead;
     result.flags = 0;
 
-    for (const int maxDimension : ImageSizeDescriptor::Sizes) {
-        const int imageMaxDimension = qMax(originalImage.width(), originalImage.height());
-        QImage sizedImage = originalImage;
-        if (imageMaxDimension > maxDimension) {
-            sizedImage = originalImage.scaled(maxDimension, maxDimension, Qt::KeepAspectRatio);
-        }
+    for (const ImageProcessingJob::ProcessedSize &size : job->sizes) {
         QIODevice *output = beginWriteFile();
-        if (!sizedImage.save(output, "PNG")) {
-            qCWarning(lcMediaService) << Q_FUNC_INFO << "Unable to save image size" << maxDimension;
+        output->write(size.data);
+        const FileDescriptor *fileDescriptor = endWriteFile(output, job->name);
+        if (!fileDescriptor) {
+            if (job->operation) {
+                job->operation->setFinishedWithTextError(QLatin1String("Unable to save the image"));
+            }
+            return;
         }
-        const FileDescriptor *fileDescriptor = endWriteFile(output, name);
+        storeFileDescriptor(*fileDescriptor);
 
         ImageSizeDescriptor sizeDescriptor;
-        sizeDescriptor.w = static_cast<quint32>(sizedImage.width());
-        sizeDescriptor.h = static_cast<quint32>(sizedImage.height());
+        sizeDescriptor.w = static_cast<quint32>(size.width);
+        sizeDescriptor.h = static_cast<quint32>(size.height);
         sizeDescriptor.size = fileDescriptor->size;
         sizeDescriptor.fileDescriptor = *fileDescriptor;
-        sizeDescriptor.sizeType = maxDimension;
+        sizeDescriptor.sizeType = size.sizeType;
 
-        if (maxDimension == ImageSizeDescriptor::Small) {
-            QBuffer buffer(&sizeDescriptor.bytes);
-            buffer.open(QIODevice::WriteOnly);
-            sizedImage.save(&buffer, "PNG");
+        if (size.sizeType == ImageSizeDescriptor::Small) {
+            sizeDescriptor.bytes = size.data;
         }
 
         result.sizes.append(sizeDescriptor);
-
-        if (imageMaxDimension <= maxDimension) {
-            break;
-        }
     }
 
-    freeUploadedData(upload.fileId);
+    freeUploadedData(job->upload.fileId);
 
-    return result;
+    if (job->operation) {
+        job->operation->setImage(result);
+        job->operation->setFinished();
+    }
 }
 
 quint64 MediaService::volumeId() const
@@ -20,11 +20,15 @@
 
 #include "IMediaService.hpp"
 
+#include <QCache>
+#include <QFile>
 #include <QHash>
 #include <QObject>
+#include <QPair>
 #include <QSet>
+#include <QSharedPointer>
+#include <QThreadPool>
 
-QT_FORWARD_DECLARE_CLASS(QFile)
 QT_FORWARD_DECLARE_CLASS(QIODevice)
 
 namespace Telegram {
@@ -36,42 +40,89 @@ class MediaService : public QObject, public IMediaService
     Q_OBJECT
 public:
     explicit MediaService(QObject *parent = nullptr);
+    ~MediaService() override;
 
     quint32 dcId() const;
     void setDcId(quint32 dcId);
 
     bool uploadFilePart(quint64 fileId, quint32 filePart, const QByteArray &bytes) override;
+    bool uploadBigFilePart(quint64 fileId, quint32 filePart, quint32 totalParts, const QByteArray &bytes) override;
     UploadDescriptor getUploadedData(quint64 fileId) const override;
     void freeUploadedData(qint64 fileId) override;
 
     FileDescriptor getSecretFileDescriptor(quint64 volumeId, quint32 localId, quint64 secret) const override;
     FileDescriptor getDocumentFileDescriptor(quint64 fileId, quint64 accessHash) const override;
 
-    QIODevice *beginReadFile(const FileDescriptor &descriptor) override;
-    void endReadFile(QIODevice *device) override;
+    bool readFileChunk(const FileDescriptor &descriptor, quint32 offset, quint32 limit, QByteArray *output) override;
 
-    // TODO: Make processImageFile() async and return a PendingOperation?
-    ImageDescriptor processImageFile(const UploadDescriptor &upload, const QString &name = QString()) override;
+    PendingImageOperation *processImageFile(const UploadDescriptor &upload,
+                                            const QString &name) override;
     FileDescriptor saveDocumentFile(const UploadDescriptor &upload,
                                     const QString &fileName,
                                     const QString &mimeType) override;
 
+    bool loadFileDescriptors();
+
 protected:
+    using FileLocation = QPair<quint64, quint32>; // volumeId, localId
+
+    struct ReadFile
+    {
+        explicit ReadFile(const QString &fileName) : file(fileName) { }
+        QFile file;
+        const uchar *data = nullptr; // The file mapping (if the file is mapped)
+        qint64 size = 0;
+    };
+
+    ReadFile *getReadFile(const FileDescriptor &descriptor);
+
+    struct ImageProcessingJob;
+    static void decodeImage(const QSharedPointer<ImageProcessingJob> &job);
+    static void processImageSize(const QSharedPointer<ImageProcessingJob> &job, int sizeIndex);
+    static void reportImageProcessed(const QSharedPointer<ImageProcessingJob> &job);
+
     QIODevice *beginWriteFile();
     FileDescriptor *endWriteFile(QIODevice *device, const QString &name);
+    FileDescriptor *addFileDescriptor(quint32 localId, quint32 size, const QString &name);
+    FileDescriptor *moveUploadToStorage(const UploadDescriptor &upload, const QString &name);
+
+    bool writeFilePart(quint64 fileId, quint32 filePart, quint32 totalParts, const QByteArray &bytes);
+    static bool isValidFilePart(const UploadDescriptor &data, quint32 filePart, quint32 totalParts, int partSize);
+    void closeUploadFile(quint64 fileId);
+    void expireUploads();
+    void removeStaleUploadFiles();
+
+    void insertFileDescriptor(FileDescriptor *descriptor);
+    bool storeFileDescriptor(const FileDescriptor &descriptor);
+    bool rewriteFileDescriptors(quint64 volumeId, const QVector<const FileDescriptor *> &descriptors);
 
     QString getVolumeDirName(quint64 volumeId) const;
     QString getFileName(quint64 volumeId, quint32 localId) const;
+    QString getDescriptorsFileName(quint64 volumeId) const;
+    QString getUploadsDirName() const;
 
     quint64 volumeId() const;
 
-    QVector<FileDescriptor> m_allFileDescriptors;
+protected slots:
+    void onImageProcessed(quint64 jobId);
+
+protected:
+    // The descriptors are allocated one by one and never move, so the pointers are stable
+    QVector<FileDescriptor *> m_allFileDescriptors;
+    QHash<FileLocation, FileDescriptor *> m_locationToDescriptor;
+    QHash<quint64, FileDescriptor *> m_idToDescriptor;
     QHash<quint64, UploadDescriptor> m_tmpFiles;
-    QSet<QFile*> m_openFiles;
+    QCache<quint64, QFile> m_uploadFiles; // Opened files of the recently written uploads
+    QSet<QFile*> m_openFiles; // The files being written by beginWriteFile()
+    QCache<FileLocation, ReadFile> m_readFiles; // Opened (and mapped) files of the recently requested chunks
     quint64 m_lastGlobalId = 0;
     quint64 m_lastTimestamp = 0;
     quint32 m_dcId = 0;
     quint32 m_lastFileLocalId = 0;
+    quint32 m_lastUploadsExpiration = 0;
+    quint64 m_lastImageJobId = 0;
+    QHash<quint64, QSharedPointer<ImageProcessingJob>> m_imageJobs;
+    QThreadPool m_imageProcessingPool;
 };
 
 } // Server namespace
@@ -28,56 +28,114 @@ namespace Telegram {
 
 namespace Server {
 
+// The limit of the interned strings (MIME types are expected to be a small set)
+static const int c_maxInternedStrings = 1024;
+
 MessageService::MessageService(QObject *parent) :
     QObject(parent)
 {
 }
 
+MessageService::~MessageService()
+{
+    for (MessageData *slab : m_slabs) {
+        delete[] slab;
+    }
+}
+
 MessageData *MessageService::addMessage(quint32 fromId, Peer toPeer, const MessageContent &content)
 {
-    ++m_lastGlobalId;
-    m_messages.insert(m_lastGlobalId, MessageData(fromId, toPeer, content));
-    MessageData *message = &m_messages[m_lastGlobalId];
-    message->setDate(Telegram::Utils::getCurrentTime());
-    message->setGlobalId(m_lastGlobalId);
-    return message;
+    return addMessageData(MessageData(fromId, toPeer, internContent(content)));
 }
 
 MessageData *MessageService::addServiceMessage(quint32 fromId, Peer toPeer, const ServiceMessageAction &action)
 {
-    ++m_lastGlobalId;
-    m_messages.insert(m_lastGlobalId, MessageData(fromId, toPeer, action));
-    MessageData *message = &m_messages[m_lastGlobalId];
-    message->setDate(Telegram::Utils::getCurrentTime());
-    message->setGlobalId(m_lastGlobalId);
-    return message;
+    return addMessageData(MessageData(fromId, toPeer, action));
 }
 
 MessageData *MessageService::replaceMessageContent(quint64 globalId, const MessageContent &content)
 {
-    MessageData *message = &m_messages[globalId];
-    message->setContent(content);
+    MessageData *message = getMessageData(globalId);
+    if (!message) {
+        return nullptr;
+    }
+    message->setContent(internContent(content));
     message->setEditDate(Telegram::Utils::getCurrentTime());
     return message;
 }
 
 const MessageData *MessageService::getMessage(quint64 globalId)
 {
-    if (!m_messages.contains(globalId)) {
-        return nullptr;
-    }
-    return &m_messages[globalId];
+    return getMessageData(globalId);
 }
 
 bool MessageService::addMessageReference(quint64 globalId, const Peer &peer, quint32 messageId)
 {
-    if (!m_messages.contains(globalId)) {
+    MessageData *message = getMessageData(globalId);
+    if (!message) {
         return false;
     }
-    m_messages[globalId].addReference(peer, messageId);
+    message->addReference(peer, messageId);
     return true;
 }
 
+MessageData *MessageService::addMessageData(const MessageData &data)
+{
+    const quint64 index = m_lastGlobalId;
+    if (index % c_slabSize == 0) {
+        m_slabs.append(new MessageData[c_slabSize]);
+    }
+    ++m_lastGlobalId;
+    MessageData *message = &m_slabs.last()[index % c_slabSize];
+    *message = data;
+    message->setDate(Telegram::Utils::getCurrentTime());
+    message->setGlobalId(m_lastGlobalId);
+    return message;
+}
+
+MessageData *MessageService::getMessageData(quint64 globalId) const
+{
+    if ((globalId == 0) || (globalId > m_lastGlobalId)) {
+        return nullptr;
+    }
+    const quint64 index = globalId - 1;
+    return &m_slabs.at(static_cast<int>(index / c_slabSize))[index % c_slabSize];
+}
+
+MessageContent MessageService::internContent(const MessageContent &content)
+{
+    // Only the low-cardinality fields are interned; the texts are mostly unique
+    MessageContent result = content;
+    if (result.m_media && !result.m_media->mimeType.isEmpty()) {
+        const QString mimeType = internString(result.m_media->mimeType);
+        if (mimeType.constData() != result.m_media->mimeType.constData()) {
+            QSharedPointer<MediaData> media = QSharedPointer<MediaData>::create(*result.m_media);
+            media->mimeType = mimeType;
+            result.m_media = media;
+        }
+    }
+    return result;
+}
+
+/*!
+  Returns a shared copy of the equal string if there is one.
+  The set is bounded; once it is full the new strings are returned as is.
+*/
+QString MessageService::internString(const QString &string)
+{
+    if (string.isEmpty()) {
+        return string;
+    }
+    auto it = m_strings.constFind(string);
+    if (it != m_strings.constEnd()) {
+        return *it;
+    }
+    if (m_strings.count() < c_maxInternedStrings) {
+        m_strings.insert(string);
+    }
+    return string;
+}
+
 } // Server namespace
 
 } // Telegram namespace
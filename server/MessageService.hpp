@@ -24,6 +24,7 @@
 #include <QHash>
 #include <QObject>
 #include <QSet>
+#include <QVector>
 
 namespace Telegram {
 
@@ -34,6 +35,8 @@ class MessageService : public QObject
     Q_OBJECT
 public:
     explicit MessageService(QObject *parent = nullptr);
+    ~MessageService() override;
+
     MessageData *addMessage(quint32 fromId, Peer toPeer, const MessageContent &content);
     MessageData *addServiceMessage(quint32 fromId, Peer toPeer, const ServiceMessageAction &action);
     MessageData *replaceMessageContent(quint64 globalId, const MessageContent &content);
@@ -41,8 +44,19 @@ public:
 
     bool addMessageReference(quint64 globalId, const Peer &peer, quint32 messageId);
 
+    quint64 messagesCount() const { return m_lastGlobalId; }
+
 protected:
-    QHash<quint64, MessageData> m_messages;
+    MessageData *addMessageData(const MessageData &data);
+    MessageData *getMessageData(quint64 globalId) const;
+    MessageContent internContent(const MessageContent &content);
+    QString internString(const QString &string);
+
+    // The messages are never removed, so the storage is an append-only list of
+    // fixed size slabs addressed by (globalId - 1). The pointers are stable.
+    static constexpr int c_slabSize = 4096;
+    QVector<MessageData *> m_slabs;
+    QSet<QString> m_strings; // The interned MIME types
     quint64 m_lastGlobalId = 0;
 };
 
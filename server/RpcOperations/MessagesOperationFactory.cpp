@@ -41,6 +41,8 @@
 
 #include <QLoggingCategory>
 
+#include <algorithm>
+
 constexpr int c_serverHistorySliceLimit = 30;
 constexpr int c_serverDialogsSliceLimit = 5;
 
@@ -882,9 +884,7 @@ void MessagesRpcOperation::runEditMessage()
         return;
     }
 
-    const QHash<quint32,quint64> messageKeys = selfUser->getPostBox()->getAllMessageKeys();
-
-    const quint64 globalMessageId = messageKeys.value(messageId);
+    const quint64 globalMessageId = selfUser->getPostBox()->getMessageGlobalId(messageId);
     const MessageData *previousData = globalMessageId
             ? api()->messageService()->getMessage(globalMessageId)
             : nullptr;
@@ -1076,58 +1076,42 @@ void MessagesRpcOperation::runGetDialogs()
     TLMessagesDialogs result;
     const LocalUser *selfUser = layer()->getUser();
 
-    const QVector<UserDialog *> dialogs = selfUser->dialogs();
-    result.count = static_cast<quint32>(dialogs.count());
+    const int dialogsCount = selfUser->dialogsCount();
+    result.count = static_cast<quint32>(dialogsCount);
 
-    int dialogsToAdd = qMin(c_serverDialogsSliceLimit, dialogs.count());
+    int dialogsToAdd = qMin(c_serverDialogsSliceLimit, dialogsCount);
     if (arguments.limit) {
         int limit = static_cast<int>(arguments.limit);
         if (limit < dialogsToAdd) {
             dialogsToAdd = limit;
         }
     }
-    if (dialogsToAdd >= dialogs.count()) {
+    if (dialogsToAdd >= dialogsCount) {
         result.tlType = TLValue::MessagesDialogs;
     } else {
         result.tlType = TLValue::MessagesDialogsSlice;
     }
 
-    int fromDialogIndex = 0;
+    QVector<UserDialog *> dialogs;
     if (arguments.offsetId) {
         Peer offsetPeer = api()->getPeer(arguments.offsetPeer, selfUser);
         const UserDialog *offsetDialog = selfUser->getDialog(offsetPeer);
         if (offsetDialog && (offsetDialog->topMessage == arguments.offsetId)) {
-            for (int i = 0; i < dialogs.count(); ++i) {
-                if (dialogs.at(i) == offsetDialog) {
-                    fromDialogIndex = i + 1;
-                    break;
-                }
-            }
+            dialogs = selfUser->getDialogsAfter(offsetDialog, dialogsToAdd);
         } else {
             // Peer not found or top message is changed. Fallback to 'date'.
             // If there is no dialog that matches the filter then there is nothing to return.
-            fromDialogIndex = dialogs.count();
-            for (int i = 0; i < dialogs.count(); ++i) {
-                if (dialogs.at(i)->date <= arguments.offsetDate) {
-                    fromDialogIndex = i;
-                    break;
-                }
-            }
+            dialogs = selfUser->getDialogsBefore(arguments.offsetDate, dialogsToAdd);
         }
+    } else {
+        dialogs = selfUser->getDialogsAfter(nullptr, dialogsToAdd);
     }
 
     QSet<Peer> interestingPeers;
 
-    dialogsToAdd = qMin(dialogsToAdd, dialogs.count() - fromDialogIndex);
-    result.dialogs.reserve(dialogsToAdd);
-
-    for (int i = fromDialogIndex; i < dialogs.count(); ++i) {
-        if (dialogsToAdd <= 0) {
-            break;
-        }
-
-        const UserDialog *dialog = dialogs.at(i);
+    result.dialogs.reserve(dialogs.count());
 
+    for (const UserDialog *dialog : dialogs) {
         TLDialog tlDialog;
         tlDialog.peer = Telegram::Utils::toTLPeer(dialog->peer);
         tlDialog.topMessage = dialog->topMessage;
@@ -1138,9 +1122,6 @@ void MessagesRpcOperation::runGetDialogs()
         tlDialog.unreadCount = dialog->unreadCount;
         tlDialog.unreadMentionsCount = dialog->unreadMentionsCount;
         result.dialogs.append(tlDialog);
-        if (dialogsToAdd) {
-            --dialogsToAdd;
-        }
 
         const PostBox *box = selfUser->getPostBox();
         quint64 topMessageGlobalId = box->getMessageGlobalId(tlDialog.topMessage);
@@ -1239,7 +1220,7 @@ void MessagesRpcOperation::runGetHistory()
 
     const LocalUser *selfUser = layer()->getUser();
     const Peer peer = api()->getPeer(arguments.peer, selfUser);
-    const QHash<quint32,quint64> messageKeys = selfUser->getPostBox()->getAllMessageKeys();
+    const PostBox *box = selfUser->getPostBox();
 
     if (arguments.hash) {
         qCritical() << Q_FUNC_INFO << "Not implemented for requested arguments" << arguments.peer.tlType;
@@ -1248,7 +1229,7 @@ void MessagesRpcOperation::runGetHistory()
         return;
     }
 
-    const int serverLimit = qMin<int>(c_serverHistorySliceLimit, messageKeys.count());
+    const int serverLimit = qMin<int>(c_serverHistorySliceLimit, static_cast<int>(box->lastMessageId()));
     int maxMessagesToAppend = arguments.limit
             ? qMin<int>(static_cast<int>(arguments.limit), serverLimit)
             : serverLimit;
@@ -1259,17 +1240,30 @@ void MessagesRpcOperation::runGetHistory()
     // from inclusive messageId
     const quint32 fromMessageId = arguments.offsetId
             ? arguments.offsetId - 1
-            : selfUser->getPostBox()->lastMessageId();
+            : box->lastMessageId();
+
+    // Seek right to the requested position of the dialog messages (if the peer is set)
+    // or iterate over all box messages otherwise.
+    const QVector<quint32> dialogMessageIds = peer.isValid() ? box->getDialogMessageIds(peer) : QVector<quint32>();
+    int dialogMessageIndex = static_cast<int>(std::upper_bound(dialogMessageIds.cbegin(), dialogMessageIds.cend(), fromMessageId)
+                                              - dialogMessageIds.cbegin());
+    quint32 nextBoxMessageId = fromMessageId;
+    const auto takeMessageId = [&]() -> quint32 {
+        if (peer.isValid()) {
+            return dialogMessageIndex > 0 ? dialogMessageIds.at(--dialogMessageIndex) : 0;
+        }
+        return nextBoxMessageId ? nextBoxMessageId-- : 0;
+    };
 
     // Iterate from newer messages (with bigger id) to older
-    for (quint32 messageId = fromMessageId; (messageId != 0) && (maxMessagesToAppend > 0); --messageId) {
+    for (quint32 messageId = takeMessageId(); (messageId != 0) && (maxMessagesToAppend > 0); messageId = takeMessageId()) {
         if (arguments.minId) {
             if (messageId <= arguments.minId) {
                 break;
             }
         }
 
-        const quint64 globalMessageId = messageKeys.value(messageId);
+        const quint64 globalMessageId = box->getMessageGlobalId(messageId);
         if (!globalMessageId) {
             // It's OK to have no message e.g. for deleted entires
             continue;
@@ -1288,12 +1282,6 @@ void MessagesRpcOperation::runGetHistory()
             }
         }
 
-        if (peer.isValid()) {
-            if (peer != messageData->getDialogPeer(selfUser->id())) {
-                continue;
-            }
-        }
-
         if (arguments.addOffset > 0) {
             --arguments.addOffset;
             continue;
@@ -1567,20 +1555,16 @@ void MessagesRpcOperation::runReadHistory()
     quint32 maxId = qMax(selfUserDialog->topMessage, arguments.maxId);
 
     UserPostBox *selfUserPostBox = selfUser->getPostBox();
-    const QHash<quint32,quint64> messageKeys = selfUserPostBox->getAllMessageKeys();
-
-    for (quint32 messageId = maxId; messageId > selfUserDialog->readInboxMaxId; --messageId) {
-        const quint64 globalMessageId = messageKeys.value(messageId);
-        if (!globalMessageId) {
-            // It's OK to have no message e.g. for deleted entires
-            continue;
-        }
-
-        const MessageData *messageData = api()->messageService()->getMessage(globalMessageId);
-        if (messageData->getDialogPeer(selfUser->id()) != targetPeer) {
-            continue;
+    const QVector<quint32> dialogMessageIds = selfUserPostBox->getDialogMessageIds(targetPeer);
+
+    // Walk the dialog messages from maxId down to the read ones
+    auto messageIt = std::upper_bound(dialogMessageIds.cbegin(), dialogMessageIds.cend(), maxId);
+    while (messageIt != dialogMessageIds.cbegin()) {
+        --messageIt;
+        const quint32 messageId = *messageIt;
+        if (messageId <= selfUserDialog->readInboxMaxId) {
+            break;
         }
-
         affectedMessages.append(messageId);
     }
 
@@ -1619,17 +1603,16 @@ void MessagesRpcOperation::runReadHistory()
     result.pts = selfUser->getPostBox()->pts();
     sendRpcReply(result);
 
-    if (selfUser->activeSessions().count() > 1) {
-        UpdateNotification readNotification;
-        readNotification.userId = selfUser->userId();
-        readNotification.type = UpdateNotification::Type::ReadInbox;
-        readNotification.date = requestDate;
-        readNotification.pts = result.pts;
-        readNotification.messageId = maxId;
-        readNotification.dialogPeer = targetPeer;
-        readNotification.excludeSession = layer()->session();
-        api()->queueUpdates({readNotification});
-    }
+    // Notify other sessions (if any) and record the update in the journal
+    UpdateNotification readNotification;
+    readNotification.userId = selfUser->userId();
+    readNotification.type = UpdateNotification::Type::ReadInbox;
+    readNotification.date = requestDate;
+    readNotification.pts = result.pts;
+    readNotification.messageId = maxId;
+    readNotification.dialogPeer = targetPeer;
+    readNotification.excludeSession = layer()->session();
+    api()->queueUpdates({readNotification});
 }
 
 void MessagesRpcOperation::runReadMentions()
@@ -1856,16 +1839,10 @@ void MessagesRpcOperation::runSendMedia()
     {
         const TLInputFile &inFile = arguments.media.file;
         const UploadDescriptor upload = api()->mediaService()->getUploadedData(inFile.id);
-        ImageDescriptor image = api()->mediaService()->processImageFile(upload, inFile.name);
-        if (!image.isValid()) {
-            sendRpcError(RpcError());
-            return;
-        }
-
-        media.type = MediaData::Photo;
-        media.caption = arguments.media.caption;
-        media.image = image;
-        break;
+        // The message is submitted once the image is processed
+        PendingImageOperation *op = api()->mediaService()->processImageFile(upload, inFile.name);
+        op->connectToFinished(this, &MessagesRpcOperation::onSendMediaImageProcessed, op);
+        return;
     }
     case TLValue::InputMediaUploadedDocument:
     {
@@ -2083,6 +2060,30 @@ void MessagesRpcOperation::setRunMethod(MessagesRpcOperation::RunMethod method)
     m_runMethod = method;
 }
 
+void MessagesRpcOperation::onSendMediaImageProcessed(PendingImageOperation *operation)
+{
+    MTProto::Functions::TLMessagesSendMedia &arguments = m_sendMedia;
+    if (!operation->isSucceeded() || !operation->image().isValid()) {
+        sendRpcError(RpcError());
+        return;
+    }
+
+    LocalUser *selfUser = layer()->getUser();
+    MessageRecipient *recipient = api()->getRecipient(arguments.peer, selfUser);
+    if (!recipient) {
+        sendRpcError(RpcError::PeerIdInvalid);
+        return;
+    }
+
+    MediaData media;
+    media.type = MediaData::Photo;
+    media.caption = arguments.media.caption;
+    media.image = operation->image();
+
+    MessageData *messageData = api()->messageService()->addMessage(selfUser->id(), recipient->toPeer(), media);
+    submitMessageData(messageData, arguments.randomId);
+}
+
 void MessagesRpcOperation::submitMessageData(MessageData *messageData, quint64 randomId)
 {
     if (!messageData) {
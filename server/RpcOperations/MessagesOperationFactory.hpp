@@ -19,6 +19,7 @@
 #define MESSAGES_OPERATION_FACTORY_HPP
 
 #include "RpcOperationFactory.hpp"
+#include "ServerNamespace.hpp"
 #include "ServerRpcOperation.hpp"
 
 #include <QObject>
@@ -27,6 +28,8 @@ namespace Telegram {
 
 namespace Server {
 
+class PendingImageOperation;
+
 class MessageData;
 
 class MessagesRpcOperation : public RpcOperation
@@ -235,6 +238,7 @@ protected:
 
     void setRunMethod(RunMethod method);
 
+    void onSendMediaImageProcessed(PendingImageOperation *operation);
     void editMessageData(MessageData *messageData, quint64 randomId);
     void submitMessageData(MessageData *messageData, quint64 randomId);
 
@@ -138,9 +138,25 @@ void PhotosRpcOperation::runUploadProfilePhoto()
         return;
     }
 
-    const ImageDescriptor image = api()->mediaService()->processImageFile(upload, arguments.file.name);
+    PendingImageOperation *op = api()->mediaService()->processImageFile(upload, arguments.file.name);
+    op->connectToFinished(this, &PhotosRpcOperation::onUploadedProfilePhotoProcessed, op);
+}
+// End of generated run methods
+
+void PhotosRpcOperation::setRunMethod(PhotosRpcOperation::RunMethod method)
+{
+    m_runMethod = method;
+}
+
+void PhotosRpcOperation::onUploadedProfilePhotoProcessed(PendingImageOperation *operation)
+{
+    if (!operation->isSucceeded()) {
+        sendRpcError(RpcError::UnknownReason);
+        return;
+    }
 
     LocalUser *selfUser = layer()->getUser();
+    const ImageDescriptor image = operation->image();
 
     selfUser->updateImage(image);
 
@@ -151,12 +167,6 @@ void PhotosRpcOperation::runUploadProfilePhoto()
 
     sendRpcReply(result);
 }
-// End of generated run methods
-
-void PhotosRpcOperation::setRunMethod(PhotosRpcOperation::RunMethod method)
-{
-    m_runMethod = method;
-}
 
 PhotosRpcOperation::ProcessingMethod PhotosRpcOperation::getMethodForRpcFunction(TLValue function)
 {
@@ -19,6 +19,7 @@
 #define PHOTOS_OPERATION_FACTORY_HPP
 
 #include "RpcOperationFactory.hpp"
+#include "ServerNamespace.hpp"
 #include "ServerRpcOperation.hpp"
 
 #include <QObject>
@@ -27,6 +28,8 @@ namespace Telegram {
 
 namespace Server {
 
+class PendingImageOperation;
+
 class PhotosRpcOperation : public RpcOperation
 {
     Q_OBJECT
@@ -57,6 +60,8 @@ protected:
 
     void setRunMethod(RunMethod method);
 
+    void onUploadedProfilePhotoProcessed(PendingImageOperation *operation);
+
     RunMethod m_runMethod = nullptr;
 
     // Generated RPC members
@@ -39,6 +39,9 @@ namespace Telegram {
 
 namespace Server {
 
+// The maximum number of the journal updates in a single updates.difference
+static const int c_differenceSliceLimit = 100;
+
 // Generated process methods
 bool UpdatesRpcOperation::processGetChannelDifference(RpcProcessingContext &context)
 {
@@ -66,20 +69,82 @@ bool UpdatesRpcOperation::processGetState(RpcProcessingContext &context)
 void UpdatesRpcOperation::runGetChannelDifference()
 {
     // MTProto::Functions::TLUpdatesGetChannelDifference &arguments = m_getChannelDifference;
-    if (processNotImplementedMethod(TLValue::UpdatesGetChannelDifference)) {
-        return;
-    }
-    TLUpdatesChannelDifference result;
-    sendRpcReply(result);
+    // The server has no channel boxes (yet), so any requested channel is invalid.
+    // Once the channels are added, the difference can be built from the channel box journal
+    // in the same way as for the user box (see runGetDifference()).
+    sendRpcError(RpcError::ChannelInvalid);
 }
 
 void UpdatesRpcOperation::runGetDifference()
 {
-    // MTProto::Functions::TLUpdatesGetDifference &arguments = m_getDifference;
-    if (processNotImplementedMethod(TLValue::UpdatesGetDifference)) {
+    MTProto::Functions::TLUpdatesGetDifference &arguments = m_getDifference;
+    LocalUser *selfUser = layer()->getUser();
+    const UserPostBox *box = selfUser->getPostBox();
+
+    if (!arguments.pts) {
+        sendRpcError(RpcError::PersistentTimestampEmpty);
         return;
     }
+    if (arguments.pts > box->pts()) {
+        sendRpcError(RpcError::PersistentTimestampInvalid);
+        return;
+    }
+
+    TLUpdatesState state;
+    Utils::setupTLUpdatesState(&state, selfUser);
+
     TLUpdatesDifference result;
+    if (arguments.pts == box->pts()) {
+        result.tlType = TLValue::UpdatesDifferenceEmpty;
+        result.date = state.date;
+        result.seq = state.seq;
+        sendRpcReply(result);
+        return;
+    }
+
+    const quint32 ptsDifference = box->pts() - arguments.pts;
+    const bool tooLongForClient = (arguments.flags & MTProto::Functions::TLUpdatesGetDifference::PtsTotalLimit)
+            && (ptsDifference > arguments.ptsTotalLimit);
+    if (tooLongForClient || (arguments.pts < box->journalStartPts())) {
+        // The client should reload the dialogs
+        result.tlType = TLValue::UpdatesDifferenceTooLong;
+        result.pts = box->pts();
+        sendRpcReply(result);
+        return;
+    }
+
+    const QVector<UpdateNotification> notifications = box->getUpdates(arguments.pts, c_differenceSliceLimit + 1);
+    const bool isSlice = notifications.count() > c_differenceSliceLimit;
+    const int count = isSlice ? c_differenceSliceLimit : notifications.count();
+
+    QSet<Peer> interestingPeers;
+    for (int i = 0; i < count; ++i) {
+        const UpdateNotification &notification = notifications.at(i);
+        TLUpdate update;
+        if (!api()->bakeUpdate(&update, notification, &interestingPeers)) {
+            // E.g. the message is deleted
+            continue;
+        }
+        switch (update.tlType) {
+        case TLValue::UpdateNewMessage:
+        case TLValue::UpdateNewChannelMessage:
+            result.newMessages.append(update.message);
+            break;
+        default:
+            result.otherUpdates.append(update);
+            break;
+        }
+    }
+    Utils::setupTLPeers(&result, interestingPeers, api(), selfUser);
+
+    if (isSlice) {
+        result.tlType = TLValue::UpdatesDifferenceSlice;
+        result.intermediateState = state;
+        result.intermediateState.pts = notifications.at(count - 1).pts;
+    } else {
+        result.tlType = TLValue::UpdatesDifference;
+        result.state = state;
+    }
     sendRpcReply(result);
 }
 
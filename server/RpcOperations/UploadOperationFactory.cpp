@@ -33,7 +33,6 @@
 #include "MTProto/StreamExtraOperators.hpp"
 #include "FunctionStreamOperators.hpp"
 
-#include <QIODevice>
 #include <QLoggingCategory>
 
 Q_LOGGING_CATEGORY(c_serverUploadRpcCategory, "telegram.server.rpc.upload", QtWarningMsg)
@@ -164,22 +163,21 @@ void UploadRpcOperation::runGetFile()
         return;
     }
 
-    QIODevice *file = api()->mediaService()->beginReadFile(descriptor);
-    if (!file) {
+    QByteArray bytes;
+    if (!api()->mediaService()->readFileChunk(descriptor, arguments.offset, arguments.limit, &bytes)) {
         qCWarning(c_serverUploadRpcCategory) << CALL_INFO << "Unable to read file";
         sendRpcError(RpcError::UnknownReason);
         return;
     }
-    file->seek(arguments.offset);
 
-    TLUploadFile result;
-    result.tlType = TLValue::UploadFile;
-    result.type.tlType = TLValue::StorageFilePng;
-    result.mtime = descriptor.date;
-    result.bytes = file->read(arguments.limit);
-    api()->mediaService()->endReadFile(file);
-
-    sendRpcReply(result);
+    // Serialize the reply head only and let the layer copy the chunk right into the packet buffer
+    TLStorageFileType type;
+    type.tlType = TLValue::StorageFilePng;
+    MTProto::Stream output(MTProto::Stream::WriteOnly);
+    output << TLValue::UploadFile;
+    output << type;
+    output << descriptor.date;
+    layer()->sendRpcReplyWithBytes(this, output.getData(), bytes);
 }
 
 void UploadRpcOperation::runGetWebFile()
@@ -204,11 +202,8 @@ void UploadRpcOperation::runReuploadCdnFile()
 
 void UploadRpcOperation::runSaveBigFilePart()
 {
-    // MTProto::Functions::TLUploadSaveBigFilePart &arguments = m_saveBigFilePart;
-    if (processNotImplementedMethod(TLValue::UploadSaveBigFilePart)) {
-        return;
-    }
-    bool result;
+    MTProto::Functions::TLUploadSaveBigFilePart &arguments = m_saveBigFilePart;
+    bool result = api()->mediaService()->uploadBigFilePart(arguments.fileId, arguments.filePart, arguments.fileTotalParts, arguments.bytes);
     sendRpcReply(result);
 }
 
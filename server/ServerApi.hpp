@@ -24,38 +24,6 @@ struct PhoneStatus
     bool exists() const { return dcId; }
 };
 
-struct UpdateNotification
-{
-    Q_GADGET
-public:
-    enum class Type {
-        Invalid,
-        CreateChat,
-        ChatParticipants,
-        NewMessage,
-        EditMessage,
-        MessageAction,
-        ReadInbox,
-        ReadOutbox,
-        UpdateName,
-        UpdateUserStatus,
-    };
-    Q_ENUM(Type)
-
-    Peer dialogPeer;
-    MessageAction messageAction;
-    quint32 userId = 0; // The Update recipient
-    quint32 fromId = 0;
-    quint32 messageId = 0;
-    quint64 messageDataId = 0;
-    quint32 dcId = 0;
-    quint32 pts = 0;
-    quint32 date = 0;
-    Session *excludeSession = nullptr;
-    bool joinWithNext = false;
-    Type type = Type::Invalid;
-};
-
 class AbstractServerApi
 {
 public:
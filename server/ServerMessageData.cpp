@@ -30,7 +30,7 @@ MessageData::MessageData(quint32 from, Peer to, const MessageContent &content)
 }
 
 MessageData::MessageData(quint32 from, Peer to, const ServiceMessageAction &action)
-    : m_action(action)
+    : m_action(QSharedPointer<const ServiceMessageAction>::create(action))
     , m_to(to)
     , m_fromId(from)
 {
@@ -73,12 +73,52 @@ bool MessageData::isMessageToSelf() const
 
 bool MessageData::isServiceMessage() const
 {
-    return m_action.type != ServiceMessageAction::Type::Empty;
+    return m_action && (m_action->type != ServiceMessageAction::Type::Empty);
+}
+
+const ServiceMessageAction &MessageData::action() const
+{
+    static const ServiceMessageAction emptyAction;
+    return m_action ? *m_action : emptyAction;
 }
 
 void MessageData::addReference(const Peer &peer, quint32 messageId)
 {
-    m_references.insert(peer, messageId);
+    if (!m_referencesHash.isEmpty()) {
+        m_referencesHash.insert(peer, messageId);
+        return;
+    }
+    for (Reference &reference : m_references) {
+        if (reference.peer == peer) {
+            reference.messageId = messageId;
+            return;
+        }
+    }
+    if (m_references.size() < m_references.capacity()) {
+        m_references.append({ peer, messageId });
+        return;
+    }
+
+    // A group message; avoid the linear lookup for each of the members
+    m_referencesHash.reserve(m_references.size() + 1);
+    for (const Reference &reference : m_references) {
+        m_referencesHash.insert(reference.peer, reference.messageId);
+    }
+    m_referencesHash.insert(peer, messageId);
+    m_references.clear();
+}
+
+quint32 MessageData::getReference(const Peer &peer) const
+{
+    if (!m_referencesHash.isEmpty()) {
+        return m_referencesHash.value(peer);
+    }
+    for (const Reference &reference : m_references) {
+        if (reference.peer == peer) {
+            return reference.messageId;
+        }
+    }
+    return 0;
 }
 
 Peer MessageData::getDialogPeer(quint32 applicantUserId) const
@@ -97,13 +137,21 @@ MessageContent::MessageContent(const QString &text)
 }
 
 MessageContent::MessageContent(const MediaData &media)
-    : m_media(media)
 {
+    if (media.isValid()) {
+        m_media = QSharedPointer<const MediaData>::create(media);
+    }
+}
+
+const MediaData &MessageContent::media() const
+{
+    static const MediaData emptyMedia;
+    return m_media ? *m_media : emptyMedia;
 }
 
 bool MessageContent::operator==(const MessageContent &anotherContent) const
 {
-    return m_text == anotherContent.m_text && m_media == anotherContent.m_media;
+    return m_text == anotherContent.m_text && media() == anotherContent.media();
 }
 
 bool MediaData::operator==(const MediaData &anotherMediaData) const
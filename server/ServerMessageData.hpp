@@ -22,6 +22,8 @@
 #include "ServerNamespace.hpp"
 
 #include <QHash>
+#include <QSharedPointer>
+#include <QVarLengthArray>
 #include <QVariant>
 
 namespace Telegram {
@@ -77,13 +79,16 @@ public:
     MessageContent(const QString &text);
     MessageContent(const MediaData &media);
 
-    const MediaData &media() const { return m_media; }
+    const MediaData &media() const;
     QString text() const { return m_text; }
 
     bool operator==(const MessageContent &anotherContent) const;
 
 protected:
-    MediaData m_media;
+    friend class MessageService;
+
+    // The media is kept out of line as most of the messages are plain text
+    QSharedPointer<const MediaData> m_media;
     QString m_text;
 };
 
@@ -121,7 +126,7 @@ public:
     quint32 editDate() const;
     void setEditDate(quint32 date);
 
-    const ServiceMessageAction &action() const { return m_action; }
+    const ServiceMessageAction &action() const;
     const MessageContent &content() const { return m_content; }
     void setContent(const MessageContent &newContent);
 
@@ -129,16 +134,24 @@ public:
     bool isServiceMessage() const;
 
     void addReference(const Peer &peer, quint32 messageId);
-    quint32 getReference(const Peer &peer) const { return m_references.value(peer); }
+    quint32 getReference(const Peer &peer) const;
 
     Peer getDialogPeer(quint32 applicantUserId) const;
 
 protected:
+    struct Reference {
+        Peer peer;
+        quint32 messageId;
+    };
+
     MessageContent m_content;
-    ServiceMessageAction m_action;
-    QHash<Peer, quint32> m_references;
-    Peer m_to;
+    QSharedPointer<const ServiceMessageAction> m_action;
+    // Most of the messages are referenced by the sender and the recipient boxes only;
+    // the references of a group message are moved to the hash once the inline array is full
+    QVarLengthArray<Reference, 2> m_references;
+    QHash<Peer, quint32> m_referencesHash;
     quint64 m_globalId = 0;
+    Peer m_to;
     quint32 m_date = 0;
     quint32 m_fromId = 0;
     quint32 m_editDate = 0;
@@ -51,6 +51,17 @@ bool FileDescriptor::operator!=(const FileDescriptor &another) const
     return !(*this == another);
 }
 
+bool UploadDescriptor::isComplete() const
+{
+    if (parts.isEmpty()) {
+        return false;
+    }
+    if (totalParts && (static_cast<quint32>(parts.size()) != totalParts)) {
+        return false;
+    }
+    return parts.count(true) == parts.size();
+}
+
 bool ImageSizeDescriptor::operator==(const ImageSizeDescriptor &another) const
 {
     if ((sizeType != another.sizeType)
@@ -3,10 +3,14 @@
 
 #include "TelegramNamespace_p.hpp"
 
+#include <QBitArray>
+
 namespace Telegram {
 
 namespace Server {
 
+class Session;
+
 struct InputPeer : public Telegram::Peer
 {
     InputPeer() = default;
@@ -67,8 +71,15 @@ public:
 
 struct UploadDescriptor
 {
+    bool isComplete() const;
+
     quint64 fileId = 0;
-    QByteArrayList partList;
+    QString fileName; // The file with the uploaded data (the parts are written right in place)
+    quint64 size = 0;
+    quint32 partSize = 0;
+    quint32 totalParts = 0; // Known only for big files
+    QBitArray parts; // Received parts
+    quint32 lastPartDate = 0; // The time of the last written part (to expire abandoned uploads)
 };
 
 struct ImageSizeDescriptor
@@ -113,6 +124,38 @@ struct PeerImage
     FileDescriptor big;
 };
 
+struct UpdateNotification
+{
+    Q_GADGET
+public:
+    enum class Type {
+        Invalid,
+        CreateChat,
+        ChatParticipants,
+        NewMessage,
+        EditMessage,
+        MessageAction,
+        ReadInbox,
+        ReadOutbox,
+        UpdateName,
+        UpdateUserStatus,
+    };
+    Q_ENUM(Type)
+
+    Peer dialogPeer;
+    MessageAction messageAction;
+    quint32 userId = 0; // The Update recipient
+    quint32 fromId = 0;
+    quint32 messageId = 0;
+    quint64 messageDataId = 0;
+    quint32 dcId = 0;
+    quint32 pts = 0;
+    quint32 date = 0;
+    Session *excludeSession = nullptr;
+    bool joinWithNext = false;
+    Type type = Type::Invalid;
+};
+
 } // Server namespace
 
 } // Telegram namespace
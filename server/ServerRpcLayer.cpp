@@ -1,5 +1,6 @@
 #include "ServerRpcLayer.hpp"
 
+#include "AbridgedLength.hpp"
 #include "CompatibilityLayer.hpp"
 #include "Debug_p.hpp"
 #include "FunctionStreamOperators.hpp"
@@ -71,6 +72,8 @@ static const QVector<TLValue> c_unregisteredUserAllowedRpcList =
 RpcLayer::RpcLayer(QObject *parent) :
     BaseRpcLayer(parent)
 {
+    // Telegram spec says it should be 255, but we need to lower the limit to pack DcConfig
+    setGzipThreshold(128);
 }
 
 LocalServerApi *RpcLayer::api()
@@ -228,6 +231,19 @@ void RpcLayer::sendUpdates(const TLUpdates &updates)
     sendRpcMessage(stream.getData());
 }
 
+/*!
+  Send the already serialized TLUpdates. The same data can be sent to all
+  sessions of the recipient without serializing the updates once again.
+*/
+void RpcLayer::sendUpdates(const QByteArray &updatesData)
+{
+    qCDebug(c_serverRpcLayerCategory) << CALL_INFO << "Send serialized update to"
+                                      << session()->userId()
+                                      << "session:" << sessionId()
+                                      << "IP:" << session()->ip;
+    sendRpcMessage(updatesData);
+}
+
 bool RpcLayer::processInitConnection(const MTProto::Message &message)
 {
     MTProto::Stream stream(message.data);
@@ -312,13 +328,10 @@ quint64 RpcLayer::sendRpcReply(const QByteArray &reply, quint64 messageId)
     RawStream output(RawStream::WriteOnly);
     output << TLValue::RpcResult;
     output << messageId;
-    if (reply.size() > 128) { // Telegram spec says it should be 255, but we need to lower the limit to pack DcConfig
-        const QByteArray innerData = Utils::packGZip(reply);
-        if (innerData.size() + 8 < reply.size()) {
-            MTProto::Stream innerStream(RawStream::WriteOnly);
-            innerStream << TLValue::GzipPacked;
-            innerStream << innerData;
-            output.writeBytes(innerStream.getData());
+    if (reply.size() > gzipThreshold()) {
+        const QByteArray packedReply = packGZipIfBeneficial(reply);
+        if (packedReply.size() < reply.size()) {
+            output.writeBytes(packedReply);
             qCDebug(c_serverRpcDumpPackageCategory) << gzipPackMessage() << messageId << TLValue::firstFromArray(reply).toString();
         } else {
             qCDebug(c_serverRpcDumpPackageCategory) << "Server: It makes no sense to gzip the answer for message" << messageId;
@@ -339,6 +352,38 @@ bool RpcLayer::sendRpcMessage(const QByteArray &message)
 bool RpcLayer::sendRpcReply(RpcOperation *operation, const QByteArray &replyData)
 {
     const quint64 operationReplyId = sendRpcReply(replyData, operation->messageId());
+    return trackRpcReply(operation, operationReplyId);
+}
+
+/*!
+  Sends the reply which consists of the serialized \a replyHead followed by the TL bytes value.
+
+  The \a bytes are copied right into the encryption buffer and never gzipped, so the file
+  chunk data (which is usually already compressed) costs neither extra copies nor the
+  compression attempt.
+*/
+bool RpcLayer::sendRpcReplyWithBytes(RpcOperation *operation, const QByteArray &replyHead, const QByteArray &bytes)
+{
+    static const char s_nulls[4] = { 0, 0, 0, 0 };
+    const AbridgedLength bytesLength(static_cast<quint32>(bytes.size()));
+
+    RawStreamEx output(RawStreamEx::WriteOnly);
+    output << TLValue::RpcResult;
+    output << operation->messageId();
+    output.writeBytes(replyHead);
+    output << bytesLength;
+    const QByteArray padding = QByteArray::fromRawData(s_nulls, bytesLength.paddingForAlignment(4));
+
+    qCDebug(c_serverRpcDumpPackageCategory) << Q_FUNC_INFO << TLValue::firstFromArray(replyHead)
+                                            << "with" << bytes.size() << "bytes"
+                                            << "for message id" << operation->messageId();
+    const quint64 operationReplyId = sendPacket({ output.getData(), bytes, padding },
+                                                SendMode::ServerReply, MessageType::ContentRelatedMessage);
+    return trackRpcReply(operation, operationReplyId);
+}
+
+bool RpcLayer::trackRpcReply(RpcOperation *operation, quint64 operationReplyId)
+{
     if (!operationReplyId) {
         qCWarning(c_serverRpcLayerCategory) << "Unable to send RPC reply for" << operation
                                             << "op messageId:" << operation->messageId();
@@ -49,6 +49,7 @@ public:
     bool processMessageAck(const MTProto::Message &message);
 
     void sendUpdates(const TLUpdates &updates);
+    void sendUpdates(const QByteArray &updatesData);
 
     // Low level
     bool processInitConnection(const MTProto::Message &message);
@@ -59,6 +60,7 @@ public:
     quint64 sendRpcReply(const QByteArray &reply, quint64 messageId);
     bool sendRpcMessage(const QByteArray &message);
     bool sendRpcReply(RpcOperation *operation, const QByteArray &replyData);
+    bool sendRpcReplyWithBytes(RpcOperation *operation, const QByteArray &replyHead, const QByteArray &bytes);
 
     static const char *gzipPackMessage();
 
@@ -73,6 +75,7 @@ protected:
     QByteArray getVerificationKeyPart() const final;
 
     MTProtoSendHelper *getHelper() const;
+    bool trackRpcReply(RpcOperation *operation, quint64 operationReplyId);
 
     Session *m_session = nullptr;
     LocalServerApi *m_api = nullptr;
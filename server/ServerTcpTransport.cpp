@@ -1,5 +1,6 @@
 #include "ServerTcpTransport.hpp"
 
+#include "CompatibilityLayer.hpp"
 #include "Crypto/AesCtr.hpp"
 #include "RawStream.hpp"
 
@@ -7,9 +8,15 @@
 #include <QLoggingCategory>
 #include <QMetaMethod>
 #include <QTcpSocket>
+#include <QtEndian>
 
 Q_LOGGING_CATEGORY(c_loggingServerTcpTransport, "telegram.server.transport.tcp", QtWarningMsg)
 
+static const quint8 c_abridgedVersionByte = 0xef;
+static const quint32 c_intermediateVersionBytes = 0xeeeeeeeeu;
+static const quint32 c_paddedIntermediateVersionBytes = 0xddddddddu;
+static const quint32 c_obfuscatedAbridgedIdentifier = 0xefefefefu;
+
 namespace Telegram {
 
 namespace Server {
@@ -55,8 +62,27 @@ bool TcpTransport::startObfuscatedSession()
 
     // The client sends its encryption key in plain text
     setCryptoKeysSourceData(encryptionSourceData, DirectIsReadReversedIsWrite);
+    // Decrypt the header to sync the read context state
     QByteArray content1 = plainData + m_socket->read(8);
-    m_readAesContext->crypt(content1);
+    m_readAesContext->crypt(content1.data(), content1.size());
+
+    // The protocol identifier selects the framing of the obfuscated data
+    const quint32 protocolIdentifier = qFromLittleEndian<quint32>(reinterpret_cast<const uchar*>(content1.constData() + 56));
+    switch (protocolIdentifier) {
+    case c_obfuscatedAbridgedIdentifier:
+        setFraming(Framing::Abridged);
+        break;
+    case c_intermediateVersionBytes:
+        setFraming(Framing::Intermediate);
+        break;
+    case c_paddedIntermediateVersionBytes:
+        setFraming(Framing::PaddedIntermediate);
+        break;
+    default:
+        qCWarning(c_loggingServerTcpTransport()) << Q_FUNC_INFO << "Unknown protocol identifier"
+                                                 << TELEGRAMQT_HEX_SHOWBASE << protocolIdentifier;
+        return false;
+    }
     return true;
 }
 
@@ -65,17 +91,32 @@ void TcpTransport::readEvent()
     if (Q_LIKELY(m_sessionType != Unknown)) {
         return;
     }
-    char sessionSign;
-    m_socket->getChar(&sessionSign);
-    if (sessionSign == char(0xef)) {
+    // The session header is up to 8 bytes; wait for more data if needed
+    uchar header[8];
+    const qint64 headerSize = m_socket->peek(reinterpret_cast<char *>(header), sizeof(header));
+    if (headerSize < 1) {
+        return;
+    }
+    if (header[0] == c_abridgedVersionByte) {
+        m_socket->read(1);
         setSessionType(Abridged);
+    } else if (headerSize < 8) {
+        qCDebug(c_loggingServerTcpTransport()) << Q_FUNC_INFO << "Wait for the session header";
+        return;
+    } else if (qFromLittleEndian<quint32>(header) == c_intermediateVersionBytes) {
+        m_socket->read(4);
+        setSessionType(Intermediate);
+    } else if (qFromLittleEndian<quint32>(header) == c_paddedIntermediateVersionBytes) {
+        m_socket->read(4);
+        setSessionType(PaddedIntermediate);
+    } else if (qFromLittleEndian<quint32>(header + 4) == 0) {
+        // Full format has no header; the first packet starts with its length and the zero
+        // packet number (obfuscated clients never send zero in the second word)
+        setSessionType(FullSize);
+    } else if (startObfuscatedSession()) {
+        setSessionType(Obfuscated);
     } else {
-        m_socket->ungetChar(sessionSign);
-        if (startObfuscatedSession()) {
-            setSessionType(Obfuscated);
-        } else {
-            qCCritical(c_loggingServerTcpTransport()) << Q_FUNC_INFO << "Invalid data";
-        }
+        qCCritical(c_loggingServerTcpTransport()) << Q_FUNC_INFO << "Invalid data";
     }
     qCDebug(c_loggingServerTcpTransport()) << Q_FUNC_INFO << remoteAddress() << "Session type:" << m_sessionType;
 }
@@ -6,6 +6,8 @@
 #include "Debug_p.hpp"
 #include "MediaService.hpp"
 #include "MessageService.hpp"
+#include "MTProto/Stream.hpp"
+#include "MTProto/StreamExtraOperators.hpp"
 #include "RandomGenerator.hpp"
 #include "RemoteClientConnection.hpp"
 #include "RemoteServerConnection.hpp"
@@ -39,6 +41,7 @@
 #include <QLoggingCategory>
 #include <QTcpServer>
 #include <QTcpSocket>
+#include <QtEndian>
 
 Q_LOGGING_CATEGORY(loggingCategoryServer, "telegram.server.main", QtWarningMsg)
 Q_LOGGING_CATEGORY(loggingCategoryServerApi, "telegram.server.api", QtWarningMsg)
@@ -270,11 +273,10 @@ void Server::reportLocalMessageRead(LocalUser *user, const UpdateNotification &n
     senderDialog->readOutboxMaxId = notification.messageId;
     user->getPostBox()->bumpPts();
 
-    if (user->hasActiveSession()) {
-        UpdateNotification userNotification = notification;
-        userNotification.pts = user->getPostBox()->pts();
-        queueUpdates({userNotification});
-    }
+    // Queue the update even without active sessions to have it in the journal
+    UpdateNotification userNotification = notification;
+    userNotification.pts = user->getPostBox()->pts();
+    queueUpdates({userNotification});
 }
 
 void Server::setSessionConnection(Session *session, RemoteClientConnection *connection)
@@ -354,36 +356,25 @@ MessageRecipient *Server::getRecipient(const Peer &peer) const
 // Returns the list of Users who interesting in the peer info updates
 QVector<quint32> Server::getPeerWatchers(const Peer &peer) const
 {
-    QVector<quint32> watchers;
-    if (peer.type() == Peer::User) {
-        const LocalUser *localUser = getUser(peer.id());
-        if (localUser) {
-            const QVector<UserDialog *> dialogs = localUser->dialogs();
-            for (const UserDialog *dialog : dialogs) {
-                if (!dialog->peer.isValid()) {
-                    // Sanity check was failed.
-                    continue;
-                }
-                if (dialog->peer.type() == Peer::User) {
-                    watchers.append(dialog->peer.id());
-                }
-            }
-        }
-        const AbstractUser *user = localUser ? localUser : getAbstractUser(peer.id());
-        const QVector<quint32> contactList = user->contactList();
-        for (const quint32 contactId : contactList) {
-            if (watchers.contains(contactId)) {
-                continue;
-            }
-            watchers.append(contactId);
-        }
+    if (peer.type() != Peer::User) {
+        return { };
+    }
 
-        // Any user is interesting in themself
-        if (!watchers.contains(peer.id())) {
-            watchers << peer.id();
-        }
+    const LocalUser *localUser = getUser(peer.id());
+    if (localUser) {
+        // The index is maintained by LocalUser on contact import and dialog creation
+        return localUser->watchers();
     }
 
+    const AbstractUser *user = getAbstractUser(peer.id());
+    if (!user) {
+        return { };
+    }
+    QVector<quint32> watchers = user->contactList();
+    // Any user is interesting in themself
+    if (!watchers.contains(peer.id())) {
+        watchers << peer.id();
+    }
     return watchers;
 }
 
@@ -718,6 +709,8 @@ QVector<UpdateNotification> Server::processMessage(MessageData *messageData, Ses
     AbstractUser *fromUser = getAbstractUser(messageData->fromId());
     QVector<PostBox *> boxes = getPostBoxes(targetPeer, fromUser);
     QVector<UpdateNotification> notifications;
+    // Queue the local updates in one batch to bake the message only once for all recipients
+    QVector<UpdateNotification> localNotifications;
 
     // Result and broadcasted Updates date seems to be always older than the message date,
     // so prepare the request date right on the start.
@@ -729,7 +722,11 @@ QVector<UpdateNotification> Server::processMessage(MessageData *messageData, Ses
         notification.messageDataId = messageData->globalId();
 
         if (isLocalBox(box)) {
-            const quint32 newMessageId = box->addMessage(notification.messageDataId);
+            // User boxes have a dialog per peer, other boxes have a single dialog with the box peer
+            const Peer dialogPeer = box->peer().type() == Peer::User
+                    ? messageData->getDialogPeer(box->peer().id())
+                    : box->peer();
+            const quint32 newMessageId = box->addMessage(notification.messageDataId, dialogPeer);
             messageService()->addMessageReference(notification.messageDataId, box->peer(), newMessageId);
             notification.messageId = newMessageId;
             notification.pts = box->pts();
@@ -765,10 +762,10 @@ QVector<UpdateNotification> Server::processMessage(MessageData *messageData, Ses
                     // Notifications for the sender
                     notification.excludeSession = excludeSession;
                     notifications = { notification };
-                    queueUpdates({notification});
+                    localNotifications.append(notification);
                     notification.excludeSession = nullptr;
                 } else {
-                    queueUpdates({notification});
+                    localNotifications.append(notification);
                 }
             } else {
                 // User is not a local user
@@ -789,6 +786,8 @@ QVector<UpdateNotification> Server::processMessage(MessageData *messageData, Ses
         }
     }
 
+    queueUpdates(localNotifications);
+
     return notifications;
 }
 
@@ -1112,89 +1111,301 @@ bool Server::bakeUpdate(TLUpdate *update, const UpdateNotification &notification
     return true;
 }
 
+static const quint32 c_recipientUserFlags = TLUser::Self|TLUser::Contact|TLUser::MutualContact;
+
+/*
+    Serialized Updates with a single UpdateNewMessage or UpdateEditMessage,
+    shared by all recipients of the message.
+
+    The message, the users and the chats are baked and serialized only for
+    the first recipient. For the others the template data is copied and the
+    recipient-specific fields (the message id and Out flag, the pts and the
+    Self, Contact and MutualContact user flags) are patched in place.
+ */
+struct MessageUpdatesTemplate
+{
+    struct UserFlags {
+        const AbstractUser *user = nullptr;
+        quint32 flags = 0; // Without the recipient-specific flags
+        int offset = 0;
+    };
+
+    bool matches(const MessageData *data, TLValue type, quint32 updatesDate) const
+    {
+        return (messageData == data) && (updateType == type) && (date == updatesDate);
+    }
+
+    bool build(const Server *server, const UpdateNotification &notification, const LocalUser *recipient);
+    QByteArray bakeFor(const LocalUser *recipient, const UpdateNotification &notification) const;
+
+    static void patch(QByteArray *data, int offset, quint32 value)
+    {
+        qToLittleEndian<quint32>(value, reinterpret_cast<uchar *>(data->data() + offset));
+    }
+
+    const MessageData *messageData = nullptr;
+    TLValue updateType;
+    quint32 date = 0;
+    QByteArray data;
+    quint32 messageFlags = 0; // Without the Out flag
+    int messageFlagsOffset = 0;
+    int messageIdOffset = 0;
+    int ptsOffset = 0;
+    QVector<UserFlags> users;
+};
+
+bool MessageUpdatesTemplate::build(const Server *server, const UpdateNotification &notification,
+                                   const LocalUser *recipient)
+{
+    TLUpdate update;
+    QSet<Peer> interestingPeers;
+    if (!server->bakeUpdate(&update, notification, &interestingPeers)) {
+        return false;
+    }
+    QVector<TLUser> tlUsers;
+    QVector<TLChat> tlChats;
+    Utils::setupTLPeers(&tlUsers, &tlChats, interestingPeers, server, recipient);
+
+    data.clear();
+    MTProto::Stream stream(&data, /* write */ true);
+    stream << TLValue::Updates;
+    stream << TLValue::Vector;
+    stream << quint32(1);
+
+    switch (update.message.tlType) {
+    case TLValue::Message:
+    case TLValue::MessageService:
+        break;
+    default:
+        return false;
+    }
+
+    // Serialize the update fields one by one (in the TLUpdate operator order)
+    // to record the offsets of the recipient-specific values.
+    stream << update.tlType;
+    const int messageOffset = data.size();
+    stream << update.message;
+    ptsOffset = data.size();
+    stream << update.pts;
+    stream << update.ptsCount;
+    // The message data starts with: tlType, flags, id
+    messageFlagsOffset = messageOffset + int(sizeof(quint32));
+    messageIdOffset = messageFlagsOffset + int(sizeof(quint32));
+    messageFlags = update.message.flags & ~quint32(TLMessage::Out);
+
+    users.clear();
+    users.reserve(tlUsers.count());
+    stream << TLValue::Vector;
+    stream << quint32(tlUsers.count());
+    for (const TLUser &tlUser : tlUsers) {
+        const int userOffset = data.size();
+        stream << tlUser;
+        if (tlUser.tlType != TLValue::User) {
+            // UserEmpty has no flags to patch
+            continue;
+        }
+        UserFlags userFlags;
+        userFlags.user = server->getAbstractUser(tlUser.id);
+        userFlags.flags = tlUser.flags & ~c_recipientUserFlags;
+        // The user data starts with: tlType, flags
+        userFlags.offset = userOffset + int(sizeof(quint32));
+        if (userFlags.user) {
+            users.append(userFlags);
+        }
+    }
+    stream << TLValue::Vector;
+    stream << quint32(tlChats.count());
+    for (const TLChat &tlChat : tlChats) {
+        stream << tlChat;
+    }
+    stream << notification.date;
+    stream << quint32(0); // seq
+
+    updateType = update.tlType;
+    date = notification.date;
+    return !stream.error();
+}
+
+QByteArray MessageUpdatesTemplate::bakeFor(const LocalUser *recipient, const UpdateNotification &notification) const
+{
+    QByteArray result = data;
+
+    quint32 flags = messageFlags;
+    if (!messageData->isServiceMessage() && (messageData->fromId() == recipient->id())) {
+        const bool messageToSelf = messageData->toPeer() == recipient->toPeer();
+        if (!messageToSelf) {
+            flags |= TLMessage::Out;
+        }
+    }
+    patch(&result, messageFlagsOffset, flags);
+    patch(&result, messageIdOffset, notification.messageId);
+    patch(&result, ptsOffset, notification.pts);
+
+    const QVector<quint32> recipientContacts = recipient->contactList();
+    for (const UserFlags &userFlags : users) {
+        flags = userFlags.flags;
+        if (userFlags.user->id() == recipient->id()) {
+            flags |= TLUser::Self;
+        }
+        if (recipientContacts.contains(userFlags.user->id())) {
+            flags |= TLUser::Contact;
+            if (userFlags.user->contactList().contains(recipient->id())) {
+                flags |= TLUser::MutualContact;
+            }
+        }
+        patch(&result, userFlags.offset, flags);
+    }
+
+    return result;
+}
+
 void Server::queueUpdates(const QVector<UpdateNotification> &notifications)
 {
+    // Global message id to the shared updates data
+    QHash<quint64, MessageUpdatesTemplate> messageTemplates;
     QVector<UpdateNotification> holdedUpdates;
     for (const UpdateNotification &notification : notifications) {
+        if (notification.pts) {
+            // Record the box update for updates.getDifference() even if the user is offline
+            LocalUser *boxOwner = getUser(notification.userId);
+            if (boxOwner) {
+                boxOwner->getPostBox()->addUpdate(notification);
+            }
+        }
         if (notification.joinWithNext) {
             holdedUpdates.append(notification);
             continue;
         }
 
-        QSet<Peer> interestingPeers;
-
-        TLUpdates updates;
         LocalUser *recipient = getUser(notification.userId);
         if (!recipient) {
             qCWarning(lcServerUpdates) << CALL_INFO << "Invalid user!" << notification.userId;
             continue;
         }
 
-        updates.date = notification.date;
-
-        if (holdedUpdates.isEmpty()) {
-            switch (notification.type) {
-            case UpdateNotification::Type::EditMessage:
-            case UpdateNotification::Type::NewMessage:
-            case UpdateNotification::Type::ReadInbox:
-            case UpdateNotification::Type::ReadOutbox:
-            case UpdateNotification::Type::ChatParticipants:
-                updates.tlType = TLValue::Updates;
-                updates.updates.resize(1);
-                if (!bakeUpdate(&updates.updates[0], notification, &interestingPeers)) {
-                    qCWarning(lcServerUpdates) << CALL_INFO << "Unable to prepare update";
-                    continue; // Omit the notification
-                }
-                break;
-            case UpdateNotification::Type::MessageAction:
-            case UpdateNotification::Type::UpdateName:
-            case UpdateNotification::Type::UpdateUserStatus:
-                updates.tlType = TLValue::UpdateShort;
-                if (!bakeUpdate(&updates.update, notification, &interestingPeers)) {
-                    qCWarning(lcServerUpdates) << CALL_INFO << "Unable to prepare update";
-                    continue; // Omit the notification
-                }
+        QVector<Session *> sessions;
+        for (Session *session : recipient->activeSessions()) {
+            if (session == notification.excludeSession) {
+                continue;
+            }
+            sessions.append(session);
+        }
+        if (sessions.isEmpty()) {
+            holdedUpdates.clear();
+            continue;
+        }
 
-                // bakeUpdate modified the updates.update object inplace
-                break;
-            case UpdateNotification::Type::CreateChat:
-                // This update should never occure in this switch.
-                // It is split to ChatParticipants and NewMessage instead.
-            case UpdateNotification::Type::Invalid:
-                break;
+        QByteArray updatesData;
+        if (holdedUpdates.isEmpty()
+                && ((notification.type == UpdateNotification::Type::NewMessage)
+                    || (notification.type == UpdateNotification::Type::EditMessage))) {
+            const quint64 globalMessageId = recipient->getPostBox()->getMessageGlobalId(notification.messageId);
+            const MessageData *messageData = messageService()->getMessage(globalMessageId);
+            if (!messageData) {
+                qCWarning(lcServerUpdates) << CALL_INFO << "Unable to prepare update: no message";
+                continue; // Omit the notification
+            }
+            const bool isChannelMessage = messageData->toPeer().type() == Peer::Channel;
+            TLValue updateType;
+            if (notification.type == UpdateNotification::Type::NewMessage) {
+                updateType = isChannelMessage ? TLValue::UpdateNewChannelMessage : TLValue::UpdateNewMessage;
+            } else {
+                updateType = isChannelMessage ? TLValue::UpdateEditChannelMessage : TLValue::UpdateEditMessage;
             }
-        } else {
-            // If holdedUpdates already had something...
-            holdedUpdates.append(notification);
 
-            updates.tlType = TLValue::Updates;
-            updates.updates.resize(holdedUpdates.count());
-            for (int i = 0; i < holdedUpdates.count(); ++i) {
-                const UpdateNotification &update = holdedUpdates[i];
-                if (!bakeUpdate(&updates.updates[i], update, &interestingPeers)) {
+            MessageUpdatesTemplate &messageTemplate = messageTemplates[globalMessageId];
+            if (!messageTemplate.matches(messageData, updateType, notification.date)) {
+                messageTemplate.messageData = messageData;
+                if (!messageTemplate.build(this, notification, recipient)) {
                     qCWarning(lcServerUpdates) << CALL_INFO << "Unable to prepare update";
-                    continue;
+                    messageTemplates.remove(globalMessageId);
+                    continue; // Omit the notification
                 }
             }
-            holdedUpdates.clear();
+            updatesData = messageTemplate.bakeFor(recipient, notification);
+        } else {
+            TLUpdates updates;
+            if (!bakeUpdates(&updates, notification, &holdedUpdates, recipient)) {
+                continue; // Omit the notification
+            }
+            MTProto::Stream stream(MTProto::Stream::WriteOnly);
+            stream << updates;
+            updatesData = stream.getData();
         }
 
-        switch (updates.tlType) {
-        case TLValue::UpdatesCombined:
-        case TLValue::Updates:
-            Utils::setupTLPeers(&updates, interestingPeers, this, recipient);
+        for (Session *session : sessions) {
+            session->getConnection()->rpcLayer()->sendUpdates(updatesData);
+        }
+    }
+}
+
+/*
+    Bake the updates for the notification and the held (joinWithNext) notifications.
+    The held notifications are consumed.
+ */
+bool Server::bakeUpdates(TLUpdates *updates, const UpdateNotification &notification,
+                         QVector<UpdateNotification> *holdedUpdates, const LocalUser *recipient) const
+{
+    QSet<Peer> interestingPeers;
+    updates->date = notification.date;
+
+    if (holdedUpdates->isEmpty()) {
+        switch (notification.type) {
+        case UpdateNotification::Type::EditMessage:
+        case UpdateNotification::Type::NewMessage:
+        case UpdateNotification::Type::ReadInbox:
+        case UpdateNotification::Type::ReadOutbox:
+        case UpdateNotification::Type::ChatParticipants:
+            updates->tlType = TLValue::Updates;
+            updates->updates.resize(1);
+            if (!bakeUpdate(&updates->updates[0], notification, &interestingPeers)) {
+                qCWarning(lcServerUpdates) << CALL_INFO << "Unable to prepare update";
+                return false;
+            }
             break;
-        default:
+        case UpdateNotification::Type::MessageAction:
+        case UpdateNotification::Type::UpdateName:
+        case UpdateNotification::Type::UpdateUserStatus:
+            updates->tlType = TLValue::UpdateShort;
+            if (!bakeUpdate(&updates->update, notification, &interestingPeers)) {
+                qCWarning(lcServerUpdates) << CALL_INFO << "Unable to prepare update";
+                return false;
+            }
+
+            // bakeUpdate modified the updates.update object inplace
+            break;
+        case UpdateNotification::Type::CreateChat:
+            // This update should never occure in this switch.
+            // It is split to ChatParticipants and NewMessage instead.
+        case UpdateNotification::Type::Invalid:
             break;
         }
-
-        for (Session *session : recipient->activeSessions()) {
-            if (session == notification.excludeSession) {
+    } else {
+        // If holdedUpdates already had something...
+        holdedUpdates->append(notification);
+
+        updates->tlType = TLValue::Updates;
+        updates->updates.resize(holdedUpdates->count());
+        for (int i = 0; i < holdedUpdates->count(); ++i) {
+            const UpdateNotification &update = holdedUpdates->at(i);
+            if (!bakeUpdate(&updates->updates[i], update, &interestingPeers)) {
+                qCWarning(lcServerUpdates) << CALL_INFO << "Unable to prepare update";
                 continue;
             }
-            session->getConnection()->rpcLayer()->sendUpdates(updates);
         }
+        holdedUpdates->clear();
     }
+
+    switch (updates->tlType) {
+    case TLValue::UpdatesCombined:
+    case TLValue::Updates:
+        Utils::setupTLPeers(updates, interestingPeers, this, recipient);
+        break;
+    default:
+        break;
+    }
+
+    return true;
 }
 
 void Server::queueServerUpdates(const QVector<UpdateNotification> &notificationsForServer)
@@ -1229,7 +1440,7 @@ QVector<UpdateNotification> Server::processServerUpdates(const QVector<UpdateNot
             UpdateNotification userUpdate = notification;
             userUpdate.type = UpdateNotification::Type::NewMessage;
             PostBox *box = user->getPostBox();
-            const quint32 newMessageId = box->addMessage(notification.messageDataId);
+            const quint32 newMessageId = box->addMessage(notification.messageDataId, userUpdate.dialogPeer);
             messageService()->addMessageReference(notification.messageDataId, box->peer(), newMessageId);
             userUpdate.messageId = newMessageId;
             userUpdate.pts = box->pts();
@@ -1242,7 +1453,7 @@ QVector<UpdateNotification> Server::processServerUpdates(const QVector<UpdateNot
         case UpdateNotification::Type::NewMessage: {
             UpdateNotification userUpdate = notification;
             PostBox *box = user->getPostBox();
-            const quint32 newMessageId = box->addMessage(userUpdate.messageDataId);
+            const quint32 newMessageId = box->addMessage(userUpdate.messageDataId, userUpdate.dialogPeer);
             messageService()->addMessageReference(userUpdate.messageDataId, box->peer(), newMessageId);
             userUpdate.messageId = newMessageId;
             userUpdate.pts = box->pts();
@@ -154,6 +154,8 @@ protected:
     void onUserSessionStatusChanged(LocalUser *user, Session *session);
 
     void reportLocalMessageRead(LocalUser *user, const UpdateNotification &notification);
+    bool bakeUpdates(TLUpdates *updates, const UpdateNotification &notification,
+                     QVector<UpdateNotification> *holdedUpdates, const LocalUser *recipient) const;
     void setSessionConnection(Session *session, RemoteClientConnection *connection);
 
 protected:
@@ -9,27 +9,104 @@
 #include <QCryptographicHash>
 #include <QLoggingCategory>
 
+#include <algorithm>
+#include <iterator>
+
 namespace Telegram {
 
 namespace Server {
 
-quint32 PostBox::addMessage(quint64 globalId)
+quint32 PostBox::addMessage(quint64 globalId, const Peer &dialogPeer)
 {
+    const quint32 index = m_lastMessageId;
     ++m_lastMessageId;
     ++m_pts;
 
-    m_messages.insert(m_lastMessageId, globalId);
+    if (index % c_messageIndexChunkSize == 0) {
+        m_messageChunks.append(QVector<quint64>());
+        m_messageChunks.last().reserve(c_messageIndexChunkSize);
+    }
+    m_messageChunks.last().append(globalId);
+    // The ids grow monotonically, so appending keeps the dialog index sorted
+    m_dialogMessages[dialogPeer].append(m_lastMessageId);
     return m_lastMessageId;
 }
 
 quint64 PostBox::getMessageGlobalId(quint32 messageId) const
 {
-    return m_messages.value(messageId);
+    if ((messageId == 0) || (messageId > m_lastMessageId)) {
+        return 0;
+    }
+    const quint32 index = messageId - 1;
+    return m_messageChunks.at(index / c_messageIndexChunkSize).at(index % c_messageIndexChunkSize);
+}
+
+QVector<quint32> PostBox::getDialogMessageIds(const Peer &dialogPeer) const
+{
+    return m_dialogMessages.value(dialogPeer);
+}
+
+static bool updatePtsLessThan(const UpdateNotification &notification, quint32 pts)
+{
+    return notification.pts < pts;
+}
+
+static bool ptsLessThanUpdate(quint32 pts, const UpdateNotification &notification)
+{
+    return pts < notification.pts;
+}
+
+void PostBox::addUpdate(const UpdateNotification &notification)
+{
+    if (!notification.pts) {
+        return;
+    }
+    if (m_updatesJournal.isEmpty()) {
+        m_journalStartPts = notification.pts - 1;
+    } else if (m_updatesJournal.count() >= c_updatesJournalLimit) {
+        const int dropCount = c_updatesJournalLimit / 2;
+        m_journalStartPts = m_updatesJournal.at(dropCount - 1).pts;
+        m_updatesJournal.remove(0, dropCount);
+    }
+
+    UpdateNotification journalEntry = notification;
+    // The journal outlives the sessions and the notification batches
+    journalEntry.excludeSession = nullptr;
+    journalEntry.joinWithNext = false;
+
+    if (m_updatesJournal.isEmpty() || (m_updatesJournal.constLast().pts <= journalEntry.pts)) {
+        m_updatesJournal.append(journalEntry);
+        return;
+    }
+    const auto it = std::upper_bound(m_updatesJournal.constBegin(), m_updatesJournal.constEnd(),
+                                     journalEntry.pts, ptsLessThanUpdate);
+    m_updatesJournal.insert(static_cast<int>(it - m_updatesJournal.constBegin()), journalEntry);
+}
+
+/*!
+  Returns the pts since which the journal has all the recorded box updates.
+*/
+quint32 PostBox::journalStartPts() const
+{
+    if (m_updatesJournal.isEmpty()) {
+        return m_pts;
+    }
+    return m_journalStartPts;
 }
 
-QHash<quint32, quint64> PostBox::getAllMessageKeys() const
+/*!
+  Returns up to \a limit journal updates with pts greater than \a afterPts.
+*/
+QVector<UpdateNotification> PostBox::getUpdates(quint32 afterPts, int limit) const
 {
-    return m_messages;
+    const auto begin = std::lower_bound(m_updatesJournal.constBegin(), m_updatesJournal.constEnd(),
+                                        afterPts + 1, updatePtsLessThan);
+    const int available = static_cast<int>(m_updatesJournal.constEnd() - begin);
+    const int count = qMin(available, limit);
+    QVector<UpdateNotification> result;
+    result.reserve(count);
+    std::copy(begin, begin + count, std::back_inserter(result));
+    return result;
 }
 
 TLPeer MessageRecipient::toTLPeer() const
@@ -206,6 +283,7 @@ void LocalUser::importContact(const UserContact &contact)
 
     if (contact.id) {
         m_contactList.append(contact.id);
+        addWatcher(contact.id);
     }
 }
 
@@ -221,52 +299,107 @@ UserDialog *LocalUser::ensureDialog(const Telegram::Peer &peer)
     if (!dialog) {
         dialog = new UserDialog();
         dialog->peer = peer;
-        m_dialogs.append(dialog);
+        m_dialogs.insert(peer, dialog);
+        m_dialogsOrder.insert(DialogOrderKey(dialog), dialog);
+        if (peer.type() == Peer::User) {
+            addWatcher(peer.id());
+        }
     }
     return dialog;
 }
 
+void LocalUser::addWatcher(quint32 userId)
+{
+    if (!userId) {
+        return;
+    }
+    const auto it = std::lower_bound(m_watchers.begin(), m_watchers.end(), userId);
+    if ((it != m_watchers.end()) && (*it == userId)) {
+        return;
+    }
+    m_watchers.insert(it, userId);
+}
+
 void LocalUser::addNewMessage(const Peer &peer, quint32 messageId, quint64 messageDate)
 {
     UserDialog *dialog = ensureDialog(peer);
     dialog->topMessage = messageId;
-    dialog->date = messageDate;
-
-    syncDialogsOrder();
+    if (dialog->date != messageDate) {
+        // Move the dialog to the new position
+        m_dialogsOrder.remove(DialogOrderKey(dialog));
+        dialog->date = messageDate;
+        m_dialogsOrder.insert(DialogOrderKey(dialog), dialog);
+    }
 }
 
 UserDialog *LocalUser::getDialog(const Peer &peer)
 {
-    for (int i = 0; i < m_dialogs.count(); ++i) {
-        if (m_dialogs.at(i)->peer == peer) {
-            return m_dialogs.at(i);
-        }
-    }
-    return nullptr;
+    return m_dialogs.value(peer);
 }
 
 const UserDialog *LocalUser::getDialog(const Peer &peer) const
 {
-    for (int i = 0; i < m_dialogs.count(); ++i) {
-        if (m_dialogs.at(i)->peer == peer) {
-            return m_dialogs.at(i);
-        }
+    return m_dialogs.value(peer);
+}
+
+QVector<UserDialog *> LocalUser::getDialogsAfter(const UserDialog *dialog, int limit) const
+{
+    if (!dialog) {
+        return getDialogs(m_dialogsOrder.constBegin(), limit);
     }
-    return nullptr;
+    DialogsOrder::const_iterator it = m_dialogsOrder.constFind(DialogOrderKey(dialog));
+    if (it == m_dialogsOrder.constEnd()) {
+        return {};
+    }
+    return getDialogs(++it, limit);
 }
 
-void LocalUser::syncDialogsOrder()
+QVector<UserDialog *> LocalUser::getDialogsBefore(quint64 date, int limit) const
 {
-    std::sort(m_dialogs.begin(), m_dialogs.end(), [](const UserDialog *left, const UserDialog *right) -> bool {
-        // return true if the first arg should be placed before the second one
-        return left->date > right->date;
-    });
+    // The peer of the key is the smallest one, so the bound is the first dialog with the date
+    return getDialogs(m_dialogsOrder.lowerBound(DialogOrderKey(date, Peer())), limit);
+}
+
+QVector<UserDialog *> LocalUser::getDialogs(DialogsOrder::const_iterator from, int limit) const
+{
+    QVector<UserDialog *> result;
+    result.reserve(qMin(limit, m_dialogs.count()));
+    for (DialogsOrder::const_iterator it = from; (it != m_dialogsOrder.constEnd()) && (result.count() < limit); ++it) {
+        result.append(it.value());
+    }
+    return result;
+}
+
+LocalUser::DialogOrderKey::DialogOrderKey(const UserDialog *dialog)
+    : date(dialog->date)
+    , peer(dialog->peer)
+{
+}
+
+LocalUser::DialogOrderKey::DialogOrderKey(quint64 date, const Peer &peer)
+    : date(date)
+    , peer(peer)
+{
+}
+
+bool LocalUser::DialogOrderKey::operator<(const DialogOrderKey &another) const
+{
+    // The newer dialogs go first
+    if (date != another.date) {
+        return date > another.date;
+    }
+    if (peer.type() != another.peer.type()) {
+        return peer.type() < another.peer.type();
+    }
+    return peer.id() < another.peer.id();
 }
 
 void LocalUser::setUserId(quint32 userId)
 {
     m_id = userId;
     m_box.setUserId(m_id);
+    // Any user is interesting in themself
+    addWatcher(m_id);
 }
 
 void UserPostBox::setUnreadCount(quint32 count)
@@ -4,6 +4,7 @@
 #include <QObject>
 #include <QVector>
 #include <QHash>
+#include <QMap>
 
 #include "ServerNamespace.hpp"
 #include "MTProto/TLTypes.hpp"
@@ -30,16 +31,33 @@ public:
     quint32 lastMessageId() const { return m_lastMessageId; }
     virtual QVector<quint32> users() const = 0;
 
-    quint32 addMessage(quint64 globalId);
+    quint32 addMessage(quint64 globalId, const Peer &dialogPeer);
     quint64 getMessageGlobalId(quint32 messageId) const;
 
-    QHash<quint32,quint64> getAllMessageKeys() const;
+    // Returns ids of the dialog messages in the ascending order
+    QVector<quint32> getDialogMessageIds(const Peer &dialogPeer) const;
+
+    // The updates journal (see updates.getDifference)
+    void addUpdate(const UpdateNotification &notification);
+    quint32 journalStartPts() const;
+    QVector<UpdateNotification> getUpdates(quint32 afterPts, int limit) const;
 
 protected:
+    // The box message ids are sequential, so the messageId to MessageData object id
+    // index is a chunked array addressed by (messageId - 1).
+    static constexpr int c_messageIndexChunkSize = 1024;
+
     Peer m_peer;
     quint32 m_pts = 0;
     quint32 m_lastMessageId = 0;
-    QHash<quint32,quint64> m_messages; // messageId to MessageData object id
+    QVector<QVector<quint64>> m_messageChunks;
+    QHash<Peer, QVector<quint32>> m_dialogMessages; // dialog peer to sorted message ids
+
+    // The last updates ordered by pts. The journal is bounded and the oldest half
+    // is dropped on overflow; the updates before journalStartPts() can not be restored.
+    static constexpr int c_updatesJournalLimit = 4096;
+    QVector<UpdateNotification> m_updatesJournal;
+    quint32 m_journalStartPts = 0;
 };
 
 class UserPostBox : public PostBox
@@ -170,18 +188,39 @@ public:
 
     void importContact(const UserContact &contact);
     QVector<quint32> contactList() const override { return m_contactList; }
-    const QVector<UserDialog *> dialogs() const { return m_dialogs; }
+    // Returns all dialogs ordered from the newest to the oldest
+    QVector<UserDialog *> dialogs() const { return getDialogs(m_dialogsOrder.constBegin(), m_dialogs.count()); }
+    int dialogsCount() const { return m_dialogs.count(); }
+    // Return up to limit dialogs (ordered from the newest to the oldest) that follow the given
+    // dialog (or the first ones if the dialog is nullptr) or have the date less or equal to the given one
+    QVector<UserDialog *> getDialogsAfter(const UserDialog *dialog, int limit) const;
+    QVector<UserDialog *> getDialogsBefore(quint64 date, int limit) const;
 
     QVector<UserContact> importedContacts() const { return m_importedContacts; }
+    // Returns the sorted ids of users interested in the user info and status updates
+    QVector<quint32> watchers() const { return m_watchers; }
 
     void bumpDialogUnreadCount(const Telegram::Peer &peer);
     void addNewMessage(const Telegram::Peer &peer, quint32 messageId, quint64 messageDate);
     UserDialog *getDialog(const Telegram::Peer &peer);
     const UserDialog *getDialog(const Telegram::Peer &peer) const;
-    void syncDialogsOrder();
 
 protected:
+    struct DialogOrderKey {
+        DialogOrderKey() = default;
+        explicit DialogOrderKey(const UserDialog *dialog);
+        DialogOrderKey(quint64 date, const Telegram::Peer &peer);
+
+        bool operator<(const DialogOrderKey &another) const;
+
+        quint64 date = 0;
+        Telegram::Peer peer;
+    };
+    using DialogsOrder = QMap<DialogOrderKey, UserDialog *>;
+
     UserDialog *ensureDialog(const Telegram::Peer &peer);
+    void addWatcher(quint32 userId);
+    QVector<UserDialog *> getDialogs(DialogsOrder::const_iterator from, int limit) const;
     void setUserId(quint32 userId);
 
     UserPostBox m_box;
@@ -195,9 +234,11 @@ protected:
     QByteArray m_passwordHash;
     QVector<ImageDescriptor> m_photos;
 
-    QVector<UserDialog *> m_dialogs;
+    QHash<Telegram::Peer, UserDialog *> m_dialogs;
+    DialogsOrder m_dialogsOrder; // From the newest to the oldest dialog
     QVector<quint32> m_contactList; // Contains only registered users from the added contacts
     QVector<UserContact> m_importedContacts; // Contains phone + name of all added contacts (including not registered yet)
+    QVector<quint32> m_watchers; // Sorted ids of the user itself, the registered contacts and the user dialog peers
 
     quint32 m_onlineTimestamp = 0;
 };
@@ -33,6 +33,7 @@
 
 #include "Operations/ClientAuthOperation.hpp"
 #include "Operations/FileOperation.hpp"
+#include "Operations/FileOperation_p.hpp"
 #include "Operations/PendingContactsOperation.hpp"
 
 // Server
@@ -55,8 +56,11 @@
 
 #include <QCryptographicHash>
 #include <QDebug>
+#include <QDir>
+#include <QFileInfo>
 #include <QRegularExpression>
 #include <QSignalSpy>
+#include <QTemporaryDir>
 #include <QTest>
 
 using namespace Telegram;
@@ -64,6 +68,13 @@ using namespace Telegram;
 static const UserData c_user1 = mkUserData(1000, 1);
 static const UserData c_user2 = mkUserData(2000, 1);
 
+class TestMediaService : public Server::MediaService
+{
+public:
+    using Server::MediaService::getDescriptorsFileName;
+    using Server::MediaService::storeFileDescriptor;
+};
+
 class tst_FilesApi : public QObject
 {
     Q_OBJECT
@@ -77,6 +88,14 @@ private slots:
     void getSelfAvatar();
     void getDialogListPictures();
     void downloadMultipartFile();
+    void downloadWithConnectionLoss();
+    void downloadThroughput();
+    void uploadFile_data();
+    void uploadFile();
+    void uploadInvalidParts();
+    void uploadManyFiles();
+    void compactFileDescriptors();
+    void downloadCache();
 
 protected:
     Server::UploadDescriptor uploadFile(Server::AbstractServerApi *server);
@@ -376,7 +395,8 @@ void tst_FilesApi::downloadMultipartFile()
         QCOMPARE(data.size(), totalSize);
     }
 
-    QCOMPARE(user->activeSessions().count(), 2);
+    // The main connection and two media connections
+    TRY_COMPARE(user->activeSessions().count(), 3);
     Server::Session *activeMediaSession = user->activeSessions().last();
     QVERIFY(activeMediaSession);
     Telegram::BaseTransport *serverSideTransport = activeMediaSession->getConnection()->transport();
@@ -408,6 +428,526 @@ void tst_FilesApi::downloadMultipartFile()
     }
 }
 
+void tst_FilesApi::downloadWithConnectionLoss()
+{
+    // Generic test data
+    const UserData user1Data = c_user1;
+    const DcOption clientDcOption = c_localDcOptions.first();
+    const RsaKey publicKey = RsaKey::fromFile(TestKeyData::publicKeyFileName());
+    const RsaKey privateKey = RsaKey::fromFile(TestKeyData::privateKeyFileName());
+
+    const int partsCount = 64;
+    const int partSize = 64 * 1024;
+    const int totalSize = partsCount * partSize;
+
+    // Prepare the server
+    Test::AuthProvider authProvider;
+    Telegram::Server::LocalCluster cluster;
+    cluster.setAuthorizationProvider(&authProvider);
+    cluster.setServerPrivateRsaKey(privateKey);
+    cluster.setServerConfiguration(c_localDcConfiguration);
+    QVERIFY(cluster.start());
+
+    Server::LocalUser *user = tryAddUser(&cluster, user1Data);
+    QVERIFY(user);
+
+    // Random data to detect misplaced chunks
+    const QByteArray fileData = Telegram::RandomGenerator::instance()->generate(totalSize);
+    QString clientFileId;
+    {
+        Server::AbstractServerApi *server = cluster.getServerApiInstance(user->dcId());
+        QVERIFY(server);
+
+        quint64 fileId;
+        Telegram::RandomGenerator::instance()->generate(&fileId);
+        Telegram::Server::IMediaService *mediaService = server->mediaService();
+        for (int filePartId = 0; filePartId < partsCount; ++filePartId) {
+            QVERIFY(mediaService->uploadFilePart(fileId, filePartId, fileData.mid(filePartId * partSize, partSize)));
+        }
+
+        const Telegram::Server::UploadDescriptor upload = mediaService->getUploadedData(fileId);
+        const Telegram::Server::FileDescriptor fileDescriptor = mediaService->saveDocumentFile(upload, QLatin1String("random.bin"), QLatin1String("bin"));
+        QVERIFY(fileDescriptor.isValid());
+
+        FileInfo clientFileInfo;
+        {
+            TLFileLocation location;
+            Telegram::Server::Utils::setupTLFileLocation(&location, fileDescriptor);
+            FileInfo::Private *p = FileInfo::Private::get(&clientFileInfo);
+            p->setFileLocation(&location);
+            p->m_size = fileDescriptor.size;
+            p->m_name = fileDescriptor.name;
+        }
+        clientFileId = clientFileInfo.getFileId();
+    }
+
+    // Prepare clients
+    Client::Client client1;
+    {
+        Test::setupClientHelper(&client1, user1Data, publicKey, clientDcOption);
+        Client::AuthOperation *signInOperation1 = nullptr;
+        Test::signInHelper(&client1, user1Data, &authProvider, &signInOperation1);
+        TRY_VERIFY2(signInOperation1->isSucceeded(), "Unexpected sign in fail");
+    }
+    TRY_VERIFY(client1.isSignedIn());
+
+    // Drop a media connection once the first chunk is received, while the next chunks are in flight
+    Client::FileOperation *fileOp = client1.filesApi()->downloadFile(clientFileId);
+    int maxChunksInFlight = 0;
+    bool connectionDropped = false;
+    connect(fileOp, &Client::FileOperation::bytesTransferredChanged, this, [&]() {
+        const Client::FileOperationPrivate *privOperation = Client::FileOperationPrivate::get(fileOp);
+        maxChunksInFlight = qMax(maxChunksInFlight, privOperation->m_chunksInFlight);
+        if (connectionDropped || (user->activeSessions().count() < 2)) {
+            return;
+        }
+        connectionDropped = true;
+        Server::Session *mediaSession = user->activeSessions().last();
+        mediaSession->getConnection()->transport()->disconnectFromHost();
+    });
+
+    TRY_VERIFY(fileOp->isFinished());
+    QVERIFY(connectionDropped);
+    QVERIFY2(maxChunksInFlight > 1, "The chunks are expected to be requested in parallel");
+    if (!fileOp->isSucceeded()) {
+        qWarning() << fileOp->errorDetails();
+    }
+    QVERIFY(fileOp->isSucceeded());
+    QCOMPARE(fileOp->bytesTransferred(), static_cast<quint32>(totalSize));
+    const QByteArray data = fileOp->device()->readAll();
+    QCOMPARE(data.size(), totalSize);
+    QVERIFY(data == fileData);
+}
+
+void tst_FilesApi::downloadThroughput()
+{
+    // Generic test data
+    const UserData user1Data = c_user1;
+    const DcOption clientDcOption = c_localDcOptions.first();
+    const RsaKey publicKey = RsaKey::fromFile(TestKeyData::publicKeyFileName());
+    const RsaKey privateKey = RsaKey::fromFile(TestKeyData::privateKeyFileName());
+
+    const int partsCount = 16;
+    const int partSize = 512 * 1024;
+    const int totalSize = partsCount * partSize;
+
+    // Prepare the server
+    Test::AuthProvider authProvider;
+    Telegram::Server::LocalCluster cluster;
+    cluster.setAuthorizationProvider(&authProvider);
+    cluster.setServerPrivateRsaKey(privateKey);
+    cluster.setServerConfiguration(c_localDcConfiguration);
+    QVERIFY(cluster.start());
+
+    Server::LocalUser *user = tryAddUser(&cluster, user1Data);
+    QVERIFY(user);
+
+    QByteArray fileHash;
+    QString clientFileId;
+    // Upload a big file (in the reverse order of parts)
+    {
+        Server::AbstractServerApi *server = cluster.getServerApiInstance(user->dcId());
+        QVERIFY(server);
+
+        const QByteArray fileData = Telegram::RandomGenerator::instance()->generate(totalSize);
+        fileHash = QCryptographicHash::hash(fileData, QCryptographicHash::Md5);
+
+        quint64 fileId;
+        Telegram::RandomGenerator::instance()->generate(&fileId);
+        Telegram::Server::IMediaService *mediaService = server->mediaService();
+        for (int filePartId = partsCount - 1; filePartId >= 0; --filePartId) {
+            QVERIFY(mediaService->uploadBigFilePart(fileId, filePartId, partsCount,
+                                                    fileData.mid(filePartId * partSize, partSize)));
+        }
+
+        const Telegram::Server::UploadDescriptor upload = mediaService->getUploadedData(fileId);
+        QVERIFY(upload.isComplete());
+        const Telegram::Server::FileDescriptor fileDescriptor = mediaService->saveDocumentFile(upload, QLatin1String("random.bin"), QLatin1String("bin"));
+        QVERIFY(fileDescriptor.isValid());
+        QCOMPARE(fileDescriptor.size, static_cast<quint32>(totalSize));
+
+        FileInfo clientFileInfo;
+        {
+            TLFileLocation location;
+            Telegram::Server::Utils::setupTLFileLocation(&location, fileDescriptor);
+            FileInfo::Private *p = FileInfo::Private::get(&clientFileInfo);
+            p->setFileLocation(&location);
+            p->m_size = fileDescriptor.size;
+            p->m_name = fileDescriptor.name;
+        }
+        clientFileId = clientFileInfo.getFileId();
+    }
+
+    // Prepare clients
+    Client::Client client1;
+    {
+        Test::setupClientHelper(&client1, user1Data, publicKey, clientDcOption);
+        Client::AuthOperation *signInOperation1 = nullptr;
+        Test::signInHelper(&client1, user1Data, &authProvider, &signInOperation1);
+        TRY_VERIFY2(signInOperation1->isSucceeded(), "Unexpected sign in fail");
+    }
+    TRY_VERIFY(client1.isSignedIn());
+
+    QByteArray data;
+    QBENCHMARK {
+        Client::FileOperation *fileOp = client1.filesApi()->downloadFile(clientFileId);
+        TRY_VERIFY(fileOp->isFinished());
+        QVERIFY(fileOp->isSucceeded());
+        QVERIFY(fileOp->device());
+        data = fileOp->device()->readAll();
+    }
+    QCOMPARE(data.size(), totalSize);
+    QCOMPARE(QCryptographicHash::hash(data, QCryptographicHash::Md5), fileHash);
+}
+
+void tst_FilesApi::uploadFile_data()
+{
+    QTest::addColumn<int>("fileSize");
+    QTest::addColumn<bool>("fromDevice");
+    QTest::newRow("Single part") << 1000 << false;
+    QTest::newRow("Small file") << 300 * 1024 + 7 << false;
+    QTest::newRow("Small file (from device)") << 300 * 1024 + 7 << true;
+    QTest::newRow("Big file (from device)") << 10 * 1024 * 1024 + 100 * 1024 + 3 << true;
+}
+
+void tst_FilesApi::uploadFile()
+{
+    QFETCH(int, fileSize);
+    QFETCH(bool, fromDevice);
+
+    // Generic test data
+    const UserData user1Data = c_user1;
+    const DcOption clientDcOption = c_localDcOptions.first();
+    const RsaKey publicKey = RsaKey::fromFile(TestKeyData::publicKeyFileName());
+    const RsaKey privateKey = RsaKey::fromFile(TestKeyData::privateKeyFileName());
+
+    const QByteArray fileData = Telegram::RandomGenerator::instance()->generate(fileSize);
+    const QByteArray fileHash = QCryptographicHash::hash(fileData, QCryptographicHash::Md5);
+
+    // Prepare the server
+    Test::AuthProvider authProvider;
+    Telegram::Server::LocalCluster cluster;
+    cluster.setAuthorizationProvider(&authProvider);
+    cluster.setServerPrivateRsaKey(privateKey);
+    cluster.setServerConfiguration(c_localDcConfiguration);
+    QVERIFY(cluster.start());
+
+    Server::LocalUser *user = tryAddUser(&cluster, user1Data);
+    QVERIFY(user);
+
+    // Prepare clients
+    Client::Client client1;
+    {
+        Test::setupClientHelper(&client1, user1Data, publicKey, clientDcOption);
+        Client::AuthOperation *signInOperation1 = nullptr;
+        Test::signInHelper(&client1, user1Data, &authProvider, &signInOperation1);
+        TRY_VERIFY2(signInOperation1->isSucceeded(), "Unexpected sign in fail");
+    }
+    TRY_VERIFY(client1.isSignedIn());
+
+    QBuffer source;
+    Client::FileOperation *fileOp = nullptr;
+    if (fromDevice) {
+        source.setData(fileData);
+        source.open(QIODevice::ReadOnly);
+        fileOp = client1.filesApi()->uploadFile(&source, QLatin1String("random.bin"));
+    } else {
+        fileOp = client1.filesApi()->uploadFile(fileData, QLatin1String("random.bin"));
+    }
+    QVERIFY(fileOp);
+    QSignalSpy progressSpy(fileOp, &Client::FileOperation::bytesTransferredChanged);
+    QCOMPARE(fileOp->totalBytes(), static_cast<quint32>(fileSize));
+
+    quint32 totalUploaded = 0;
+    forever {
+        TRY_VERIFY(fileOp->isFinished() || (totalUploaded != fileOp->bytesTransferred()));
+        totalUploaded = fileOp->bytesTransferred();
+        if (fileOp->isFinished()) {
+            break;
+        }
+    }
+    if (!fileOp->isSucceeded()) {
+        qWarning() << fileOp->errorDetails();
+    }
+    QVERIFY(fileOp->isSucceeded());
+    QCOMPARE(fileOp->bytesTransferred(), static_cast<quint32>(fileSize));
+    QVERIFY(!progressSpy.isEmpty());
+    QCOMPARE(progressSpy.last().first().toUInt(), static_cast<quint32>(fileSize));
+
+    QVERIFY(fileOp->fileInfo()->isValid());
+    const FileInfo::Private *uploadedFile = FileInfo::Private::get(fileOp->fileInfo());
+    const TLInputFile inputFile = uploadedFile->getInputFile();
+    const bool bigFile = fileSize > 10 * 1024 * 1024;
+    QVERIFY(inputFile.tlType == (bigFile ? TLValue::InputFileBig : TLValue::InputFile));
+    QCOMPARE(inputFile.name, QLatin1String("random.bin"));
+    if (!bigFile) {
+        QCOMPARE(inputFile.md5Checksum, QString::fromLatin1(fileHash.toHex()));
+    }
+
+    // Check the data received by the server
+    Server::AbstractServerApi *server = cluster.getServerApiInstance(user->dcId());
+    QVERIFY(server);
+    Telegram::Server::IMediaService *mediaService = server->mediaService();
+    const Telegram::Server::UploadDescriptor upload = mediaService->getUploadedData(inputFile.id);
+    QVERIFY(upload.isComplete());
+    QCOMPARE(upload.size, static_cast<quint64>(fileSize));
+    QCOMPARE(static_cast<quint32>(upload.parts.size()), inputFile.parts);
+
+    const Telegram::Server::FileDescriptor fileDescriptor = mediaService->saveDocumentFile(upload, inputFile.name, QLatin1String("bin"));
+    QVERIFY(fileDescriptor.isValid());
+    QByteArray serverData;
+    QVERIFY(mediaService->readFileChunk(fileDescriptor, 0, static_cast<quint32>(fileSize), &serverData));
+    QCOMPARE(QCryptographicHash::hash(serverData, QCryptographicHash::Md5), fileHash);
+}
+
+void tst_FilesApi::uploadInvalidParts()
+{
+    Server::MediaService mediaService;
+    mediaService.setDcId(1);
+
+    quint64 fileId;
+    Telegram::RandomGenerator::instance()->generate(&fileId);
+    const QByteArray part(1024 * 32, 'a');
+
+    // Out of the parts limit
+    QVERIFY(!mediaService.uploadFilePart(fileId, 4000, part));
+    QVERIFY(!mediaService.uploadFilePart(fileId, 0xffffffff, part));
+    QVERIFY(!mediaService.uploadBigFilePart(fileId, 0, 4001, part));
+    // Too big part
+    QVERIFY(!mediaService.uploadFilePart(fileId, 0, QByteArray(512 * 1024 + 1024, 'a')));
+    QVERIFY(!mediaService.getUploadedData(fileId).fileId);
+
+    QVERIFY(mediaService.uploadFilePart(fileId, 0, part));
+    QVERIFY(mediaService.uploadFilePart(fileId, 2, part));
+    // Only the last part can be not aligned to 1 KiB
+    QVERIFY(!mediaService.uploadFilePart(fileId, 1, part.left(1000)));
+    QVERIFY(mediaService.uploadFilePart(fileId, 3, part.left(1000)));
+    QVERIFY(mediaService.uploadFilePart(fileId, 1, part));
+
+    const Server::UploadDescriptor upload = mediaService.getUploadedData(fileId);
+    QVERIFY(upload.isComplete());
+    QCOMPARE(upload.size, static_cast<quint64>(part.size() * 3 + 1000));
+    mediaService.freeUploadedData(static_cast<qint64>(fileId));
+
+    quint64 bigFileId;
+    Telegram::RandomGenerator::instance()->generate(&bigFileId);
+    QVERIFY(!mediaService.uploadBigFilePart(bigFileId, 0, 2, part.left(1000)));
+    QVERIFY(mediaService.uploadBigFilePart(bigFileId, 1, 2, part.left(1000)));
+    QVERIFY(mediaService.uploadBigFilePart(bigFileId, 0, 2, part));
+    QVERIFY(mediaService.getUploadedData(bigFileId).isComplete());
+    mediaService.freeUploadedData(static_cast<qint64>(bigFileId));
+}
+
+void tst_FilesApi::uploadManyFiles()
+{
+    QTemporaryDir storageDir;
+    QVERIFY(storageDir.isValid());
+    const QString workingDir = QDir::currentPath();
+    QVERIFY(QDir::setCurrent(storageDir.path()));
+
+    // An upload file left by a previous run
+    const QString staleFileName = QStringLiteral("storage1/uploads/12345");
+    QVERIFY(QDir().mkpath(QFileInfo(staleFileName).path()));
+    {
+        QFile staleFile(staleFileName);
+        QVERIFY(staleFile.open(QIODevice::WriteOnly));
+        staleFile.write(QByteArray(1024, 's'));
+    }
+
+    Server::MediaService mediaService;
+    mediaService.setDcId(1);
+    QVERIFY(!QFile::exists(staleFileName));
+
+    // More uploads than the opened upload files limit, with interleaved parts
+    constexpr int c_uploadsCount = 100;
+    const QByteArray part(1024, 'a');
+    QVector<quint64> fileIds;
+    for (int i = 0; i < c_uploadsCount; ++i) {
+        quint64 fileId;
+        Telegram::RandomGenerator::instance()->generate(&fileId);
+        fileIds.append(fileId);
+        QVERIFY(mediaService.uploadFilePart(fileId, 0, part));
+    }
+    for (int i = 0; i < c_uploadsCount; ++i) {
+        QVERIFY(mediaService.uploadFilePart(fileIds.at(i), 1, QByteArray(i + 1, char('0' + i % 10))));
+    }
+    for (int i = 0; i < c_uploadsCount; ++i) {
+        const Server::UploadDescriptor upload = mediaService.getUploadedData(fileIds.at(i));
+        QVERIFY(upload.isComplete());
+        QCOMPARE(upload.size, static_cast<quint64>(part.size() + i + 1));
+        QVERIFY(upload.lastPartDate);
+        QVERIFY(QFile::exists(upload.fileName));
+        mediaService.freeUploadedData(static_cast<qint64>(fileIds.at(i)));
+        QVERIFY(!QFile::exists(upload.fileName));
+    }
+
+    QVERIFY(QDir::setCurrent(workingDir));
+}
+
+void tst_FilesApi::compactFileDescriptors()
+{
+    QTemporaryDir storageDir;
+    QVERIFY(storageDir.isValid());
+    const QString workingDir = QDir::currentPath();
+    QVERIFY(QDir::setCurrent(storageDir.path()));
+
+    Server::FileDescriptor descriptor1;
+    descriptor1.volumeId = 1;
+    descriptor1.localId = 1;
+    descriptor1.dcId = 1;
+    descriptor1.id = 0x1001;
+    descriptor1.accessHash = 0xaaaa;
+    descriptor1.name = QStringLiteral("first");
+    Server::FileDescriptor descriptor2 = descriptor1;
+    descriptor2.localId = 2;
+    descriptor2.id = 0x1002;
+    descriptor2.name = QStringLiteral("second");
+
+    QString descriptorsFileName;
+    {
+        TestMediaService mediaService;
+        mediaService.setDcId(1);
+        descriptorsFileName = mediaService.getDescriptorsFileName(descriptor1.volumeId);
+        QVERIFY(QDir().mkpath(QFileInfo(descriptorsFileName).path()));
+        QVERIFY(mediaService.storeFileDescriptor(descriptor1));
+        QVERIFY(mediaService.storeFileDescriptor(descriptor2));
+        descriptor1.name = QStringLiteral("renamed");
+        descriptor1.mimeType = QStringLiteral("text/plain");
+        QVERIFY(mediaService.storeFileDescriptor(descriptor1));
+    }
+    const qint64 logSize = QFileInfo(descriptorsFileName).size();
+
+    // The superseded record is dropped on load
+    for (int i = 0; i < 2; ++i) {
+        TestMediaService mediaService;
+        mediaService.setDcId(1);
+        const Server::FileDescriptor loaded1 = mediaService.getDocumentFileDescriptor(descriptor1.id,
+                                                                                    descriptor1.accessHash);
+        QCOMPARE(loaded1.localId, descriptor1.localId);
+        QCOMPARE(loaded1.name, descriptor1.name);
+        QCOMPARE(loaded1.mimeType, descriptor1.mimeType);
+        const Server::FileDescriptor loaded2 = mediaService.getDocumentFileDescriptor(descriptor2.id,
+                                                                                    descriptor2.accessHash);
+        QCOMPARE(loaded2.localId, descriptor2.localId);
+        QCOMPARE(loaded2.name, descriptor2.name);
+        QVERIFY(QFileInfo(descriptorsFileName).size() < logSize);
+    }
+
+    QVERIFY(QDir::setCurrent(workingDir));
+}
+
+void tst_FilesApi::downloadCache()
+{
+    // Generic test data
+    const UserData user1Data = c_user1;
+    const DcOption clientDcOption = c_localDcOptions.first();
+    const RsaKey publicKey = RsaKey::fromFile(TestKeyData::publicKeyFileName());
+    const RsaKey privateKey = RsaKey::fromFile(TestKeyData::privateKeyFileName());
+    const int requestsCount = 5;
+
+    // Prepare the server
+    Test::AuthProvider authProvider;
+    Telegram::Server::LocalCluster cluster;
+    cluster.setAuthorizationProvider(&authProvider);
+    cluster.setServerPrivateRsaKey(privateKey);
+    cluster.setServerConfiguration(c_localDcConfiguration);
+    QVERIFY(cluster.start());
+
+    Server::LocalUser *user1 = tryAddUser(&cluster, user1Data);
+    QVERIFY(user1);
+
+    // Upload an image
+    {
+        Server::AbstractServerApi *server = cluster.getServerApiInstance(user1->dcId());
+        QVERIFY(server);
+        const Server::ImageDescriptor image = uploadUserImage(server);
+        QVERIFY(image.isValid());
+        user1->updateImage(image);
+    }
+
+    // Prepare clients
+    Client::Client client1;
+    {
+        Test::setupClientHelper(&client1, user1Data, publicKey, clientDcOption);
+        Client::AuthOperation *signInOperation1 = nullptr;
+        Test::signInHelper(&client1, user1Data, &authProvider, &signInOperation1);
+        TRY_VERIFY2(signInOperation1->isSucceeded(), "Unexpected sign in fail");
+    }
+    TRY_VERIFY(client1.isSignedIn());
+
+    UserInfo selfUserInfo;
+    client1.dataStorage()->getUserInfo(&selfUserInfo, client1.dataStorage()->selfUserId());
+    FileInfo pictureFile;
+    selfUserInfo.getPeerPicture(&pictureFile, PeerPictureSize::Small);
+    QVERIFY(!pictureFile.getFileId().isEmpty());
+
+    QTemporaryDir cacheDir;
+    QVERIFY(cacheDir.isValid());
+    Client::FilesApi *filesApi = client1.filesApi();
+    filesApi->setCacheDirectory(cacheDir.path());
+    QCOMPARE(filesApi->cacheDirectory(), cacheDir.path());
+
+    // Concurrent requests of the same file
+    QByteArray pictureData;
+    QString pictureMimeType;
+    {
+        QVector<Client::FileOperation *> operations;
+        for (int i = 0; i < requestsCount; ++i) {
+            operations.append(filesApi->downloadFile(pictureFile.getFileId()));
+        }
+        for (Client::FileOperation *fileOp : operations) {
+            TRY_VERIFY(fileOp->isFinished());
+            QVERIFY(fileOp->isSucceeded());
+            QVERIFY(fileOp->device());
+            const QByteArray data = fileOp->device()->readAll();
+            QVERIFY(!data.isEmpty());
+            if (pictureData.isEmpty()) {
+                pictureData = data;
+            }
+            QCOMPARE(data, pictureData);
+            QCOMPARE(fileOp->bytesTransferred(), static_cast<quint32>(pictureData.size()));
+            if (pictureMimeType.isEmpty()) {
+                pictureMimeType = fileOp->fileInfo()->mimeType();
+            }
+            QCOMPARE(fileOp->fileInfo()->mimeType(), pictureMimeType);
+        }
+    }
+    QVERIFY(!pictureMimeType.isEmpty());
+    const QDir dir(cacheDir.path());
+    QCOMPARE(dir.entryList(QDir::Files).count(), 2); // The file and its MIME type
+
+    // The followers take over the download deleted by its caller
+    filesApi->setCacheDirectory(QString());
+    {
+        QVector<Client::FileOperation *> operations;
+        for (int i = 0; i < requestsCount; ++i) {
+            operations.append(filesApi->downloadFile(pictureFile.getFileId()));
+        }
+        delete operations.takeFirst();
+        for (Client::FileOperation *fileOp : operations) {
+            TRY_VERIFY(fileOp->isFinished());
+            QVERIFY(fileOp->isSucceeded());
+            QCOMPARE(fileOp->device()->readAll(), pictureData);
+        }
+    }
+    filesApi->setCacheDirectory(cacheDir.path());
+    QCOMPARE(dir.entryList(QDir::Files).count(), 2);
+
+    // The cached file is available without connection
+    client1.connectionApi()->disconnectFromServer();
+    {
+        Client::FileOperation *fileOp = filesApi->downloadFile(&pictureFile);
+        TRY_VERIFY(fileOp->isFinished());
+        QVERIFY(fileOp->isSucceeded());
+        QCOMPARE(fileOp->device()->readAll(), pictureData);
+        QCOMPARE(fileOp->fileInfo()->mimeType(), pictureMimeType);
+    }
+
+    // LRU budget
+    filesApi->setCacheMaxSize(pictureData.size() - 1);
+    QCOMPARE(dir.entryList(QDir::Files).count(), 0);
+}
+
 QTEST_GUILESS_MAIN(tst_FilesApi)
 
 #include "tst_FilesApi.moc"
@@ -42,6 +42,7 @@
 #include <QTest>
 #include <QSignalSpy>
 #include <QDebug>
+#include <QElapsedTimer>
 #include <QRegularExpression>
 
 #include "keys_data.hpp"
@@ -52,7 +53,11 @@
 #include "TestUtils.hpp"
 
 #ifdef TEST_PRIVATE_API
+#include "ClientBackend.hpp"
+#include "Client_p.hpp"
 #include "DataStorage_p.hpp"
+#include "RpcError.hpp"
+#include "RpcLayers/ClientRpcUpdatesLayer.hpp"
 #endif
 
 using namespace Telegram;
@@ -84,11 +89,15 @@ private slots:
     void getDialogs();
     void getAllDialogs();
     void groupChatMessaging();
+    void groupChatFanOut_data();
+    void groupChatFanOut();
     void sendMessage_data();
     void sendMessage();
     void getHistory_data();
     void getHistory();
     void syncPeerDialogs();
+    void getDifference_data();
+    void getDifference();
     void messageAction();
 };
 
@@ -847,6 +856,132 @@ void tst_MessagesApi::groupChatMessaging()
     client2MessageActionsSpy.clear();
 }
 
+void tst_MessagesApi::groupChatFanOut_data()
+{
+    QTest::addColumn<int>("membersCount");
+    QTest::addColumn<int>("onlineMembersCount");
+
+    QTest::newRow("10 members") << 10 << 9;
+    QTest::newRow("100 members") << 100 << 99;
+    QTest::newRow("1000 members") << 1000 << 250;
+}
+
+void tst_MessagesApi::groupChatFanOut()
+{
+    QFETCH(int, membersCount);
+    QFETCH(int, onlineMembersCount);
+
+    const UserData user1Data = c_user1;
+    const DcOption clientDcOption = c_localDcOptions.first();
+    const RsaKey publicKey = RsaKey::fromFile(TestKeyData::publicKeyFileName());
+    const RsaKey privateKey = RsaKey::fromFile(TestKeyData::privateKeyFileName());
+
+    // Prepare server
+    Test::AuthProvider authProvider;
+    Telegram::Server::LocalCluster cluster;
+    cluster.setAuthorizationProvider(&authProvider);
+    cluster.setServerPrivateRsaKey(privateKey);
+    cluster.setServerConfiguration(c_localDcConfiguration);
+    QVERIFY(cluster.start());
+
+    Server::LocalUser *user1 = tryAddUser(&cluster, user1Data);
+    QVERIFY(user1);
+
+    // The members have different contact relations to the sender
+    // to check the per-recipient patching of the shared updates data:
+    // 0 - mutual contacts, 1 - in the sender contacts, 2 - has the sender in contacts, 3 - no relation
+    QVector<quint32> chatMembers;
+    QVector<UserData> onlineMembersData;
+    for (int i = 1; i < membersCount; ++i) {
+        const UserData memberData = mkUserData(10000 + i, user1Data.dcId);
+        Server::LocalUser *member = tryAddUser(&cluster, memberData);
+        QVERIFY(member);
+        chatMembers.append(member->id());
+        if (onlineMembersData.count() < onlineMembersCount) {
+            const int relation = onlineMembersData.count() % 4;
+            if ((relation == 0) || (relation == 1)) {
+                user1->importContact(member->toContact());
+            }
+            if ((relation == 0) || (relation == 2)) {
+                member->importContact(user1->toContact());
+            }
+            onlineMembersData.append(memberData);
+        }
+    }
+    QCOMPARE(onlineMembersData.count(), onlineMembersCount);
+
+    // Prepare clients
+    Client::Client client1;
+    Test::setupClientHelper(&client1, user1Data, publicKey, clientDcOption);
+    signInHelper(&client1, user1Data, &authProvider);
+    TRY_VERIFY2(client1.isSignedIn(), "Unexpected sign in fail");
+
+    QObject clientsParent;
+    QVector<Client::Client *> memberClients;
+    QVector<quint32> lastReceivedMessageIds(onlineMembersCount);
+    int receivedMessages = 0;
+    for (int i = 0; i < onlineMembersCount; ++i) {
+        const UserData &memberData = onlineMembersData.at(i);
+        Client::Client *client = new Client::Client(&clientsParent);
+        Test::setupClientHelper(client, memberData, publicKey, clientDcOption);
+        signInHelper(client, memberData, &authProvider);
+        memberClients.append(client);
+        connect(client->messagingApi(), &Client::MessagingApi::messageReceived,
+                [&receivedMessages, &lastReceivedMessageIds, i](const Peer &, quint32 messageId) {
+            ++receivedMessages;
+            lastReceivedMessageIds[i] = messageId;
+        });
+    }
+    for (Client::Client *client : memberClients) {
+        TRY_VERIFY2(client->isSignedIn(), "Unexpected sign in fail");
+    }
+
+    QSignalSpy client1MessageReceivedSpy(client1.messagingApi(), &Client::MessagingApi::messageReceived);
+
+    Server::Server *server = cluster.getServerInstance(user1Data.dcId);
+    Server::GroupChat *groupChat = server->createChat(user1, QStringLiteral("Fan-out chat"), chatMembers);
+    QVERIFY(groupChat);
+    const Peer chatPeer = Peer::fromChatId(groupChat->id());
+    server->announceNewChat(chatPeer, nullptr);
+
+    // The chat creation service message
+    TRY_COMPARE(client1MessageReceivedSpy.count(), 1);
+    client1MessageReceivedSpy.clear();
+    TRY_COMPARE(receivedMessages, onlineMembersCount);
+    receivedMessages = 0;
+
+    // Each message is sent after the previous one is delivered to all online members
+    static constexpr int c_messagesCount = 20;
+    const QString c_messageText = QStringLiteral("Hello everyone");
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 1; i <= c_messagesCount; ++i) {
+        client1.messagingApi()->sendMessage(chatPeer, c_messageText);
+        TRY_COMPARE(receivedMessages, onlineMembersCount * i);
+    }
+    const qint64 elapsed = qMax<qint64>(timer.elapsed(), 1);
+    qInfo().nospace() << membersCount << " members (" << onlineMembersCount << " online): "
+                      << qRound64(c_messagesCount * 1000.0 / elapsed) << " messages/sec, "
+                      << qRound64(c_messagesCount * onlineMembersCount * 1000.0 / elapsed) << " deliveries/sec";
+    TRY_COMPARE(client1MessageReceivedSpy.count(), c_messagesCount);
+
+    for (int i = 0; i < memberClients.count(); ++i) {
+        Client::DataStorage *dataStorage = memberClients.at(i)->dataStorage();
+        Telegram::Message message;
+        dataStorage->getMessage(&message, chatPeer, lastReceivedMessageIds.at(i));
+        QCOMPARE(message.text(), c_messageText);
+        QCOMPARE(message.fromUserId(), user1->id());
+        QVERIFY(!(message.flags() & Namespace::MessageFlagOut));
+
+        const int relation = i % 4;
+        Telegram::UserInfo senderInfo;
+        QVERIFY(dataStorage->getUserInfo(&senderInfo, user1->id()));
+        QVERIFY(!senderInfo.isSelf());
+        QCOMPARE(senderInfo.isContact(), (relation == 0) || (relation == 2));
+        QCOMPARE(senderInfo.isMutualContact(), relation == 0);
+    }
+}
+
 void tst_MessagesApi::sendMessage_data()
 {
     QTest::addColumn<UserData>("user1Data");
@@ -1193,6 +1328,128 @@ void tst_MessagesApi::getHistory()
     }
 }
 
+void tst_MessagesApi::getDifference_data()
+{
+    QTest::addColumn<int>("messagesCount");
+    QTest::addColumn<quint32>("ptsTotalLimit");
+    QTest::addColumn<bool>("requestFuturePts");
+    QTest::addColumn<quint32>("expectedType");
+    QTest::addColumn<int>("expectedMessages");
+
+    QTest::newRow("Empty") << 0 << 0u << false
+                           << quint32(TLValue::UpdatesDifferenceEmpty) << 0;
+    QTest::newRow("Difference") << 5 << 0u << false
+                                << quint32(TLValue::UpdatesDifference) << 5;
+    QTest::newRow("Slice") << 150 << 0u << false
+                           << quint32(TLValue::UpdatesDifferenceSlice) << 100;
+    QTest::newRow("TooLong (ptsTotalLimit)") << 20 << 10u << false
+                                             << quint32(TLValue::UpdatesDifferenceTooLong) << 0;
+    // Overflow the updates journal to drop the requested pts
+    QTest::newRow("TooLong (journal)") << 5000 << 0u << false
+                                       << quint32(TLValue::UpdatesDifferenceTooLong) << 0;
+    QTest::newRow("Invalid pts") << 1 << 0u << true
+                                 << quint32(0) << 0;
+}
+
+void tst_MessagesApi::getDifference()
+{
+#ifndef TEST_PRIVATE_API
+    QSKIP("The test needs the private API to call updates.getDifference directly");
+#else
+    QFETCH(int, messagesCount);
+    QFETCH(quint32, ptsTotalLimit);
+    QFETCH(bool, requestFuturePts);
+    QFETCH(quint32, expectedType);
+    QFETCH(int, expectedMessages);
+
+    const UserData user1Data = c_user1;
+    const UserData user2Data = c_user2;
+    const DcOption clientDcOption = c_localDcOptions.first();
+    const RsaKey publicKey = RsaKey::fromFile(TestKeyData::publicKeyFileName());
+    const RsaKey privateKey = RsaKey::fromFile(TestKeyData::privateKeyFileName());
+
+    // Prepare server
+    Test::AuthProvider authProvider;
+    Telegram::Server::LocalCluster cluster;
+    cluster.setAuthorizationProvider(&authProvider);
+    cluster.setServerPrivateRsaKey(privateKey);
+    cluster.setServerConfiguration(c_localDcConfiguration);
+    QVERIFY(cluster.start());
+
+    Server::LocalUser *user1 = tryAddUser(&cluster, user1Data);
+    Server::AbstractUser *user2 = tryAddUser(&cluster, user2Data);
+    QVERIFY(user1 && user2);
+
+    Server::AbstractServerApi *server = cluster.getServerApiInstance(user1Data.dcId);
+    QVERIFY(server);
+
+    // The pts must be not zero to request the difference
+    {
+        Server::MessageData *messageData = server->messageService()->addMessage(
+                    user2->id(), user1->toPeer(), QStringLiteral("Initial message"));
+        cluster.sendMessage(messageData);
+    }
+    const quint32 clientPts = user1->getPostBox()->pts();
+    QVERIFY(clientPts);
+
+    // The messages arrive while the user is offline
+    for (int i = 0; i < messagesCount; ++i) {
+        Server::MessageData *messageData = server->messageService()->addMessage(
+                    user2->id(), user1->toPeer(), QString::number(i + 1));
+        cluster.sendMessage(messageData);
+    }
+    const quint32 serverPts = user1->getPostBox()->pts();
+    QCOMPARE(serverPts, clientPts + static_cast<quint32>(messagesCount));
+
+    // Go online
+    Client::Client client;
+    Test::setupClientHelper(&client, user1Data, publicKey, clientDcOption);
+    signInHelper(&client, user1Data, &authProvider);
+    TRY_VERIFY2(client.isSignedIn(), "Unexpected sign in fail");
+    TRY_COMPARE(client.connectionApi()->status(), Telegram::Client::ConnectionApi::StatusReady);
+
+    Client::UpdatesRpcLayer *updatesLayer = Client::ClientPrivate::get(&client)->updatesLayer();
+    const quint32 flags = ptsTotalLimit ? MTProto::Functions::TLUpdatesGetDifference::PtsTotalLimit : 0;
+    const quint32 requestPts = requestFuturePts ? serverPts + 1 : clientPts;
+    Client::UpdatesRpcLayer::PendingUpdatesDifference *op
+            = updatesLayer->getDifference(flags, requestPts, ptsTotalLimit, 0, 0);
+    TRY_VERIFY(op->isFinished());
+
+    if (requestFuturePts) {
+        QVERIFY(op->isFailed());
+        QVERIFY(op->rpcError());
+        QCOMPARE(op->rpcError()->reason(), RpcError::PersistentTimestampInvalid);
+        return;
+    }
+    QVERIFY(op->isSucceeded());
+
+    TLUpdatesDifference difference;
+    QVERIFY(op->getResult(&difference));
+    QVERIFY(difference.tlType == expectedType);
+    QCOMPARE(difference.newMessages.count(), expectedMessages);
+
+    switch (difference.tlType) {
+    case TLValue::UpdatesDifference:
+        QCOMPARE(difference.state.pts, serverPts);
+        QCOMPARE(difference.newMessages.constLast().message, QString::number(messagesCount));
+        break;
+    case TLValue::UpdatesDifferenceSlice:
+        QCOMPARE(difference.intermediateState.pts, clientPts + static_cast<quint32>(expectedMessages));
+        QCOMPARE(difference.newMessages.constFirst().message, QString::number(1));
+        QCOMPARE(difference.newMessages.constLast().message, QString::number(expectedMessages));
+        break;
+    case TLValue::UpdatesDifferenceTooLong:
+        QCOMPARE(difference.pts, serverPts);
+        if (!ptsTotalLimit) {
+            QVERIFY(user1->getPostBox()->journalStartPts() > clientPts);
+        }
+        break;
+    default:
+        break;
+    }
+#endif // TEST_PRIVATE_API
+}
+
 void tst_MessagesApi::syncPeerDialogs()
 {
     const DcOption clientDcOption = c_localDcOptions.first();
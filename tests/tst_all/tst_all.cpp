@@ -122,6 +122,15 @@ void tst_all::testSignIn_data()
     QTest::newRow("Obfuscated") << Client::Settings::SessionType::Obfuscated
                                 << userOnDc1
                                 << opt;
+    QTest::newRow("Intermediate") << Client::Settings::SessionType::Intermediate
+                                  << userOnDc1
+                                  << opt;
+    QTest::newRow("Padded intermediate") << Client::Settings::SessionType::PaddedIntermediate
+                                         << userOnDc1
+                                         << opt;
+    QTest::newRow("Full size") << Client::Settings::SessionType::FullSize
+                               << userOnDc1
+                               << opt;
     QTest::newRow("Abridged with migration")   << Client::Settings::SessionType::Abridged
                                                << userOnDc2
                                                << opt;
@@ -3,6 +3,7 @@
 
 #include "IMediaService.hpp"
 #include "LocalCluster.hpp"
+#include "PendingOperation.hpp"
 #include "RandomGenerator.hpp"
 #include "ServerApi.hpp"
 #include "TelegramServerUser.hpp"
@@ -10,6 +11,7 @@
 
 #include <QBuffer>
 #include <QDebug>
+#include <QEventLoop>
 #include <QImage>
 
 Telegram::Server::LocalUser *tryAddUser(Telegram::Server::LocalCluster *cluster, const UserData &data)
@@ -49,7 +51,13 @@ Telegram::Server::ImageDescriptor uploadUserImage(Telegram::Server::AbstractServ
     Telegram::Server::IMediaService *mediaService = server->mediaService();
     mediaService->uploadFilePart(fileId, filePartId, pictureData);
     const Telegram::Server::UploadDescriptor desc = mediaService->getUploadedData(fileId);
-    return mediaService->processImageFile(desc, pictureFileName);
+    Telegram::Server::PendingImageOperation *op = mediaService->processImageFile(desc, pictureFileName);
+    if (!op->isFinished()) {
+        QEventLoop loop;
+        QObject::connect(op, &Telegram::PendingOperation::finished, &loop, &QEventLoop::quit);
+        loop.exec();
+    }
+    return op->image();
 }
 
 #endif // TEST_SERVER_UTILS_HPP